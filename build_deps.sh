@@ -8,7 +8,8 @@ cd bullet3/build3
 cd ..
 sed -i 's/\s\+\(printf("unknown chunk\\n")\);/\/\/\1/' */*/*/*.cpp
 cd build3/gmake
-make
+# Threadsafe build for the multithreaded world, the engine is built with the same define
+CPPFLAGS=-DBT_THREADSAFE=1 make
 cd ../../bin
 for i in *.a
 do
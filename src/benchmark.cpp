@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <benchmark.h>
+
+using namespace std;
+
+bool parse_benchmark_options(int argc, char **argv, BenchmarkOptions &options)
+{
+  options.enabled = false;
+  options.frames = 600;
+  options.warmup = 30;
+  options.width = 1280;
+  options.height = 720;
+  options.dumpEvery = 0;
+  options.report = "benchmark.json";
+  options.dumpPrefix = "frame";
+
+  for (int i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+      if (!strcmp(arg, "--benchmark"))
+        {
+          options.enabled = true;
+          if (value && value[0] != '-')
+            {
+              options.frames = atoi(value);
+              i++;
+            }
+        }
+      else if (strcmp(arg, "--size") && strcmp(arg, "--warmup") && strcmp(arg, "--report")
+               && strcmp(arg, "--dump-every") && strcmp(arg, "--dump-prefix"))
+        {
+          printf("Unknown argument %s\n", arg);
+          return false;
+        }
+      else if (!value)
+        {
+          printf("Missing value for %s\n", arg);
+          return false;
+        }
+      else if (!strcmp(arg, "--size"))
+        {
+          if (sscanf(value, "%dx%d", &options.width, &options.height) != 2)
+            {
+              printf("Expected --size WIDTHxHEIGHT, got %s\n", value);
+              return false;
+            }
+          i++;
+        }
+      else if (!strcmp(arg, "--warmup"))
+        options.warmup = atoi(argv[++i]);
+      else if (!strcmp(arg, "--report"))
+        options.report = argv[++i];
+      else if (!strcmp(arg, "--dump-every"))
+        options.dumpEvery = atoi(argv[++i]);
+      else
+        options.dumpPrefix = argv[++i];
+    }
+  return options.frames > 0 && options.warmup >= 0 && options.width > 0 && options.height > 0;
+}
+
+BenchmarkRecorder::BenchmarkRecorder(int _warmup)
+  : warmup(_warmup), frame(0), gpuTimers(GLEW_ARB_timer_query || GLEW_VERSION_3_3)
+{
+  if (gpuTimers)
+    glGenQueries(QUERY_LATENCY, queries);
+  fill(queryFrames, queryFrames + QUERY_LATENCY, -1);
+}
+
+BenchmarkRecorder::~BenchmarkRecorder()
+{
+  if (gpuTimers)
+    glDeleteQueries(QUERY_LATENCY, queries);
+}
+
+void BenchmarkRecorder::beginFrame()
+{
+  start = chrono::steady_clock::now();
+  if (gpuTimers)
+    {
+      int slot = frame % QUERY_LATENCY;
+      collect(slot);
+      glBeginQuery(GL_TIME_ELAPSED, queries[slot]);
+      queryFrames[slot] = frame;
+    }
+}
+
+void BenchmarkRecorder::endFrame(unsigned int frameDrawCalls, unsigned int frameTriangles)
+{
+  if (gpuTimers)
+    glEndQuery(GL_TIME_ELAPSED);
+  // Submit like a buffer swap would, so the measured time includes handing the frame over
+  glFlush();
+  double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  if (frame >= warmup)
+    {
+      cpuTimes.push_back(elapsed);
+      drawCalls.push_back(frameDrawCalls);
+      triangles.push_back(frameTriangles);
+    }
+  frame++;
+}
+
+// Read back a query slot, the result is normally long available after QUERY_LATENCY frames
+void BenchmarkRecorder::collect(int slot)
+{
+  if (queryFrames[slot] < 0)
+    return;
+  GLuint64 nanoseconds = 0;
+  glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &nanoseconds);
+  if (queryFrames[slot] >= warmup)
+    gpuTimes.push_back(nanoseconds / 1e6);
+  queryFrames[slot] = -1;
+}
+
+void BenchmarkRecorder::finish()
+{
+  if (!gpuTimers)
+    return;
+  // Collect in issue order
+  for (int i = 0; i < QUERY_LATENCY; i++)
+    collect((frame + i) % QUERY_LATENCY);
+}
+
+// Nearest rank percentile of sorted samples
+static double percentile(const vector<double> &sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  size_t rank = (size_t) max(1.0, p / 100.0 * sorted.size() + 0.5);
+  return sorted[min(rank, sorted.size()) - 1];
+}
+
+static void write_distribution(FILE *f, const char *name, vector<double> samples, bool last)
+{
+  sort(samples.begin(), samples.end());
+  double sum = 0;
+  for (double s : samples)
+    sum += s;
+  fprintf(f, "  \"%s\": {\"samples\": %lu, \"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, "
+          "\"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}%s\n",
+          name, samples.size(), samples.empty() ? 0 : sum / samples.size(),
+          samples.empty() ? 0 : samples.front(), percentile(samples, 50), percentile(samples, 90),
+          percentile(samples, 95), percentile(samples, 99), samples.empty() ? 0 : samples.back(), last ? "" : ",");
+}
+
+bool BenchmarkRecorder::writeReport(const char *filename, const char *renderer, int width, int height) const
+{
+  FILE *f = fopen(filename, "w");
+  if (!f)
+    {
+      printf("Failed to open %s\n", filename);
+      return false;
+    }
+  string escaped;
+  for (const char *c = renderer; *c; c++)
+    {
+      if (*c == '"' || *c == '\\')
+        escaped += '\\';
+      escaped += *c;
+    }
+
+  vector<double> calls(drawCalls.begin(), drawCalls.end()), tris(triangles.begin(), triangles.end());
+  fprintf(f, "{\n");
+  fprintf(f, "  \"renderer\": \"%s\",\n", escaped.c_str());
+  fprintf(f, "  \"width\": %d,\n  \"height\": %d,\n", width, height);
+  fprintf(f, "  \"frames\": %lu,\n  \"warmup\": %d,\n", cpuTimes.size(), warmup);
+  fprintf(f, "  \"gpu_timer_queries\": %s,\n", gpuTimers ? "true" : "false");
+  write_distribution(f, "cpu_frame_ms", cpuTimes, false);
+  write_distribution(f, "gpu_frame_ms", gpuTimes, false);
+  write_distribution(f, "draw_calls", calls, false);
+  write_distribution(f, "triangles", tris, true);
+  fprintf(f, "}\n");
+  fclose(f);
+  printf("Benchmark report written to %s\n", filename);
+  return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+
+struct BenchmarkOptions
+{
+  bool enabled;
+  // Measured frames, and frames rendered before measuring starts
+  int frames, warmup;
+  int width, height;
+  // Write every dumpEvery-th measured frame to dumpPrefix<frame>.ppm, never when zero
+  int dumpEvery;
+  std::string report, dumpPrefix;
+};
+
+// Parses --benchmark [frames], --size WxH, --warmup N, --report FILE,
+// --dump-every N and --dump-prefix PATH. Returns false on bad arguments
+bool parse_benchmark_options(int argc, char **argv, BenchmarkOptions &options);
+
+/*
+  Collects per-frame timings and counters of a benchmark run and writes them
+  out as a JSON report. GPU time is measured with GL_TIME_ELAPSED queries
+  that are read back several frames late, so recording never stalls the
+  pipeline until finish().
+*/
+class BenchmarkRecorder
+{
+public:
+  BenchmarkRecorder(int warmup);
+  ~BenchmarkRecorder();
+
+  void beginFrame();
+  void endFrame(unsigned int drawCalls, unsigned int triangles);
+  // Wait for the queries still in flight
+  void finish();
+
+  bool writeReport(const char *filename, const char *renderer, int width, int height) const;
+
+private:
+  static const int QUERY_LATENCY = 4;
+
+  void collect(int slot);
+
+  int warmup, frame;
+  bool gpuTimers;
+  GLuint queries[QUERY_LATENCY];
+  // Frame each query slot was issued in, -1 when idle
+  int queryFrames[QUERY_LATENCY];
+  std::chrono::steady_clock::time_point start;
+  std::vector<double> cpuTimes, gpuTimes;
+  std::vector<unsigned int> drawCalls, triangles;
+
+  BenchmarkRecorder(const BenchmarkRecorder &);
+  BenchmarkRecorder &operator=(const BenchmarkRecorder &);
+};
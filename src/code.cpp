@@ -12,7 +12,13 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <float.h>
+#include <algorithm>
 #include <memory>
+#include <random>
 #include <vector>
 #include <fstream>
 #include <iostream>
@@ -27,8 +33,25 @@
 #include <btBulletFile.h>
 #include <btBulletWorldImporter.h>
 
+#include <benchmark.h>
+#include <geometry.h>
 #include <glstuff.h>
+#include <headless.h>
+#include <jobs.h>
+#include <lighting.h>
+#include <meshopt.h>
+#include <occlusion.h>
+#include <physics.h>
+#include <profiler.h>
+#include <renderqueue.h>
+#include <ringbuffer.h>
+#include <shader.h>
+#include <startup.h>
+#include <texcook.h>
 #include <text.h>
+#include <textures.h>
+#include <trace.h>
+#include <transforms.h>
 
 using namespace std;
 using namespace glm;
@@ -38,19 +61,193 @@ static const float playerMass = 1.0;
 static const float playerHeight = 2.0;
 static const float playerRadius = 2.0;
 static const float movementSpeed = 8.0;
-static const float breakFactor = -25.0;
+// Rate at which horizontal speed decays while no direction is held, per second
+static const float brakeRate = 25.0;
 static const vec3 up(0,0,-1);
+static const int maxLods = 4;
+// Index count of each detail level relative to the full mesh
+static const float lodRatios[maxLods] = {1.0, 0.5, 0.25, 0.1};
+// Projected bounding radius over the viewport half height where the next level takes over
+static const float lodThresholds[maxLods - 1] = {0.4, 0.15, 0.05};
+static const float lodHysteresis = 0.15;
+// Meshes at least this large keep a CPU copy of a detail level within the budget to occlude with
+static const float occluderMinRadius = 2.0;
+static const unsigned int occluderTriangleBudget = 2048;
+static const int pointLightCount = 256;
+enum {PASS_OPAQUE = 0, PASS_SKY = 1, PASS_TRANSPARENT = 2};
+// Frames between issuing a GL query and reading it back
+static const int queryLatency = 3;
+static const int shadowCascades = 3;
+static const int shadowMapSize = 1024;
+// View distance covered by the cascades, split between logarithmic and uniform spacing
+static const float shadowDistance = 150.0;
+static const float shadowSplitNear = 1.0;
+static const float shadowSplitLambda = 0.75;
 class Context;
 class Material;
 class Mesh;
 class Object;
 class Camera;
 
-struct drawOptions
+struct frameStats
 {
-  bool textured = true;
-  bool selected = false;
-  btTransform camera;
+  unsigned int drawCalls;
+  unsigned int commands;
+  unsigned int triangles;
+  unsigned int prepassDrawCalls;
+  unsigned int occludedBodies;
+  unsigned int lightEntries;
+  unsigned int shadowStaticDraws;
+  unsigned int shadowDynamicDraws;
+  unsigned int shadowCascadesRebuilt;
+  unsigned int instances;
+  unsigned int visibleBodies;
+  unsigned int totalBodies;
+  unsigned int shaderBinds;
+  unsigned int vaoBinds;
+  unsigned int textureBinds;
+  unsigned int materialUploads;
+};
+
+static struct frameStats stats;
+
+// Per-instance vertex attributes, streamed once per frame for every Object
+struct InstanceData
+{
+  float mvp[16];
+  float model[16];
+  float normal[9];
+  float tint[4];
+};
+
+// Per-instance data of the shadow pass, which only needs positions
+struct ShadowInstance
+{
+  float model[16];
+};
+
+// std140 layout of the Frame uniform block shared by default.vs and default.fs
+static const GLuint FRAME_BLOCK_BINDING = 0;
+struct FrameUniforms
+{
+  float camera[16];
+  float projection[16];
+  float cameraPosition[4];
+  float lightPosition[4];
+  float lightIntensities[4];
+  float lightAmbientCoefficient;
+  float lightAttenuation;
+  float pad[2];
+  float clusterScale[4];
+  float clusterNear;
+  int pointLights;
+  int pad2[2];
+  int clusterBase[4];
+  int clusterSize[4];
+  float shadowMatrix[shadowCascades][16];
+  float cascadeEnd[4];
+};
+
+// Texture units of the clustered lighting buffers and the shadow map, unit 0 is the material texture
+enum {LIGHT_DATA_UNIT = 1, LIGHT_GRID_UNIT = 2, LIGHT_INDEX_UNIT = 3, SHADOW_MAP_UNIT = 4};
+
+class DefaultShader : public ShaderProgram
+{
+public:
+  GLint vertex, normal, uv, mvp, model, normalMatrix, tint;
+  GLint texid, sky, isHighlighted, materialShininess, materialSpecularColor, materialDiffuse;
+
+  DefaultShader() : ShaderProgram("src/default.vs", "src/default.fs")
+  {
+    vertex = attrib("vertex");
+    normal = attrib("normal");
+    uv = attrib("uv");
+    mvp = attrib("mvp");
+    model = attrib("model");
+    normalMatrix = attrib("normalMatrix");
+    tint = attrib("tint");
+    texid = uniform("texid");
+    sky = uniform("sky");
+    isHighlighted = uniform("isHighlighted");
+    materialShininess = uniform("materialShininess");
+    materialSpecularColor = uniform("materialSpecularColor");
+    materialDiffuse = uniform("materialDiffuse");
+    bindBlock("Frame", FRAME_BLOCK_BINDING);
+    use();
+    set(uniform("lightData"), LIGHT_DATA_UNIT);
+    set(uniform("lightGrid"), LIGHT_GRID_UNIT);
+    set(uniform("lightIndices"), LIGHT_INDEX_UNIT);
+    set(uniform("shadowMap"), SHADOW_MAP_UNIT);
+  }
+
+  // Attribute layout of a geometry pool holding packed vertices, its vertex array must be bound
+  void setupVertexArray(size_t stride, bool textured)
+  {
+    glEnableVertexAttribArray (vertex);
+    glVertexAttribPointer (vertex, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (const GLvoid*) offsetof(PackedTexturedVertex, position));
+
+    glEnableVertexAttribArray (normal);
+    glVertexAttribPointer (normal, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (const GLvoid*) offsetof(PackedTexturedVertex, normal));
+
+    if (textured)
+      {
+        glEnableVertexAttribArray (uv);
+        glVertexAttribPointer (uv, 2, GL_HALF_FLOAT, GL_FALSE, stride, (const GLvoid*) offsetof(PackedTexturedVertex, uv));
+      }
+
+    // Matrices occupy one attribute slot per column
+    for (int i = 0; i < 4; i++)
+      {
+        glEnableVertexAttribArray (mvp + i);
+        glVertexAttribDivisor (mvp + i, 1);
+        glEnableVertexAttribArray (model + i);
+        glVertexAttribDivisor (model + i, 1);
+      }
+    for (int i = 0; i < 3; i++)
+      {
+        glEnableVertexAttribArray (normalMatrix + i);
+        glVertexAttribDivisor (normalMatrix + i, 1);
+      }
+    glEnableVertexAttribArray (tint);
+    glVertexAttribDivisor (tint, 1);
+  }
+
+  // Point the per-instance attributes at instance data in a buffer, vertex array must be bound
+  void bindInstances(GLuint buffer, size_t offset)
+  {
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+    for (int i = 0; i < 4; i++)
+      {
+        glVertexAttribPointer (mvp + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (const GLvoid*)(offset + offsetof(InstanceData, mvp) + i * 4 * sizeof(GLfloat)));
+        glVertexAttribPointer (model + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (const GLvoid*)(offset + offsetof(InstanceData, model) + i * 4 * sizeof(GLfloat)));
+      }
+    for (int i = 0; i < 3; i++)
+      {
+        glVertexAttribPointer (normalMatrix + i, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (const GLvoid*)(offset + offsetof(InstanceData, normal) + i * 3 * sizeof(GLfloat)));
+      }
+    glVertexAttribPointer (tint, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (const GLvoid*)(offset + offsetof(InstanceData, tint)));
+  }
+
+  // Shadow casters read nothing but the position and a model matrix per instance
+  void setupShadowArray(size_t stride)
+  {
+    glEnableVertexAttribArray (vertex);
+    glVertexAttribPointer (vertex, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (const GLvoid*) offsetof(PackedTexturedVertex, position));
+    for (int i = 0; i < 4; i++)
+      {
+        glEnableVertexAttribArray (model + i);
+        glVertexAttribDivisor (model + i, 1);
+      }
+  }
+
+  void bindModels(GLuint buffer, size_t offset)
+  {
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+    for (int i = 0; i < 4; i++)
+      {
+        glVertexAttribPointer (model + i, 4, GL_FLOAT, GL_FALSE, sizeof(ShadowInstance), (const GLvoid*)(offset + i * 4 * sizeof(GLfloat)));
+      }
+  }
 };
 
 class Material
@@ -71,50 +268,53 @@ class Mesh
   friend Object;
   friend Context;
 private:
-  vector<float> vertexdata;
+  vector<char> vertexdata;
   vector<unsigned int> elements;
-  unsigned int numElements, vao, vbo, ebo, material_idx;
-  GLuint shader;
+  unsigned int numVertices, numElements, material_idx;
+  // Maps the unit cube of quantized positions onto the mesh bounds
+  float boundsMin[3], boundsExtent[3], radius;
+  // Index ranges of the detail levels within elements, level 0 is the full mesh
+  unsigned int lodFirst[maxLods], lodCount[maxLods];
+  int numLods;
+  OccluderMesh occluder;
+  GeometryPool *pool;
+  GLint baseVertex;
+  GLuint firstIndex;
+  DefaultShader *shader;
   bool hasTexture, hasAnimations;
-  unsigned int texture;
+  // Handle of the material texture
+  int texture;
 public:
   Mesh() : hasTexture(false), hasAnimations(false) {};
 
   ~Mesh() {};
 
-  void init(GLuint _shader)
+  // Sub-allocate the mesh into a shared pool, the CPU copy is released afterwards
+  void init(DefaultShader *_shader, GeometryPool *_pool)
   {
     shader = _shader;
-    size_t stride = hasTexture ? sizeof(float) * 8 : sizeof(float) * 6;
-    GLint vertexAttrib = glGetAttribLocation (shader, "vertex");
-    GLint normalAttrib = glGetAttribLocation (shader, "normal");
-    GLint uvAttrib = glGetAttribLocation (shader, "uv");
-    glGenBuffers (1, &vbo);
-    glBindBuffer (GL_ARRAY_BUFFER, vbo);
-    glBufferData (GL_ARRAY_BUFFER, sizeof (float) * vertexdata.size(), &vertexdata[0], GL_STREAM_DRAW);
-
-    glGenVertexArrays (1, &vao);
-    glBindVertexArray (vao);
-
-    glEnableVertexAttribArray (vertexAttrib);
-    glVertexAttribPointer (vertexAttrib, 3, GL_FLOAT, GL_FALSE, stride, NULL);
-
-    glEnableVertexAttribArray (normalAttrib);
-    glVertexAttribPointer (normalAttrib, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(3 * sizeof(GLfloat)));
-
-    if (hasTexture)
-      {
-        glEnableVertexAttribArray (uvAttrib);
-        glVertexAttribPointer (uvAttrib, 2, GL_FLOAT, GL_TRUE, stride, (const GLvoid*)(6 * sizeof(GLfloat)));
-      }
-
-    glGenBuffers(1, &ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (elements.size()) * sizeof(unsigned int), &elements[0], GL_STATIC_DRAW);
+    pool = _pool;
+    pool->add(vertexdata.data(), numVertices, elements.data(), elements.size(), &baseVertex, &firstIndex);
+    vector<char>().swap(vertexdata);
+    vector<unsigned int>().swap(elements);
+  };
 
-    glBindVertexArray (0);
+  DrawElementsIndirectCommand command(GLuint instanceCount, GLuint baseInstance, int lod = 0) const
+  {
+    DrawElementsIndirectCommand c = { lodCount[lod], instanceCount, firstIndex + lodFirst[lod], baseVertex, baseInstance };
+    return c;
+  }
 
-  };
+  // Coarsen or refine from the current level, switching only past a margin around each threshold
+  int selectLod(int current, float screenSize) const
+  {
+    int lod = min(current, numLods - 1);
+    while (lod < numLods - 1 && screenSize < lodThresholds[lod] * (1.0 - lodHysteresis))
+      lod++;
+    while (lod > 0 && screenSize > lodThresholds[lod - 1] * (1.0 + lodHysteresis))
+      lod--;
+    return lod;
+  }
 };
 
 struct Instance {
@@ -161,13 +361,20 @@ class Object
 
 private:
   string name;
+  bool isSky;
   float tint[4];
   btCollisionShape *shape;
   btRigidBody *body;
   vector<btRigidBody*> bodies;
+  // Snapshot slot of each body
+  vector<int> slots;
   shared_ptr<Mesh> mesh;
   btTransform t;
   float mat[16];
+  // Detail level each body was drawn with last, and the visible instances per level
+  vector<unsigned char> lods;
+  vector<size_t> lodInstances[maxLods];
+  size_t instanceCount;
 
 public:
   Object(const char *_name, btRigidBody* _body, shared_ptr<Mesh>_mesh)
@@ -180,6 +387,7 @@ public:
     tint[2] = 1.0;
     tint[3] = 1.0;
     shape = _body->getCollisionShape();
+    isSky = name == "Sky";
   }
 
   Object(const char *_name, btRigidBody* _body, shared_ptr<Mesh> _mesh, float _tint[4])
@@ -192,20 +400,15 @@ public:
     tint[2] =_tint[2];
     tint[3] =_tint[3];
     shape = _body->getCollisionShape();
+    isSky = name == "Sky";
   }
 
 
-  ~Object()
-  {
-    delete body;
-    for (btRigidBody *b : bodies)
-      {
-        delete b;
-      }
-    delete shape;
-  };
+  // Bodies and shapes are in the world, which Context tears down
+  ~Object() {};
 
-  Instance addInstance(shared_ptr<btDiscreteDynamicsWorld> world, btTransform t, btScalar mass, btRigidBody *b)
+  // New bodies join the world at the next physics step
+  Instance addInstance(PhysicsThread *physics, btTransform t, btScalar mass, btRigidBody *b)
   {
     btMotionState* motion=new btDefaultMotionState(t);
     btVector3 inertia(0,0,0);
@@ -221,96 +424,144 @@ public:
     body->setMotionState(motion);
     //body->setActivationState(WANTS_DEACTIVATION);
 
-    if (!b)
-      world->addRigidBody(body);
+    slots.push_back(physics->track(body, !b));
     bodies.push_back(body);
     Instance instance(name);
     t.getOpenGLMatrix(instance.transform);
     return instance;
   }
 
-  void drawBufferr(struct drawOptions opt, Material *material)
+  // Append the model matrices of the bodies marked visible this frame to the
+  // transform batch and pick their detail levels, lodScale is the vertical
+  // projection scale. Returns the distance to the nearest one
+  float gatherInstances(const vec3 &eye, int frame, float lodScale, const OcclusionCuller *occlusion,
+                        const PhysicsSnapshot &snapshot, const vector<int> &frames,
+                        TransformBatch &batch, unsigned int *occluded)
   {
-    if (mesh)
+    float nearest = FLT_MAX;
+    instanceCount = 0;
+    for (int l = 0; l < maxLods; l++)
       {
+        lodInstances[l].clear();
+      }
+    lods.resize(bodies.size(), 0);
 
-        glBindVertexArray (mesh->vao);
-        glUniform4f (glGetUniformLocation(mesh->shader, "color"), (GLfloat) tint[0], (GLfloat) tint[1], (GLfloat) tint[2], (GLfloat) tint[3]);
-        glUniform3f(glGetUniformLocation (mesh->shader, "light.position"), 10000, 10, 1000000);
-        glUniform3f(glGetUniformLocation (mesh->shader, "light.intensities"), material->diffuse[0],material->diffuse[0],material->diffuse[0]);
-        glUniform1i(glGetUniformLocation (mesh->shader, "sky"), name == "Sky");
-        glUniform1i(glGetUniformLocation (mesh->shader, "texid"), mesh->hasTexture ? mesh->texture : 0);
-        glUniform1i(glGetUniformLocation (mesh->shader, "isHighlighted"), 0);
-        glUniform1f(glGetUniformLocation (mesh->shader, "light.ambientCoefficient"), 0.01);
-        glUniform1f(glGetUniformLocation (mesh->shader, "materialShininess"), material->shininess);
-        glUniform3f(glGetUniformLocation (mesh->shader, "materialSpecularColor"), material->specular[0],material->specular[0],material->specular[0]);
-
-        if (mesh->hasTexture)
-          {
-            glEnable(GL_TEXTURE_2D);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, mesh->texture);
-          }
-        else
+    for (size_t i = 0; i < bodies.size(); i++)
+      {
+        int slot = slots[i];
+        if (slot >= (int) frames.size() || frames[slot] != frame)
+          continue;
+        const BodyState &state = snapshot.bodies[slot];
+        if (occlusion && !occlusion->visible(state.aabbMin, state.aabbMax))
           {
-            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-            glDisable(GL_TEXTURE_2D);
+            (*occluded)++;
+            continue;
           }
+        memcpy(mat, state.transform, sizeof(mat));
+        float distance = length(vec3(mat[12], mat[13], mat[14]) - eye);
+        nearest = min(nearest, distance);
 
-        for (btRigidBody *b : bodies)
-          {
-            b->getMotionState()->getWorldTransform(t);
-            t.getOpenGLMatrix(mat);
+        lods[i] = mesh->selectLod(lods[i], mesh->radius * lodScale / max(distance, 0.001f));
+        lodInstances[lods[i]].push_back(batch.add(mat));
+        instanceCount++;
+      }
+    return nearest;
+  }
 
-            glUniformMatrix4fv (glGetUniformLocation (mesh->shader, "model"), 1, GL_FALSE, mat);
+  // The dequantization of packed positions is folded into the matrices, the
+  // normal matrix is left as computed from the unscaled model matrix
+  void writeInstance(InstanceData &instance, const TransformBatch &batch, size_t index, const float color[4])
+  {
+    batch.store(index, instance.mvp, instance.model, instance.normal);
+    dequantize(instance.mvp);
+    dequantize(instance.model);
+    memcpy(instance.tint, color, sizeof(instance.tint));
+  }
 
-            if (name == "Sky" == 0)
-              {
-                glDisable(GL_CULL_FACE);
-              }
-            glDrawElements( GL_TRIANGLES, (mesh->elements.size()), GL_UNSIGNED_INT, NULL);
-            if (name == "Sky" == 0)
-              {
-                glEnable(GL_CULL_FACE);
-              }
-          }
+  // m = m * translate(boundsMin) * scale(boundsExtent), column major
+  void dequantize(float *m)
+  {
+    for (int r = 0; r < 4; r++)
+      {
+        m[12 + r] += m[r] * mesh->boundsMin[0] + m[4 + r] * mesh->boundsMin[1] + m[8 + r] * mesh->boundsMin[2];
+        m[r] *= mesh->boundsExtent[0];
+        m[4 + r] *= mesh->boundsExtent[1];
+        m[8 + r] *= mesh->boundsExtent[2];
+      }
+  }
 
-        if (opt.selected)
+  // Write the instance data straight into the stream buffer, with one draw command per detail level
+  void writeInstances(const TransformBatch &batch, RingBuffer &stream, vector<DrawElementsIndirectCommand> &commands)
+  {
+    for (int l = 0; l < maxLods; l++)
+      {
+        const vector<size_t> &instances = lodInstances[l];
+        if (instances.empty())
+          continue;
+        size_t offset, bytes = sizeof(InstanceData) * instances.size();
+        InstanceData *data = (InstanceData*) stream.allocate(bytes, sizeof(InstanceData), &offset);
+        for (size_t i = 0; i < instances.size(); i++)
           {
-            opt.camera.getOpenGLMatrix(mat);
-
-            glUniformMatrix4fv (glGetUniformLocation (mesh->shader, "model"), 1, GL_FALSE, mat);
-            glUniform1i(glGetUniformLocation (mesh->shader, "isHighlighted"), 1);
-            glUniform4f (glGetUniformLocation(mesh->shader, "color"), 0.0, 0.0, 1.0, 1.0);
-            glDrawElements( GL_TRIANGLES, (mesh->elements.size()), GL_UNSIGNED_INT, NULL);
+            writeInstance(data[i], batch, instances[i], tint);
           }
-        glBindVertexArray (0);
-      } else {
-      printf("No mesh for %s\n", name.c_str());
-    }
-  };
+        stream.commit(offset, bytes);
+        commands.push_back(mesh->command(instances.size(), offset / sizeof(InstanceData), l));
+      }
+  }
+
+  DrawElementsIndirectCommand writeSelected(const TransformBatch &batch, size_t index, RingBuffer &stream)
+  {
+    const float highlight[4] = {0.0, 0.0, 1.0, 1.0};
+    size_t offset;
+    InstanceData *instance = (InstanceData*) stream.allocate(sizeof(InstanceData), sizeof(InstanceData), &offset);
+    writeInstance(*instance, batch, index, highlight);
+    stream.commit(offset, sizeof(InstanceData));
+    return mesh->command(1, offset / sizeof(InstanceData));
+  }
 };
 
 class Context
 {
 private:
   const char *scene_file = "assets/sandbox.fbx", *bullet_file = "assets/sandbox.bullet";
+  bool optimizeOverdraw = true;
   btBulletWorldImporter* m_fileLoader;
   Assimp::Importer importer;
-  shared_ptr<btDiscreteDynamicsWorld> world;
-  shared_ptr<btCollisionDispatcher> dispatcher;
-  shared_ptr<btCollisionConfiguration> collisionConfig;
-  shared_ptr<btDbvtBroadphase> broadphase;
-  shared_ptr<btSequentialImpulseConstraintSolver> solver;
+  // Workers for startup and frame work, declared early so it outlives the modules using it
+  shared_ptr<JobSystem> jobs;
+  // Single or multithreaded world as chosen by the --physics options
+  PhysicsOptions physicsOptions;
+  shared_ptr<PhysicsWorld> dynamics;
+  btDiscreteDynamicsWorld *world;
+  // Steps the world while the frame renders, which reads bodies from its snapshot only
+  shared_ptr<PhysicsThread> physics;
+  const PhysicsSnapshot *snapshot = NULL;
+  // Real time not yet simulated, less than one fixed step after every frame
+  double physicsLag = 0;
+  // Frame number each slot was last inside the view frustum
+  vector<int> visibleFrames;
 
   vector<Material> materials;
+  // Owns the material textures, decoded in the background while frames draw placeholders
+  shared_ptr<TextureManager> textures;
+  size_t textureBudget;
   vector<Camera> cameras;
   unordered_map<string, shared_ptr<Mesh>> meshes;
 
   unordered_map<string, shared_ptr<Object>> objects;
   vector<Instance> addedInstances;
 
-  SDL_Window *window;
+  SDL_Window *window = NULL;
+  // Benchmarks render offscreen into the headless context's framebuffer
+  BenchmarkOptions benchmark;
+  shared_ptr<HeadlessContext> headless;
+  GLuint targetFramebuffer = 0;
+  // Seconds that drive scene animation, frame based when benchmarking so runs repeat
+  double sceneTime = 0;
+  // Per-phase timings shown over the scene, toggled with T
+  Profiler profiler;
+  // R starts and stops a capture of the timeline into this file
+  const char *traceFile = "trace.json";
   SDL_DisplayMode displayMode = { SDL_PIXELFORMAT_UNKNOWN, 0, 0, 0, 0 };
 
   int screenWidth;
@@ -318,28 +569,138 @@ private:
   int videoMode;
 
   Object *player;
+  int playerSlot;
   float mouseSensitivity = 0.005;
   float playerPitch;
   float playerYaw;
   //bool player_grounded = false;
 
-  int playerInput[8];
+  int playerInput[8] = {};
+
+  // What the physics thread needs of a frame to move the player and pick bodies
+  struct playerCommand
+  {
+    int input[8];
+    vec3 forward;
+    mat4 view, projection;
+  };
 
   int createObjIdx = 0;
   shared_ptr<Object> createObj;
 
+  // Physics thread only, stepInput is the latest input and applies to every fixed step
+  playerCommand stepInput = playerCommand();
   btRigidBody *heldObject = NULL;
-
   bool grappleTarget = false;
   btVector3 grapplePos;
 
   mat4 look, projection;
   vec3 eye, forward;
 
-  GLuint staticShader;
+  shared_ptr<DefaultShader> staticShader;
+  shared_ptr<ShaderProgram> depthShader;
+  bool depthPrepass = true;
+  shared_ptr<OcclusionCuller> occlusion;
+  bool occlusionCulling = true;
+
+  // Point lights circle around their anchors, binned into clusters every frame
+  struct lightMotion
+  {
+    float center[3];
+    float orbit, speed, phase;
+  };
+  vector<PointLight> lights;
+  vector<lightMotion> lightMotions;
+  shared_ptr<LightClusterer> clusterer;
+  // Texture buffer views of the stream buffer, indexed by unit - LIGHT_DATA_UNIT
+  GLuint lightTextures[3];
+  int lightBase[3];
+  // Views cover only their own range with ARB_texture_buffer_range, the whole stream otherwise,
+  // either way no texel a shader fetches may lie past the texture buffer size limit
+  bool textureBufferRange;
+  GLint textureBufferAlignment, maxTextureBufferTexels;
+  // Cleared for frames whose light data the views cannot reach, which then go without point lights
+  bool pointLightsShown = true, pointLightsWarned = false;
+
+  // Cascaded sun shadows. Static casters are drawn into a cached layer per cascade
+  // only when the cascade moves, every frame that layer is copied into the sampled
+  // map and the dynamic casters are drawn over it
+  struct shadowCascade
+  {
+    // Distance along the view of the slice's bounding sphere, and the view depth the slice ends at
+    float distance, splitFar;
+    // Side of the light space square, whose center is snapped to an eighth of it
+    float extent, center[2];
+    mat4 viewProjection;
+    bool valid;
+  };
+  struct shadowBatch
+  {
+    Object *object;
+    int cascade, lod;
+    bool isStatic;
+    // Range of the batch's model matrices in shadowModels
+    size_t first, count;
+  };
+  shadowCascade cascades[shadowCascades];
+  vector<shadowBatch> shadowBatches;
+  vector<float> shadowModels;
+  vector<size_t> shadowCasters;
+  shared_ptr<ShaderProgram> shadowShader;
+  GLint shadowLightViewProjection;
+  // Cached static layers and the sampled map, both depth array textures
+  GLuint shadowTextures[2];
+  GLuint shadowFramebuffers[2];
+  GLuint shadowArrays[4];
+  bool shadowPass = false;
+  bool copyImage;
+  vec3 sunPosition = vec3(10000, 10, 1000000);
+  vec3 shadowLight = vec3(0);
+  mat4 shadowView;
+  float shadowDepth[2];
+  size_t shadowStaticBodies = 0;
+  shared_ptr<RingBuffer> stream;
+  GLint uniformAlignment;
   unsigned int tick;
+  // Frames are paced by the swap interval, V switches to uncapped rendering
+  bool vsync = true;
+  int frameNumber = 0;
+  // Cleared by Escape or closing the window, loop() returns once the frame is done
+  bool running = true;
 
-  btRigidBody *RayTrace(int x, int y)
+  struct drawItem
+  {
+    Object *object;
+    Material *material;
+    // Range of this item's commands in itemCommands
+    size_t firstCommand, commandCount;
+  };
+  RenderQueue queue, depthQueue;
+  vector<DrawElementsIndirectCommand> itemCommands;
+  vector<drawItem> drawItems;
+  TransformBatch transforms;
+  vector<DrawElementsIndirectCommand> commands;
+
+  // Indexed by textured * 2 + 32-bit indices
+  shared_ptr<GeometryPool> pools[4];
+  bool multiDrawIndirect;
+
+  // Fragment shader invocations of the shading passes, read back queryLatency frames late
+  bool pipelineStatistics;
+  GLuint fragmentQueries[queryLatency];
+  GLuint64 fragmentInvocations = 0;
+
+  // GL state last set by bindState, used to skip redundant changes
+  struct
+  {
+    DefaultShader *shader;
+    GeometryPool *pool;
+    GLuint texture;
+    Material *material;
+    int sky;
+  } bound;
+
+  btRigidBody *RayTrace(int x, int y, const mat4 &look, const mat4 &projection)
   {
     vec4 ray_start_NDC( ((float)x/(float)screenWidth  - 0.5f) * 2.0f, ((float)y/(float)screenHeight - 0.5f) * 2.0f, -1.0, 1.0f);
     vec4 ray_end_NDC( ((float)x/(float)screenWidth  - 0.5f) * 2.0f, ((float)y/(float)screenHeight - 0.5f) * 2.0f, 0.0, 1.0f);
@@ -447,116 +808,187 @@ private:
 
   void initGL(void)
   {
-    SDL_GL_CreateContext(window);
-    glewExperimental = GL_TRUE;
-    glewInit();
-    staticShader = compile_shader("src/default.vs", "src/default.fs");
+    if (headless)
+      {
+        headless->loadEntryPoints();
+        headless->createFramebuffer();
+        targetFramebuffer = headless->framebuffer();
+      }
+    else
+      {
+        SDL_GL_CreateContext(window);
+        SDL_GL_SetSwapInterval(vsync);
+        glewExperimental = GL_TRUE;
+        GLenum status = glewInit();
+        if (status != GLEW_OK)
+          throw runtime_error(string("GLEW could not load GL entry points: ") + (const char *) glewGetErrorString(status));
+      }
+    staticShader.reset(new DefaultShader());
+    depthShader.reset(new ShaderProgram("src/depth.vs", "src/depth.fs", &*staticShader));
+    stream.reset(new RingBuffer(4 * 1024 * 1024));
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+    if (!GLEW_ARB_vertex_type_2_10_10_10_rev)
+      throw runtime_error("Packed normals need ARB_vertex_type_2_10_10_10_rev");
+    multiDrawIndirect = GLEW_ARB_multi_draw_indirect;
+    printf("Multi-draw indirect %s\n", multiDrawIndirect ? "enabled" : "not supported");
+    glGenTextures(3, lightTextures);
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTextureBufferTexels);
+    textureBufferRange = GLEW_ARB_texture_buffer_range;
+    textureBufferAlignment = 1;
+    if (textureBufferRange)
+      glGetIntegerv(GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT, &textureBufferAlignment);
+    printf("Texture buffers up to %d texels, %s\n", maxTextureBufferTexels,
+           textureBufferRange ? "bound by range" : "bound whole");
+    pipelineStatistics = GLEW_ARB_pipeline_statistics_query;
+    if (pipelineStatistics)
+      glGenQueries(queryLatency, fragmentQueries);
 
     gl_error();
   }
 
   void initBullet(void)
   {
-    collisionConfig.reset(new btDefaultCollisionConfiguration());
-    dispatcher.reset(new btCollisionDispatcher(&*collisionConfig));
-    broadphase.reset(new btDbvtBroadphase());
-    solver.reset(new btSequentialImpulseConstraintSolver());
-    world.reset(new btDiscreteDynamicsWorld(&*dispatcher,&*broadphase,&*solver,&*collisionConfig));
+    dynamics.reset(new PhysicsWorld(physicsOptions));
+    world = dynamics->world();
+    physics.reset(new PhysicsThread(world));
   }
 
-  void initScene()
+  // Parse the scene and take its materials, cameras and node transforms, meshes are built from it later
+  void readScene()
   {
     const struct aiScene *scene = importer.ReadFile(scene_file, aiProcessPreset_TargetRealtime_Fast);
     printf("Loading scene from %s\n\t%s\n", scene_file, importer.GetErrorString());
 
     instancesFromGraph(scene->mRootNode, aiMatrix4x4());
 
-    {
-      fprintf(stderr, "%d\tmeshes\n%d\tmaterials\n%d\tcameras\n",
-              scene->mNumMeshes, scene->mNumMaterials, scene->mNumCameras);
-      for (unsigned int i = 0; i < scene->mNumMaterials; i++)
-        {
-          AddMaterial(scene->mMaterials[i]);
-        }
+    fprintf(stderr, "%d\tmeshes\n%d\tmaterials\n%d\tcameras\n",
+            scene->mNumMeshes, scene->mNumMaterials, scene->mNumCameras);
+    for (unsigned int i = 0; i < scene->mNumMaterials; i++)
+      {
+        AddMaterial(scene->mMaterials[i]);
+      }
 
-      for (unsigned int i = 0; i < scene->mNumMeshes; i++)
-        {
-          AddMesh(scene->mMeshes[i]);
-        }
+    for (unsigned int i = 0; i < scene->mNumCameras; i++)
+      {
+        AddCamera(scene, scene->mCameras[i]);
+      }
+  }
 
-      for (unsigned int i = 0; i < scene->mNumCameras; i++)
-        {
-          AddCamera(scene, scene->mCameras[i]);
-        }
-    }
+  // Textures arrive in later frames as update() uploads them
+  void loadTextures()
+  {
+    textures.reset(new TextureManager(&*jobs, textureBudget));
+    for (Material &m : materials)
+      {
+        if (m.texture >= 0)
+          m.texture = textures->acquire(m.bitmap_file.c_str());
+      }
+  }
+
+  // Built in parallel and added in scene order, so a later mesh of the same name still wins
+  void initMeshes()
+  {
+    const struct aiScene *scene = importer.GetScene();
+    vector<shared_ptr<Mesh>> built(scene->mNumMeshes);
+    jobs->parallelFor(scene->mNumMeshes, 1, [this, scene, &built](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++)
+          {
+            built[i] = buildMesh(scene->mMeshes[i]);
+          }
+      }, "build meshes");
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+      {
+        if (built[i])
+          meshes[string(scene->mMeshes[i]->mName.C_Str())] = built[i];
+      }
+  }
 
+  // Pack the built meshes into the geometry pools once the textures are uploaded
+  void initGeometry()
+  {
+    for (int i = 0; i < 4; i++)
+      {
+        pools[i].reset(new GeometryPool(i & 2 ? sizeof(PackedTexturedVertex) : sizeof(PackedVertex),
+                                        i & 1 ? sizeof(GLuint) : sizeof(GLushort)));
+      }
 
     for (auto const &mesh : meshes)
       {
+        GeometryPool *pool = &*pools[(mesh.second->hasTexture ? 2 : 0) + (mesh.second->numVertices > 0xffff ? 1 : 0)];
+        if (mesh.second->hasTexture)
+          mesh.second->texture = materials.at(mesh.second->material_idx).texture;
         if (mesh.second->hasAnimations)
           {
             printf("Animations not yet implemented\n");
-            mesh.second->init(staticShader);
+            mesh.second->init(&*staticShader, pool);
           }
         else
-          mesh.second->init(staticShader);
+          mesh.second->init(&*staticShader, pool);
       }
 
+    for (int i = 0; i < 4; i++)
+      {
+        pools[i]->upload();
+        staticShader->setupVertexArray(pools[i]->stride, i & 2);
+      }
+    glBindVertexArray (0);
+
     importer.FreeScene();
   }
 
-  void initPhysics()
+  void loadPhysics()
   {
-    m_fileLoader = new btBulletWorldImporter(&*world);
+    m_fileLoader = new btBulletWorldImporter(world);
 
     m_fileLoader->setVerboseMode(false);
 
-    if (m_fileLoader->loadFile(bullet_file))
+    if (!m_fileLoader->loadFile(bullet_file))
+      {
+        throw runtime_error("Failed to physics data");
+      }
+    printf("Loaded %s....\n%d\tconstraints\n%d\trigid bodies\n",
+           bullet_file, m_fileLoader->getNumConstraints(), m_fileLoader->getNumRigidBodies());
+  }
+
+  // Pair the loaded bodies with the meshes of the same name
+  void initPhysics()
+  {
+    for(int i=0; i < m_fileLoader->getNumRigidBodies(); i++)
       {
-        printf("Loaded %s....\n%d\tconstraints\n%d\trigid bodies\n",
-               bullet_file, m_fileLoader->getNumConstraints(), m_fileLoader->getNumRigidBodies());
-        for(int i=0; i < m_fileLoader->getNumRigidBodies(); i++)
+        btCollisionObject* obj = m_fileLoader->getRigidBodyByIndex(i);
+        btRigidBody* body = btRigidBody::upcast(obj);
+        const char *name = m_fileLoader->getNameForPointer(body);
+        if (body && name)
           {
-            btCollisionObject* obj = m_fileLoader->getRigidBodyByIndex(i);
-            btRigidBody* body = btRigidBody::upcast(obj);
-            const char *name = m_fileLoader->getNameForPointer(body);
-            if (body && name)
+            char copy[256];
+            strcpy(copy, name);
+            copy[strlen(name) - 4] = '\0';
+            if (meshes.count(name) || meshes.count(copy))
               {
-                char copy[256];
-                strcpy(copy, name);
-                copy[strlen(name) - 4] = '\0';
-                if (meshes.count(name) || meshes.count(copy))
-                  {
 
-                    shared_ptr<Object> object(new Object(name, body, meshes.at(name)));
-
-                    if (meshes.count(name))
-                      {
-                        objects[name] = object;
-                        printf("Added object %s\n", name);
-                      }
-                    else
-                      {
-                        objects[copy] = object;
-                        printf("Added object %s as copy of %s\n", name, copy);
-                      }
+                shared_ptr<Object> object(new Object(name, body, meshes.at(name)));
+
+                if (meshes.count(name))
+                  {
+                    objects[name] = object;
+                    printf("Added object %s\n", name);
+                  }
+                else
+                  {
+                    objects[copy] = object;
+                    printf("Added object %s as copy of %s\n", name, copy);
                   }
               }
           }
-
-        for(int i=0; i < m_fileLoader->getNumConstraints(); i++)
-          {
-            btTypedConstraint*   constraint=m_fileLoader->getConstraintByIndex(i);
-            printf("  constraint type = %i\n", constraint->getConstraintType());
-            btRigidBody* body = &constraint->getRigidBodyA();
-            const char *name = m_fileLoader->getNameForPointer(body);
-            printf("Body a name %s\n", name);
-          }
-
       }
-    else
+
+    for(int i=0; i < m_fileLoader->getNumConstraints(); i++)
       {
-        throw runtime_error("Failed to physics data");
+        btTypedConstraint*   constraint=m_fileLoader->getConstraintByIndex(i);
+        printf("  constraint type = %i\n", constraint->getConstraintType());
+        btRigidBody* body = &constraint->getRigidBodyA();
+        const char *name = m_fileLoader->getNameForPointer(body);
+        printf("Body a name %s\n", name);
       }
     printf("%d bodies and %d constraints in world\n", world->getNumCollisionObjects(), world->getNumConstraints());
   }
@@ -573,7 +1005,7 @@ private:
 
       if (objects.count(i.name))
         {
-          objects[i.name]->addInstance(world, t, 1.0 / objects[i.name]->body->getInvMass(), objects[i.name]->body);
+          objects[i.name]->addInstance(&*physics, t, 1.0 / objects[i.name]->body->getInvMass(), objects[i.name]->body);
           printf("Added instance %s\n", i.name.c_str());
         }
     }
@@ -604,7 +1036,7 @@ private:
       playerBody->setSleepingThresholds(0.0, 0.0);
       playerBody->setAngularFactor(0.0);
 
-      world->addRigidBody(playerBody);
+      playerSlot = physics->track(playerBody, true);
 
       player = new Object("Player", playerBody, NULL);
     }
@@ -616,14 +1048,19 @@ private:
   {
     for (auto &obj : objects)
       {
-        for(vector<btRigidBody*>::iterator i = obj.second->bodies.begin() + 1;
-            i != obj.second->bodies.end(); ++i)
+        for (vector<int>::iterator i = obj.second->slots.begin() + 1; i != obj.second->slots.end(); ++i)
           {
-            world->removeRigidBody(*i);
+            physics->untrack(*i, true);
           }
         obj.second->bodies.erase(obj.second->bodies.begin() + 1, obj.second->bodies.end());
+        obj.second->slots.erase(obj.second->slots.begin() + 1, obj.second->slots.end());
       }
-    printf("Cleared bodies, remaining bodies in world %d\n", world->getNumCollisionObjects());
+    physics->enqueue([this] {
+        // Removed bodies lost their slot
+        if (heldObject && heldObject->getUserIndex() < 0)
+          heldObject = NULL;
+        printf("Cleared bodies, remaining bodies in world %d\n", world->getNumCollisionObjects());
+      });
     addedInstances.clear();
   }
 
@@ -642,42 +1079,137 @@ private:
     return NULL;
   };
 
-  void AddMesh(const aiMesh *AIMesh)
+  // Optimize and pack one mesh, no GL calls so meshes build on the workers. Meshes with
+  // nothing to draw come back empty and are left out of the scene
+  shared_ptr<Mesh> buildMesh(const aiMesh *AIMesh)
   {
+    TraceZone zone("buildMesh", AIMesh->mName.data);
+    if (!AIMesh->mNumFaces || !AIMesh->mNumVertices)
+      {
+        printf("Mesh %-24s is empty, skipped\n", AIMesh->mName.C_Str());
+        return shared_ptr<Mesh>();
+      }
     shared_ptr<Mesh> mesh(new Mesh());
     mesh->numElements = AIMesh->mNumFaces * 3;
+    mesh->hasTexture = AIMesh->mTextureCoords[0] != NULL;
+
+    for (unsigned int j = 0; j < AIMesh->mNumFaces; j++)
+      {
+        mesh->elements.push_back(AIMesh->mFaces[j].mIndices[0]);
+        mesh->elements.push_back(AIMesh->mFaces[j].mIndices[1]);
+        mesh->elements.push_back(AIMesh->mFaces[j].mIndices[2]);
+      }
+
+    // Vertex indices of the packed mesh into the imported one
+    vector<unsigned int> remap;
+    {
+      float acmr[2], atvr[2];
+      analyze_vertex_cache(mesh->elements.data(), mesh->numElements, AIMesh->mNumVertices, VERTEX_CACHE_SIZE, &acmr[0], &atvr[0]);
+
+      vector<size_t> clusters;
+      optimize_vertex_cache(mesh->elements.data(), mesh->numElements, AIMesh->mNumVertices, VERTEX_CACHE_SIZE, &clusters);
+      if (optimizeOverdraw)
+        optimize_overdraw(mesh->elements.data(), mesh->numElements, &AIMesh->mVertices[0].x, clusters);
+      mesh->numVertices = optimize_vertex_fetch(mesh->elements.data(), mesh->numElements, AIMesh->mNumVertices, remap);
+
+      analyze_vertex_cache(mesh->elements.data(), mesh->numElements, mesh->numVertices, VERTEX_CACHE_SIZE, &acmr[1], &atvr[1]);
+      printf("Mesh %-24s ACMR %.3f -> %.3f ATVR %.3f -> %.3f, %lu clusters\n",
+             AIMesh->mName.C_Str(), acmr[0], acmr[1], atvr[0], atvr[1], clusters.size());
+    }
+
+    aiVector3D lower(FLT_MAX), upper(-FLT_MAX);
     for (unsigned int j = 0; j < AIMesh->mNumVertices; j++)
       {
-        mesh->vertexdata.push_back(AIMesh->mVertices[j].x);
-        mesh->vertexdata.push_back(AIMesh->mVertices[j].y);
-        mesh->vertexdata.push_back(AIMesh->mVertices[j].z);
+        const aiVector3D &v = AIMesh->mVertices[j];
+        lower = aiVector3D(min(lower.x, v.x), min(lower.y, v.y), min(lower.z, v.z));
+        upper = aiVector3D(max(upper.x, v.x), max(upper.y, v.y), max(upper.z, v.z));
+      }
+    for (int k = 0; k < 3; k++)
+      {
+        mesh->boundsMin[k] = AIMesh->mNumVertices ? lower[k] : 0.0f;
+        mesh->boundsExtent[k] = AIMesh->mNumVertices ? upper[k] - lower[k] : 0.0f;
+      }
 
-        if (AIMesh->mNormals)
+    mesh->radius = 0.5 * sqrt(mesh->boundsExtent[0] * mesh->boundsExtent[0]
+                              + mesh->boundsExtent[1] * mesh->boundsExtent[1]
+                              + mesh->boundsExtent[2] * mesh->boundsExtent[2]);
+
+    // Coarser levels are appended to the index list and share the vertices of the full mesh
+    {
+      vector<float> positions(mesh->numVertices * 3);
+      for (unsigned int n = 0; n < mesh->numVertices; n++)
+        {
+          memcpy(&positions[n * 3], &AIMesh->mVertices[remap[n]].x, 3 * sizeof(float));
+        }
+
+      mesh->numLods = 1;
+      mesh->lodFirst[0] = 0;
+      mesh->lodCount[0] = mesh->numElements;
+      vector<unsigned int> lod(mesh->numElements);
+      for (int l = 1; l < maxLods; l++)
+        {
+          size_t target = (size_t) (mesh->numElements / 3 * lodRatios[l]) * 3;
+          size_t previous = mesh->lodCount[l - 1];
+          size_t count = simplify(lod.data(), &mesh->elements[mesh->lodFirst[l - 1]], previous,
+                                  positions.data(), mesh->numVertices, target);
+          // Stop once the mesh will not simplify further
+          if (!count || count > previous * 0.9)
+            break;
+          optimize_vertex_cache(lod.data(), count, mesh->numVertices, VERTEX_CACHE_SIZE, NULL);
+          mesh->lodFirst[l] = mesh->elements.size();
+          mesh->lodCount[l] = count;
+          mesh->elements.insert(mesh->elements.end(), lod.begin(), lod.begin() + count);
+          mesh->numLods++;
+        }
+
+      printf("Mesh %-24s %d levels:", AIMesh->mName.C_Str(), mesh->numLods);
+      for (int l = 0; l < mesh->numLods; l++)
+        {
+          printf(" %u", mesh->lodCount[l] / 3);
+        }
+      printf(" triangles\n");
+
+      if (mesh->radius >= occluderMinRadius)
+        {
+          int l = 0;
+          while (l < mesh->numLods && mesh->lodCount[l] / 3 > occluderTriangleBudget)
+            l++;
+          if (l < mesh->numLods)
+            {
+              mesh->occluder.positions = positions;
+              mesh->occluder.indices.assign(mesh->elements.begin() + mesh->lodFirst[l],
+                                            mesh->elements.begin() + mesh->lodFirst[l] + mesh->lodCount[l]);
+            }
+        }
+    }
+
+    size_t stride = mesh->hasTexture ? sizeof(PackedTexturedVertex) : sizeof(PackedVertex);
+    mesh->vertexdata.resize(mesh->numVertices * stride);
+    for (unsigned int n = 0; n < mesh->numVertices; n++)
+      {
+        unsigned int j = remap[n];
+        PackedTexturedVertex *p = (PackedTexturedVertex*) &mesh->vertexdata[n * stride];
+        for (int k = 0; k < 3; k++)
           {
-            mesh->vertexdata.push_back(AIMesh->mNormals[j].x);
-            mesh->vertexdata.push_back(AIMesh->mNormals[j].y);
-            mesh->vertexdata.push_back(AIMesh->mNormals[j].z);
+            p->position[k] = pack_unorm16(AIMesh->mVertices[j][k], mesh->boundsMin[k], mesh->boundsExtent[k]);
           }
+        p->position[3] = 0;
+
+        if (AIMesh->mNormals)
+          p->normal = pack_snorm_2_10_10_10(AIMesh->mNormals[j].x, AIMesh->mNormals[j].y, AIMesh->mNormals[j].z);
+        else
+          p->normal = pack_snorm_2_10_10_10(0, 0, 1);
 
-        if (AIMesh->mTextureCoords[0])
+        if (mesh->hasTexture)
           {
-            mesh->vertexdata.push_back(AIMesh->mTextureCoords[0][j].x);
-            mesh->vertexdata.push_back(AIMesh->mTextureCoords[0][j].y);
-            mesh->hasTexture = true;
+            p->uv[0] = pack_half(AIMesh->mTextureCoords[0][j].x);
+            p->uv[1] = pack_half(AIMesh->mTextureCoords[0][j].y);
           }
       }
 
-    for (unsigned int j = 0; j < AIMesh->mNumFaces; j++)
-      {
-        mesh->elements.push_back(AIMesh->mFaces[j].mIndices[0]);
-        mesh->elements.push_back(AIMesh->mFaces[j].mIndices[1]);
-        mesh->elements.push_back(AIMesh->mFaces[j].mIndices[2]);
-      }
-
     if (mesh->hasTexture)
       {
         mesh->material_idx = AIMesh->mMaterialIndex;
-        mesh->texture = materials.at(AIMesh->mMaterialIndex).texture;
       }
 
     if (AIMesh->HasBones())
@@ -685,7 +1217,15 @@ private:
         mesh->hasAnimations = true;
       }
 
-    meshes[string(AIMesh->mName.C_Str())] = mesh;
+    {
+      size_t floatBytes = AIMesh->mNumVertices * (mesh->hasTexture ? 8 : 6) * sizeof(float) + mesh->numElements * sizeof(GLuint);
+      size_t packedBytes = mesh->vertexdata.size() + mesh->numElements * (mesh->numVertices > 0xffff ? sizeof(GLuint) : sizeof(GLushort));
+      printf("Mesh %-24s %6u vertices %7u indices %8lu -> %8lu bytes, saved %lu (%.0f%%)\n",
+             AIMesh->mName.C_Str(), AIMesh->mNumVertices, mesh->numElements, floatBytes, packedBytes,
+             floatBytes - packedBytes, floatBytes ? 100.0 * (floatBytes - packedBytes) / floatBytes : 0.0);
+    }
+
+    return mesh;
   };
 
   void AddMaterial(const struct aiMaterial *AIMaterial)
@@ -701,20 +1241,8 @@ private:
         strcpy(filename, "assets/");
         strcat(filename, str.data);
         material.bitmap_file = string(filename);
-        bool duplicateTexture = false;
-        for(Material &m : materials)
-          {
-            if (strcmp(filename, m.bitmap_file.c_str()) == 0)
-              {
-                material.texture = m.texture;
-                duplicateTexture = true;
-                break;
-              }
-          }
-        if (!duplicateTexture)
-          {
-            material.texture = load_texture(filename);
-          }
+        // Acquired by loadTextures once the GL context exists
+        material.texture = 0;
       }
     else
       material.texture = -1;
@@ -722,6 +1250,7 @@ private:
     AIMaterial->Get(AI_MATKEY_NAME, _n);
     AIMaterial->Get(AI_MATKEY_COLOR_DIFFUSE,material.diffuse);
     AIMaterial->Get(AI_MATKEY_COLOR_SPECULAR,material.specular);
+    AIMaterial->Get(AI_MATKEY_OPACITY,material.diffuse[3]);
     AIMaterial->Get(AI_MATKEY_SHININESS,material.shininess);
     material.name = string(_n.data);
     materials.push_back(material);
@@ -749,63 +1278,931 @@ private:
   };
 
 
-  void drawScene()
+  void resetState()
   {
-    struct drawOptions opt;
-    Material defaultMaterial;
-    glUseProgram(staticShader);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
+    bound.shader = NULL;
+    bound.pool = NULL;
+    bound.texture = ~0u;
+    bound.material = NULL;
+    bound.sky = -1;
+  }
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glClearColor(0,0,0,0);
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_DEPTH_TEST);
-    glCullFace(GL_FRONT);
-    glDepthMask(GL_TRUE);
+  bool isBound(Object *object, Material *material)
+  {
+    Mesh *mesh = &*object->mesh;
+    return bound.shader == mesh->shader
+      && bound.pool == mesh->pool
+      && bound.texture == (mesh->hasTexture ? textures->name(mesh->texture) : 0)
+      && bound.material == material
+      && bound.sky == object->isSky;
+  }
 
-    {
-      glUniformMatrix4fv(glGetUniformLocation (staticShader, "camera"), 1, GL_FALSE, value_ptr(look));
-      glUniformMatrix4fv(glGetUniformLocation (staticShader, "projection"), 1, GL_FALSE, value_ptr(projection));
-      glUniform3f(glGetUniformLocation (staticShader, "cameraPosition"), eye.x, eye.y, eye.z);
-    }
+  void bindState(Object *object, Material *material)
+  {
+    Mesh *mesh = &*object->mesh;
+    DefaultShader *shader = mesh->shader;
 
-    for (const auto &object : objects)
+    if (bound.shader != shader)
       {
-        opt.selected = false;
-        if (object.second->mesh->hasTexture)
-          object.second->drawBufferr(opt, &materials.at(object.second->mesh->material_idx));
-        else
-          object.second->drawBufferr(opt, &defaultMaterial);
+        resetState();
+        shader->use();
+        shader->set(shader->isHighlighted, 0);
+        bound.shader = shader;
+        stats.shaderBinds++;
       }
 
-    {
-      const float summonDistance = 10.0;
+    if (bound.pool != mesh->pool)
+      {
+        glBindVertexArray (mesh->pool->vao);
+        bound.pool = mesh->pool;
+        stats.vaoBinds++;
+      }
 
-      btTransform t;
-      t.setIdentity();
-      t.setOrigin(player->body->getWorldTransform().getOrigin());
-      t.setOrigin(t.getOrigin() + btVector3(forward.x * summonDistance,
-                                            forward.y * summonDistance,
-                                            forward.z * summonDistance));
+    GLuint texture = mesh->hasTexture ? textures->use(mesh->texture) : 0;
+    if (bound.texture != texture)
+      {
+        if (texture)
+          {
+            glEnable(GL_TEXTURE_2D);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, texture);
+          }
+        else
+          {
+            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+            glDisable(GL_TEXTURE_2D);
+          }
+        shader->set(shader->texid, (int) texture);
+        bound.texture = texture;
+        stats.textureBinds++;
+      }
+
+    if (bound.material != material)
+      {
+        shader->set(shader->materialDiffuse, material->diffuse[0], material->diffuse[0], material->diffuse[0]);
+        shader->set(shader->materialShininess, material->shininess);
+        shader->set(shader->materialSpecularColor, material->specular[0], material->specular[0], material->specular[0]);
+        bound.material = material;
+        stats.materialUploads++;
+      }
+
+    if (bound.sky != object->isSky)
+      {
+        // Only the sky is drawn with culling, of its front faces as set in drawScene, since the
+        // camera looks at the inside of the dome
+        if (object->isSky)
+          glEnable(GL_CULL_FACE);
+        else
+          glDisable(GL_CULL_FACE);
+        shader->set(shader->sky, (int) object->isSky);
+        bound.sky = object->isSky;
+      }
+  }
+
+  // Rasterize static occluders seen last frame on the occlusion worker while physics steps.
+  // Bodies are tested with the same, one frame old, view so the result stays consistent
+  void queueOccluders()
+  {
+    if (!occlusionCulling)
+      return;
+    for (auto const &object : objects)
+      {
+        Object *o = &*object.second;
+        if (!o->mesh || o->mesh->occluder.indices.empty() || o->isSky)
+          continue;
+        for (int slot : o->slots)
+          {
+            if (slot >= (int) visibleFrames.size() || visibleFrames[slot] != frameNumber
+                || !snapshot->bodies[slot].isStatic)
+              continue;
+            occlusion->addOccluder(snapshot->bodies[slot].transform, &o->mesh->occluder);
+          }
+      }
+    mat4 viewProjection = projection * look;
+    occlusion->begin(value_ptr(viewProjection));
+  }
+
+  // Every program shares the instance attribute locations of the static shader,
+  // the shadow pass streams bare model matrices instead of full instance data
+  void bindInstanceData(GLuint baseInstance)
+  {
+    if (shadowPass)
+      staticShader->bindModels(stream->id(), baseInstance * sizeof(ShadowInstance));
+    else
+      staticShader->bindInstances(stream->id(), baseInstance * sizeof(InstanceData));
+  }
+
+  // Draw the pending commands, which all share the currently bound state
+  void flushCommands()
+  {
+    if (commands.empty())
+      return;
+
+    if (multiDrawIndirect)
+      {
+        size_t offset, bytes = sizeof(DrawElementsIndirectCommand) * commands.size();
+        void *indirect = stream->allocate(bytes, sizeof(GLuint), &offset);
+        memcpy(indirect, &commands[0], bytes);
+        stream->commit(offset, bytes);
+
+        // Instance attributes start at the buffer origin, each command selects its range by base instance
+        bindInstanceData(0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, stream->id());
+        glMultiDrawElementsIndirect(GL_TRIANGLES, bound.pool->indexType(), (const GLvoid*) offset, commands.size(), 0);
+        stats.drawCalls++;
+      }
+    else
+      {
+        for (const DrawElementsIndirectCommand &c : commands)
+          {
+            bindInstanceData(c.baseInstance);
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, c.count, bound.pool->indexType(),
+                                              (const GLvoid*)(c.firstIndex * bound.pool->indexSize), c.instanceCount, c.baseVertex);
+            stats.drawCalls++;
+          }
+      }
+
+    for (const DrawElementsIndirectCommand &c : commands)
+      {
+        stats.instances += c.instanceCount;
+        stats.triangles += c.count / 3 * c.instanceCount;
+      }
+    stats.commands += commands.size();
+    commands.clear();
+  }
+
+  void uploadFrameUniforms()
+  {
+    size_t offset;
+    FrameUniforms &frame = *(FrameUniforms*) stream->allocate(sizeof(FrameUniforms), uniformAlignment, &offset);
+    memset(&frame, 0, sizeof(frame));
+    memcpy(frame.camera, value_ptr(look), sizeof(frame.camera));
+    memcpy(frame.projection, value_ptr(projection), sizeof(frame.projection));
+    frame.cameraPosition[0] = eye.x;
+    frame.cameraPosition[1] = eye.y;
+    frame.cameraPosition[2] = eye.z;
+    frame.lightPosition[0] = sunPosition.x;
+    frame.lightPosition[1] = sunPosition.y;
+    frame.lightPosition[2] = sunPosition.z;
+    frame.lightIntensities[0] = frame.lightIntensities[1] = frame.lightIntensities[2] = 1.0;
+    frame.lightAmbientCoefficient = 0.01;
+    frame.clusterScale[0] = (float) LightClusterer::CLUSTERS_X / screenWidth;
+    frame.clusterScale[1] = (float) LightClusterer::CLUSTERS_Y / screenHeight;
+    frame.clusterScale[2] = clusterer->sliceScale();
+    frame.clusterScale[3] = clusterer->sliceBias();
+    frame.clusterNear = clusterer->nearPlane();
+    frame.pointLights = pointLightsShown ? lights.size() : 0;
+    memcpy(frame.clusterBase, lightBase, sizeof(lightBase));
+    frame.clusterSize[0] = LightClusterer::CLUSTERS_X;
+    frame.clusterSize[1] = LightClusterer::CLUSTERS_Y;
+    frame.clusterSize[2] = LightClusterer::CLUSTERS_Z;
+    // Light clip space to texture coordinates and depth
+    const mat4 bias(vec4(0.5, 0, 0, 0), vec4(0, 0.5, 0, 0), vec4(0, 0, 0.5, 0), vec4(0.5, 0.5, 0.5, 1));
+    for (int c = 0; c < shadowCascades; c++)
+      {
+        memcpy(frame.shadowMatrix[c], value_ptr(bias * cascades[c].viewProjection), sizeof(frame.shadowMatrix[c]));
+        frame.cascadeEnd[c] = cascades[c].splitFar;
+      }
+    stream->commit(offset, sizeof(FrameUniforms));
+    glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, stream->id(), offset, sizeof(FrameUniforms));
+  }
+
+  // State of a body as of the last step, NULL until a step has seen it
+  const BodyState *body(int slot) const
+  {
+    if (slot >= (int) snapshot->bodies.size() || !snapshot->bodies[slot].valid)
+      return NULL;
+    return &snapshot->bodies[slot];
+  }
+
+  vec3 playerPosition() const
+  {
+    const float *m = snapshot->bodies[playerSlot].transform;
+    return vec3(m[12], m[13], m[14]);
+  }
+
+  // Union of the bounding boxes of every body in the scene
+  void sceneBounds(btVector3 &lower, btVector3 &upper)
+  {
+    lower = btVector3(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+    upper = -lower;
+    for (auto const &object : objects)
+      {
+        for (int slot : object.second->slots)
+          {
+            const BodyState *state = body(slot);
+            if (!state)
+              continue;
+            lower.setMin(btVector3(state->aabbMin[0], state->aabbMin[1], state->aabbMin[2]));
+            upper.setMax(btVector3(state->aabbMax[0], state->aabbMax[1], state->aabbMax[2]));
+          }
+      }
+  }
+
+  void initLights()
+  {
+    clusterer.reset(new LightClusterer(&*jobs, 1.0, 500.0));
+
+    // Scatter the lights over the bounds of the scene. This runs on a worker, where rand() is
+    // not safe, so it draws from its own generator with a fixed seed for the same scene every run
+    btVector3 lower, upper;
+    sceneBounds(lower, upper);
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    for (int i = 0; i < pointLightCount; i++)
+      {
+        PointLight light;
+        lightMotion motion;
+        for (int k = 0; k < 3; k++)
+          {
+            motion.center[k] = lower[k] + (upper[k] - lower[k]) * unit(generator);
+            light.color[k] = 0.2 + 0.8 * unit(generator);
+          }
+        motion.orbit = 2.0 + 6.0 * unit(generator);
+        motion.speed = 0.2 + 0.8 * unit(generator);
+        motion.phase = TWOPI * unit(generator);
+        light.radius = 4.0 + 8.0 * unit(generator);
+        light.intensity = 1.5;
+        lights.push_back(light);
+        lightMotions.push_back(motion);
+      }
+    printf("%lu point lights\n", lights.size());
+  }
+
+  void updateLights()
+  {
+    float t = sceneTime;
+    for (size_t i = 0; i < lights.size(); i++)
+      {
+        const lightMotion &m = lightMotions[i];
+        float angle = m.phase + t * m.speed;
+        lights[i].position[0] = m.center[0] + m.orbit * cos(angle);
+        lights[i].position[1] = m.center[1] + m.orbit * sin(angle);
+        lights[i].position[2] = m.center[2];
+      }
+  }
+
+  // Stream the binned lights and point the texture buffer views at them
+  void uploadLights()
+  {
+    const vector<uint32_t> &grid = clusterer->grid();
+    const vector<uint16_t> &indices = clusterer->indices();
+    const GLenum formats[3] = { GL_RG32UI, GL_R16UI, GL_RGBA32F };
+    const GLenum units[3] = { LIGHT_GRID_UNIT, LIGHT_INDEX_UNIT, LIGHT_DATA_UNIT };
+    const size_t texelBytes[3] = { 2 * sizeof(uint32_t), sizeof(uint16_t), 4 * sizeof(float) };
+    const void *sources[3] = { grid.data(), indices.data(), lights.data() };
+    const size_t used[3] = { grid.size() * sizeof(uint32_t), indices.size() * sizeof(uint16_t),
+                             lights.size() * sizeof(PointLight) };
+    size_t offsets[3], sizes[3];
+
+    for (int i = 0; i < 3; i++)
+      {
+        sizes[i] = max(used[i], texelBytes[i]);
+        void *data = stream->allocate(sizes[i], max(texelBytes[i], (size_t) textureBufferAlignment), &offsets[i]);
+        if (used[i])
+          memcpy(data, sources[i], used[i]);
+        stream->commit(offsets[i], sizes[i]);
+        lightBase[i] = textureBufferRange ? 0 : offsets[i] / texelBytes[i];
+      }
+
+    pointLightsShown = true;
+    for (int i = 0; i < 3; i++)
+      {
+        if (lightBase[i] + sizes[i] / texelBytes[i] > (size_t) maxTextureBufferTexels)
+          pointLightsShown = false;
+      }
+    if (!pointLightsShown && !pointLightsWarned)
+      {
+        printf("Light data is past the texture buffer limit of %d texels, frames that hit it have no point lights\n",
+               maxTextureBufferTexels);
+        pointLightsWarned = true;
+      }
+
+    // A spill moves every allocation of the frame along, so the views are made after the last one
+    for (int i = 0; i < 3; i++)
+      {
+        glActiveTexture(GL_TEXTURE0 + units[i]);
+        glBindTexture(GL_TEXTURE_BUFFER, lightTextures[i]);
+        if (textureBufferRange)
+          glTexBufferRange(GL_TEXTURE_BUFFER, formats[i], stream->id(), offsets[i], sizes[i]);
+        else
+          glTexBuffer(GL_TEXTURE_BUFFER, formats[i], stream->id());
+      }
+    glActiveTexture(GL_TEXTURE0);
+    stats.lightEntries = indices.size();
+  }
+
+  void initShadows()
+  {
+    shadowShader.reset(new ShaderProgram("src/shadow.vs", "src/depth.fs", &*staticShader));
+    shadowLightViewProjection = shadowShader->uniform("lightViewProjection");
+    copyImage = GLEW_ARB_copy_image;
+
+    glGenTextures(2, shadowTextures);
+    for (int i = 0; i < 2; i++)
+      {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, shadowTextures[i]);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, shadowMapSize, shadowMapSize, shadowCascades,
+                     0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+      }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenFramebuffers(2, shadowFramebuffers);
+    for (int i = 0; i < 2; i++)
+      {
+        glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffers[i]);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+      }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    for (int i = 0; i < 4; i++)
+      {
+        shadowArrays[i] = pools[i]->createVertexArray();
+        staticShader->setupShadowArray(pools[i]->stride);
+      }
+    glBindVertexArray (0);
+
+    // The bounding sphere of a view slice only depends on the projection, so cascade extents never change
+    float k = 1.0 / (projection[0][0] * projection[0][0]) + 1.0 / (projection[1][1] * projection[1][1]);
+    float splitNear = 0;
+    for (int c = 0; c < shadowCascades; c++)
+      {
+        float t = (c + 1.0) / shadowCascades;
+        float n = splitNear;
+        float f = shadowSplitLambda * shadowSplitNear * pow(shadowDistance / shadowSplitNear, t)
+          + (1.0 - shadowSplitLambda) * (shadowSplitNear + (shadowDistance - shadowSplitNear) * t);
+        float distance = min(f, (f + n) * (1 + k) / 2);
+        float radius = max(sqrt(f * f * k + (f - distance) * (f - distance)),
+                           sqrt(n * n * k + (distance - n) * (distance - n)));
+        cascades[c].distance = distance;
+        cascades[c].splitFar = f;
+        // Snapping moves the center up to a sixteenth of the side, the sphere still fits
+        cascades[c].extent = 2 * radius * 8 / 7;
+        cascades[c].valid = false;
+        splitNear = f;
+        printf("Shadow cascade %d to %.1f, %.1f units across\n", c, f, cascades[c].extent);
+      }
+    gl_error();
+  }
+
+  // Fit every cascade around its view slice, a cascade whose snapped center moved
+  // or whose light changed has its cached static layer redrawn
+  void updateShadowCascades()
+  {
+    vec3 light = normalize(sunPosition);
+    bool lightMoved = light != shadowLight;
+    if (lightMoved)
+      {
+        shadowLight = light;
+        shadowView = lookAt(vec3(0), -light, fabs(light.y) < 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0));
+
+        // Depth range over the scene as loaded, casters outside it are clamped
+        const float margin = 10.0;
+        btVector3 lower, upper;
+        sceneBounds(lower, upper);
+        shadowDepth[0] = FLT_MAX;
+        shadowDepth[1] = -FLT_MAX;
+        for (int k = 0; k < 8; k++)
+          {
+            vec4 corner(k & 1 ? upper.x() : lower.x(), k & 2 ? upper.y() : lower.y(), k & 4 ? upper.z() : lower.z(), 1);
+            float depth = -(shadowView * corner).z;
+            shadowDepth[0] = min(shadowDepth[0], depth - margin);
+            shadowDepth[1] = max(shadowDepth[1], depth + margin);
+          }
+      }
+
+    for (int c = 0; c < shadowCascades; c++)
+      {
+        shadowCascade &cascade = cascades[c];
+        vec4 center = shadowView * vec4(eye + forward * cascade.distance, 1);
+        float step = cascade.extent / 8;
+        float x = floor(center.x / step + 0.5) * step, y = floor(center.y / step + 0.5) * step;
+        if (lightMoved || x != cascade.center[0] || y != cascade.center[1])
+          {
+            cascade.center[0] = x;
+            cascade.center[1] = y;
+            cascade.valid = false;
+          }
+        float half = cascade.extent / 2;
+        cascade.viewProjection = ortho(x - half, x + half, y - half, y + half, shadowDepth[0], shadowDepth[1]) * shadowView;
+      }
+  }
+
+  // Whether a world space box overlaps the square of a cascade in light space, depth is unbounded
+  bool castsInto(const shadowCascade &cascade, const float *aabbMin, const float *aabbMax) const
+  {
+    vec3 lower = make_vec3(aabbMin), upper = make_vec3(aabbMax);
+    vec3 center = (lower + upper) * 0.5f, half = (upper - lower) * 0.5f;
+    for (int axis = 0; axis < 2; axis++)
+      {
+        float p = shadowView[0][axis] * center.x + shadowView[1][axis] * center.y
+          + shadowView[2][axis] * center.z + shadowView[3][axis];
+        float r = fabs(shadowView[0][axis]) * half.x + fabs(shadowView[1][axis]) * half.y
+          + fabs(shadowView[2][axis]) * half.z;
+        if (fabs(p - cascade.center[axis]) > cascade.extent / 2 + r)
+          return false;
+      }
+    return true;
+  }
+
+  // Static casters (no inverse mass) go into stale cached layers at full detail,
+  // the rest into every cascade with the level they are shaded with
+  void gatherShadowCasters()
+  {
+    shadowBatches.clear();
+    shadowModels.clear();
+
+    size_t staticBodies = 0;
+    for (auto const &object : objects)
+      {
+        for (int slot : object.second->slots)
+          {
+            const BodyState *state = body(slot);
+            staticBodies += state && state->isStatic;
+          }
+      }
+    if (staticBodies != shadowStaticBodies)
+      {
+        for (int c = 0; c < shadowCascades; c++)
+          cascades[c].valid = false;
+        shadowStaticBodies = staticBodies;
+      }
+
+    for (int c = 0; c < shadowCascades; c++)
+      {
+        for (auto const &object : objects)
+          {
+            Object *o = &*object.second;
+            if (!o->mesh || o->isSky)
+              continue;
+            if (!cascades[c].valid)
+              addShadowBatches(o, c, true);
+            addShadowBatches(o, c, false);
+          }
+      }
+  }
+
+  void addShadowBatches(Object *o, int cascade, bool isStatic)
+  {
+    shadowCasters.clear();
+    for (size_t i = 0; i < o->slots.size(); i++)
+      {
+        const BodyState *state = body(o->slots[i]);
+        if (!state || state->isStatic != isStatic)
+          continue;
+        if (castsInto(cascades[cascade], state->aabbMin, state->aabbMax))
+          shadowCasters.push_back(i);
+      }
+
+    for (int l = 0; l < (isStatic ? 1 : maxLods); l++)
+      {
+        shadowBatch batch = { o, cascade, l, isStatic, shadowModels.size() / 16, 0 };
+        for (size_t i : shadowCasters)
+          {
+            if (!isStatic && (i < o->lods.size() ? o->lods[i] : 0) != l)
+              continue;
+            float model[16];
+            memcpy(model, snapshot->bodies[o->slots[i]].transform, sizeof(model));
+            o->dequantize(model);
+            shadowModels.insert(shadowModels.end(), model, model + 16);
+            batch.count++;
+          }
+        if (batch.count)
+          shadowBatches.push_back(batch);
+      }
+  }
+
+  void drawShadowBatches(int cascade, bool isStatic, GLuint baseInstance)
+  {
+    for (int p = 0; p < 4; p++)
+      {
+        for (const shadowBatch &b : shadowBatches)
+          {
+            if (b.cascade == cascade && b.isStatic == isStatic && b.object->mesh->pool == &*pools[p])
+              commands.push_back(b.object->mesh->command(b.count, baseInstance + b.first, b.lod));
+          }
+        if (commands.empty())
+          continue;
+        glBindVertexArray (shadowArrays[p]);
+        bound.pool = &*pools[p];
+        flushCommands();
+      }
+  }
+
+  void attachShadowLayer(GLenum target, int texture, int cascade)
+  {
+    glBindFramebuffer(target, shadowFramebuffers[texture]);
+    glFramebufferTextureLayer(target, GL_DEPTH_ATTACHMENT, shadowTextures[texture], 0, cascade);
+  }
+
+  // Refresh stale static layers, then start each map layer from its static layer and add the dynamic casters
+  void drawShadows()
+  {
+    size_t offset = 0;
+    if (!shadowModels.empty())
+      {
+        size_t bytes = shadowModels.size() * sizeof(float);
+        memcpy(stream->allocate(bytes, sizeof(ShadowInstance), &offset), &shadowModels[0], bytes);
+        stream->commit(offset, bytes);
+      }
+    GLuint baseInstance = offset / sizeof(ShadowInstance);
+
+    resetState();
+    shadowShader->use();
+    shadowPass = true;
+    glViewport(0, 0, shadowMapSize, shadowMapSize);
+    glEnable(GL_DEPTH_CLAMP);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0, 4.0);
+    glDisable(GL_CULL_FACE);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+
+    for (int c = 0; c < shadowCascades; c++)
+      {
+        shadowShader->setMatrix(shadowLightViewProjection, value_ptr(cascades[c].viewProjection));
+
+        unsigned int drawCalls = stats.drawCalls;
+        if (!cascades[c].valid)
+          {
+            attachShadowLayer(GL_FRAMEBUFFER, 0, c);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            drawShadowBatches(c, true, baseInstance);
+            cascades[c].valid = true;
+            stats.shadowCascadesRebuilt++;
+          }
+        stats.shadowStaticDraws += stats.drawCalls - drawCalls;
+
+        if (copyImage)
+          glCopyImageSubData(shadowTextures[0], GL_TEXTURE_2D_ARRAY, 0, 0, 0, c,
+                             shadowTextures[1], GL_TEXTURE_2D_ARRAY, 0, 0, 0, c, shadowMapSize, shadowMapSize, 1);
+        else
+          {
+            attachShadowLayer(GL_READ_FRAMEBUFFER, 0, c);
+            attachShadowLayer(GL_DRAW_FRAMEBUFFER, 1, c);
+            glBlitFramebuffer(0, 0, shadowMapSize, shadowMapSize, 0, 0, shadowMapSize, shadowMapSize,
+                              GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+          }
+
+        drawCalls = stats.drawCalls;
+        attachShadowLayer(GL_FRAMEBUFFER, 1, c);
+        drawShadowBatches(c, false, baseInstance);
+        stats.shadowDynamicDraws += stats.drawCalls - drawCalls;
+      }
+
+    shadowPass = false;
+    glBindFramebuffer(GL_FRAMEBUFFER, targetFramebuffer);
+    glViewport(0, 0, screenWidth, screenHeight);
+    glDisable(GL_DEPTH_CLAMP);
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glEnable(GL_CULL_FACE);
+    glBindVertexArray (0);
+    resetState();
+
+    glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowTextures[1]);
+    glActiveTexture(GL_TEXTURE0);
+  }
+
+  // Mark the slots whose snapshot box touches the view frustum with the current frame number
+  void cullBodies(const mat4 &m)
+  {
+    // Gribb-Hartmann planes of projection * camera, inside when n.p + d >= 0
+    vec3 normals[6];
+    float offsets[6];
+    for (int i = 0; i < 3; i++)
+      {
+        for (int side = 0; side < 2; side++)
+          {
+            float sign = side ? -1.0 : 1.0;
+            normals[i * 2 + side] = vec3(m[0][3] + sign * m[0][i],
+                                         m[1][3] + sign * m[1][i],
+                                         m[2][3] + sign * m[2][i]);
+            offsets[i * 2 + side] = m[3][3] + sign * m[3][i];
+          }
+      }
+
+    frameNumber++;
+    const vector<BodyState> &bodies = snapshot->bodies;
+    visibleFrames.resize(bodies.size(), -1);
+    for (size_t i = 0; i < bodies.size(); i++)
+      {
+        if (!bodies[i].valid)
+          continue;
+        // Test the corner furthest along each plane normal
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; p++)
+          {
+            const vec3 &n = normals[p];
+            float d = offsets[p]
+              + n.x * (n.x >= 0 ? bodies[i].aabbMax[0] : bodies[i].aabbMin[0])
+              + n.y * (n.y >= 0 ? bodies[i].aabbMax[1] : bodies[i].aabbMin[1])
+              + n.z * (n.z >= 0 ? bodies[i].aabbMax[2] : bodies[i].aabbMin[2]);
+            inside = d >= 0;
+          }
+        if (inside)
+          visibleFrames[i] = frameNumber;
+      }
+  }
+
+  void drawScene()
+  {
+    Material defaultMaterial;
+    memset(&stats, 0, sizeof(stats));
+    resetState();
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glClearColor(0,0,0,0);
+    glEnable(GL_CULL_FACE);
+    glEnable(GL_DEPTH_TEST);
+    // Front faces, whenever culling is on: only the sky enables it, seen from inside
+    glCullFace(GL_FRONT);
+    glDepthMask(GL_TRUE);
+
+    mat4 viewProjection = projection * look;
+    profiler.begin("cull");
+    cullBodies(viewProjection);
+    occlusion->finish();
+    profiler.end();
+
+    // Lights are binned on the clusterer's workers while the draw list is gathered
+    updateLights();
+    clusterer->begin(lights, value_ptr(look), value_ptr(projection));
+
+    profiler.begin("gather");
+    queue.clear();
+    depthQueue.clear();
+    drawItems.clear();
+    transforms.clear();
+    for (const auto &object : objects)
+      {
+        Object *o = &*object.second;
+        if (!o->mesh)
+          {
+            printf("No mesh for %s\n", o->name.c_str());
+            continue;
+          }
+        stats.totalBodies += o->bodies.size();
+
+        float depth = o->gatherInstances(eye, frameNumber, projection[1][1], occlusionCulling ? &*occlusion : NULL,
+                                         *snapshot, visibleFrames, transforms, &stats.occludedBodies);
+        stats.visibleBodies += o->instanceCount;
+        if (!o->instanceCount)
+          continue;
+
+        Material *material = o->mesh->hasTexture ? &materials.at(o->mesh->material_idx) : &defaultMaterial;
+        unsigned int materialKey = o->mesh->hasTexture ? o->mesh->material_idx + 1 : 0;
+        unsigned int shaderKey = o->mesh->shader->id(), textureKey = o->mesh->hasTexture ? o->mesh->texture + 1 : 0;
+        unsigned int vaoKey = o->mesh->pool->vao;
+        drawItem item = { o, material, 0, 0 };
+
+        uint64_t key;
+        if (o->tint[3] < 1.0 || material->diffuse[3] < 1.0)
+          key = RenderQueue::makeDepthKey(PASS_TRANSPARENT, depth, true, shaderKey, textureKey, materialKey, vaoKey);
+        else if (o->isSky)
+          key = RenderQueue::makeKey(PASS_SKY, shaderKey, textureKey, materialKey, vaoKey, depth);
+        else if (depthPrepass)
+          {
+            // The pre-pass resolves visibility, shading can follow state order
+            key = RenderQueue::makeKey(PASS_OPAQUE, shaderKey, textureKey, materialKey, vaoKey, depth);
+            depthQueue.push(RenderQueue::makeDepthKey(PASS_OPAQUE, depth, false, 0, 0, 0, vaoKey), drawItems.size());
+          }
+        else
+          key = RenderQueue::makeDepthKey(PASS_OPAQUE, depth, false, shaderKey, textureKey, materialKey, vaoKey);
+        queue.push(key, drawItems.size());
+        drawItems.push_back(item);
+      }
+    queue.sort();
+    depthQueue.sort();
+
+    updateShadowCascades();
+    gatherShadowCasters();
+    profiler.end();
+
+    size_t selectedIndex = 0;
+    {
+      const float summonDistance = 10.0;
+
+      vec3 origin = playerPosition();
+      btTransform t;
+      t.setIdentity();
+      t.setOrigin(btVector3(origin.x, origin.y, origin.z));
+      t.setOrigin(t.getOrigin() + btVector3(forward.x * summonDistance,
+                                            forward.y * summonDistance,
+                                            forward.z * summonDistance));
       t.setOrigin(btVector3(round(t.getOrigin().x()),round(t.getOrigin().y()), round(t.getOrigin().z())));
-      opt.camera = t;
-      opt.selected = true;
 
-      if (createObj)
-        createObj->drawBufferr(opt, &defaultMaterial);
+      float mat[16];
+      t.getOpenGLMatrix(mat);
+      selectedIndex = transforms.add(mat);
     }
 
+    profiler.begin("transforms");
+    transforms.compute(value_ptr(viewProjection), &*jobs);
+    clusterer->finish();
+    profiler.end();
+
+    // Everything streamed this frame must fit one buffer, spill now rather than halfway through drawing
+    stream->reserve(sizeof(FrameUniforms) + transforms.size() * sizeof(InstanceData)
+                    + drawItems.size() * maxLods * (sizeof(InstanceData) + 2 * sizeof(DrawElementsIndirectCommand))
+                    + clusterer->grid().size() * sizeof(uint32_t) + (clusterer->indices().size() + 1) * sizeof(uint16_t)
+                    + (lights.size() + 1) * sizeof(PointLight)
+                    + shadowModels.size() * sizeof(float) + shadowBatches.size() * sizeof(DrawElementsIndirectCommand)
+                    + 4 * uniformAlignment + 3 * textureBufferAlignment + 8 * sizeof(ShadowInstance));
+    profiler.begin("upload");
+    uploadLights();
+    uploadFrameUniforms();
+
+    // Instance data is written once and shared by the pre-pass and the shading passes
+    itemCommands.clear();
+    for (drawItem &d : drawItems)
+      {
+        d.firstCommand = itemCommands.size();
+        d.object->writeInstances(transforms, *stream, itemCommands);
+        d.commandCount = itemCommands.size() - d.firstCommand;
+      }
+    profiler.end();
+
+    profiler.begin("shadows", true);
+    drawShadows();
+    profiler.end();
+    if (depthPrepass)
+      {
+        ProfileScope scope(profiler, "depth prepass", true);
+        drawDepthPrepass();
+      }
+
+    profiler.begin("shading", true);
+
+    GLuint fragmentQuery = fragmentQueries[frameNumber % queryLatency];
+    if (pipelineStatistics)
+      {
+        GLuint available = 0;
+        if (frameNumber > queryLatency)
+          glGetQueryObjectuiv(fragmentQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+          glGetQueryObjectui64v(fragmentQuery, GL_QUERY_RESULT, &fragmentInvocations);
+        glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, fragmentQuery);
+      }
+
+    // Opaque surfaces that passed the pre-pass are shaded exactly once
+    glDepthFunc(depthPrepass ? GL_EQUAL : GL_LESS);
+    glDepthMask(depthPrepass ? GL_FALSE : GL_TRUE);
+
+    unsigned int pass = PASS_OPAQUE;
+    for (const RenderItem &item : queue.items())
+      {
+        drawItem &d = drawItems[item.index];
+        if (RenderQueue::pass(item.key) != pass)
+          {
+            flushCommands();
+            pass = RenderQueue::pass(item.key);
+            beginPass(pass);
+          }
+        if (!isBound(d.object, d.material))
+          {
+            flushCommands();
+            bindState(d.object, d.material);
+          }
+        commands.insert(commands.end(), itemCommands.begin() + d.firstCommand,
+                        itemCommands.begin() + d.firstCommand + d.commandCount);
+      }
+    flushCommands();
+
+    if (createObj)
+      {
+        if (pass != PASS_TRANSPARENT)
+          beginPass(PASS_TRANSPARENT);
+        bindState(&*createObj, &defaultMaterial);
+        createObj->mesh->shader->set(createObj->mesh->shader->isHighlighted, 1);
+        commands.push_back(createObj->writeSelected(transforms, selectedIndex, *stream));
+        flushCommands();
+      }
+
+    if (pipelineStatistics)
+      glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+    profiler.end();
+
+    glBindVertexArray (0);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
     glDisable(GL_CULL_FACE);
     glDisable(GL_DEPTH_TEST);
     glDisable(GL_TEXTURE_2D);
     glDisable(GL_BLEND);
   }
 
+  // The sky fills whatever the opaque pass left, transparent surfaces blend over both without writing depth
+  void beginPass(unsigned int pass)
+  {
+    if (pass == PASS_SKY)
+      {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+      }
+    else if (pass == PASS_TRANSPARENT)
+      {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_FALSE);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      }
+  }
+
+  // Lay down opaque depth front to back with color writes off
+  void drawDepthPrepass()
+  {
+    if (!depthQueue.items().size())
+      return;
+
+    resetState();
+    depthShader->use();
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDisable(GL_CULL_FACE);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+
+    unsigned int drawCalls = stats.drawCalls;
+    for (const RenderItem &item : depthQueue.items())
+      {
+        drawItem &d = drawItems[item.index];
+        GeometryPool *pool = d.object->mesh->pool;
+        if (bound.pool != pool)
+          {
+            flushCommands();
+            glBindVertexArray (pool->vao);
+            bound.pool = pool;
+          }
+        commands.insert(commands.end(), itemCommands.begin() + d.firstCommand,
+                        itemCommands.begin() + d.firstCommand + d.commandCount);
+      }
+    flushCommands();
+    stats.prepassDrawCalls = stats.drawCalls - drawCalls;
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    resetState();
+  }
+
   void drawUI()  {
-    btVector3 playerPosition = player->body->getWorldTransform().getOrigin();
-    position(screenWidth, screenHeight, playerPosition.x(), playerPosition.y(), playerPosition.z());
+    vec3 origin = playerPosition();
+    position(screenWidth, screenHeight, origin.x, origin.y, origin.z);
+
+    char line[128];
+    snprintf(line, sizeof(line), "draw calls %u commands %u instances %u triangles %u",
+             stats.drawCalls, stats.commands, stats.instances, stats.triangles);
+    overlay(screenWidth, screenHeight, 0, line);
+    snprintf(line, sizeof(line), "binds shader %u vao %u texture %u material %u",
+             stats.shaderBinds, stats.vaoBinds, stats.textureBinds, stats.materialUploads);
+    overlay(screenWidth, screenHeight, 1, line);
+    snprintf(line, sizeof(line), "visible bodies %u of %u, physics step %.2f ms",
+             stats.visibleBodies, stats.totalBodies, physics->stepTime());
+    overlay(screenWidth, screenHeight, 2, line);
+    snprintf(line, sizeof(line), "depth pre-pass %s, %u draw calls, shaded fragments %llu",
+             depthPrepass ? "on" : "off", stats.prepassDrawCalls, (unsigned long long) fragmentInvocations);
+    overlay(screenWidth, screenHeight, 3, line);
+    snprintf(line, sizeof(line), "occlusion %s, %u occluders %u triangles, %u bodies culled",
+             occlusionCulling ? "on" : "off", occlusion->occluders(), occlusion->triangles(), stats.occludedBodies);
+    overlay(screenWidth, screenHeight, 4, line);
+    snprintf(line, sizeof(line), "point lights %lu, %u cluster entries, textures %lu using %lu of %lu MB",
+             lights.size(), stats.lightEntries, textures->count(), textures->used() >> 20, textures->budget() >> 20);
+    overlay(screenWidth, screenHeight, 5, line);
+    snprintf(line, sizeof(line), "shadows %d cascades, static %u draws %u rebuilt, dynamic %u draws",
+             shadowCascades, stats.shadowStaticDraws, stats.shadowCascadesRebuilt, stats.shadowDynamicDraws);
+    overlay(screenWidth, screenHeight, 6, line);
+
+    if (profiler.enabled())
+      drawProfiler(7);
+  }
+
+  // Average time of every profiled phase, nested phases indented under their parent, then a frame time graph
+  void drawProfiler(int firstLine)
+  {
+    float frameTimes[Profiler::HISTORY], total = 0;
+    profiler.frameTimes(frameTimes);
+    for (float t : frameTimes)
+      total += t;
+
+    char line[128];
+    int n = firstLine;
+    snprintf(line, sizeof(line), "frame %.2f ms (T hides)", total / Profiler::HISTORY);
+    overlay(screenWidth, screenHeight, n++, line);
+    for (const Profiler::zone &z : profiler.zones())
+      {
+        if (z.gpuMs >= 0)
+          snprintf(line, sizeof(line), "%*s%-16s cpu %6.2f ms  gpu %6.2f ms", 2 * z.depth, "", z.name, z.cpuMs, z.gpuMs);
+        else
+          snprintf(line, sizeof(line), "%*s%-16s cpu %6.2f ms", 2 * z.depth, "", z.name, z.cpuMs);
+        overlay(screenWidth, screenHeight, n++, line);
+      }
+    // Bars reach the top at two 60 Hz frames
+    graph(screenWidth, screenHeight, n, frameTimes, Profiler::HISTORY, 1000.0 / 30, 60);
   }
 
   void pollInput()
@@ -839,9 +2236,11 @@ private:
               case SDL_BUTTON_RIGHT:
                 //if (player_grounded)
                 {
-                  btVector3 velocity = player->body->getLinearVelocity();
-                  velocity.setZ(10);
-                  player->body->setLinearVelocity(velocity);
+                  physics->enqueue([this] {
+                      btVector3 velocity = player->body->getLinearVelocity();
+                      velocity.setZ(10);
+                      player->body->setLinearVelocity(velocity);
+                    });
                   //player_grounded = false;
                   break;
                 }
@@ -887,6 +2286,30 @@ private:
                 {
                   instancesToFile("bodies.dat");
                 }
+              if (keystate[SDL_SCANCODE_C])
+                {
+                  occlusionCulling = !occlusionCulling;
+                }
+              if (keystate[SDL_SCANCODE_P])
+                {
+                  depthPrepass = !depthPrepass;
+                }
+              if (keystate[SDL_SCANCODE_V])
+                {
+                  vsync = !vsync;
+                  SDL_GL_SetSwapInterval(vsync);
+                }
+              if (keystate[SDL_SCANCODE_T])
+                {
+                  profiler.setEnabled(!profiler.enabled());
+                }
+              if (keystate[SDL_SCANCODE_R])
+                {
+                  if (trace_enabled())
+                    trace_stop();
+                  else
+                    trace_start(traceFile);
+                }
               if (keystate[SDL_SCANCODE_Q]) {
                 playerInput[MIDDLE_CLICK] = 1;
               }
@@ -915,11 +2338,12 @@ private:
               playerInput[RIGHT] = keystate[SDL_SCANCODE_D] ? 1 : 0;
               playerInput[LEFT] = keystate[SDL_SCANCODE_A] ? 1 : 0;
               if (keystate[SDL_SCANCODE_ESCAPE])
-                throw logic_error("User quit");
+                running = false;
               break;
             }
           case SDL_QUIT:
-            exit(0);
+            running = false;
+            break;
           }
       }
 
@@ -927,16 +2351,45 @@ private:
 
 
 
+  // Look from where the player was at the last step, and hand this frame's input to the physics thread,
+  // which moves the player with it on every fixed step until the next frame's input arrives
   void updatePlayer() {
     {// Orientation
-      btVector3 playerOrigin = player->body->getWorldTransform().getOrigin();
-
-      eye = vec3(playerOrigin.x(), playerOrigin.y(), playerOrigin.z());
+      eye = playerPosition();
       forward = vec3( cos(playerYaw)*sin(playerPitch), cos(playerYaw) * cos(playerPitch), sin(playerYaw) );
 
       look =  lookAt(eye, eye + (forward * float(5.0)), up);
     }
 
+    {
+      playerCommand command;
+      memcpy(command.input, playerInput, sizeof(command.input));
+      command.forward = forward;
+      command.view = look;
+      command.projection = projection;
+      physics->enqueue([this, command] {
+          stepInput = command;
+          collision(command);
+        });
+    }
+
+    {
+      int i = 0;
+      for (auto &o : objects)
+        {
+          if (i++ == createObjIdx)
+            {
+              createObj = o.second;
+              break;
+            }
+        }
+    }
+  }
+
+  // Runs on the physics thread before every fixed step of dt seconds
+  void movePlayer(const playerCommand &command, float dt) {
+    const int *playerInput = command.input;
+    const vec3 &forward = command.forward;
     { // Velocity
       vec3 left = cross(forward, up);
       btVector3 velocity = player->body->getLinearVelocity();
@@ -959,9 +2412,8 @@ private:
         }
       if (inputDirection.length() == 0)
         {
-          btTransform t;
-          player->body->getMotionState()->getWorldTransform(t);
-          player->body->applyForce(btVector3(velocity.x() * breakFactor, velocity.y() * breakFactor, 0),t.getOrigin());
+          float brake = exp(-brakeRate * dt);
+          velocity = btVector3(velocity.x() * brake, velocity.y() * brake, velocity.z());
         }
       else
         {
@@ -1009,24 +2461,11 @@ private:
         } else {
         grappleTarget = false;
       }
-
-      {
-
-        int i = 0;
-        for (auto &o : objects)
-          {
-            if (i++ == createObjIdx)
-              {
-                createObj = o.second;
-                break;
-              }
-          }
-      }
-
     }
   }
 
-  void collision(void)
+  // Runs on the physics thread, picks the body in the middle of the command's view
+  void collision(const playerCommand &command)
   {
     int numManifolds = world->getDispatcher()->getNumManifolds();
     for (int i=0;i<numManifolds;i++)
@@ -1055,32 +2494,27 @@ private:
               }
           }
       }
-    btRigidBody *collisionBody = RayTrace(screenWidth/2, screenHeight/2);
-    if (collisionBody && !heldObject)
+    btRigidBody *collisionBody = RayTrace(screenWidth/2, screenHeight/2, command.view, command.projection);
+    // Bodies of objects have a slot, the object lists themselves belong to the main thread
+    if (collisionBody && !heldObject && collisionBody->getUserIndex() >= 0 && collisionBody != player->body)
       {
-        for (auto &o : objects)
-          for (btRigidBody *bodyInstance : o.second->bodies)
-            {
-              if (collisionBody == bodyInstance)
-                {
-                  if (playerInput[LEFT_CLICK] && collisionBody->getInvMass() != 0)
-                    heldObject = collisionBody;
-                  if (playerInput[MIDDLE_CLICK])
-                    grappleTarget = collisionBody;
-                }
-            }
+        if (command.input[LEFT_CLICK] && collisionBody->getInvMass() != 0)
+          heldObject = collisionBody;
+        if (command.input[MIDDLE_CLICK])
+          grappleTarget = collisionBody;
       }
   }
 
   void spawnCurrentObject() {
+    vec3 origin = playerPosition();
     btTransform t;
     t.setIdentity();
-    t.setOrigin(player->body->getWorldTransform().getOrigin());
+    t.setOrigin(btVector3(origin.x, origin.y, origin.z));
 
     const float radius = 10;
     t.setOrigin(t.getOrigin() + (btVector3(forward.x, forward.y, forward.z) * radius));
     t.setOrigin(btVector3(round(t.getOrigin().x()),round(t.getOrigin().y()), round(t.getOrigin().z())));
-    Instance instance = createObj->addInstance(world, t, 1.0 / createObj->body->getInvMass(), NULL);
+    Instance instance = createObj->addInstance(&*physics, t, 1.0 / createObj->body->getInvMass(), NULL);
     addedInstances.push_back(instance);
   }
 
@@ -1091,29 +2525,115 @@ private:
         btTransform t;
         t.setIdentity();
         t.setOrigin(btVector3(x*2,y*2,0));
-        Instance instance = objects["Cube.001"]->addInstance(world, t, 1.0 / objects["Cube.001"]->body->getInvMass(), NULL);
+        Instance instance = objects["Cube.001"]->addInstance(&*physics, t, 1.0 / objects["Cube.001"]->body->getInvMass(), NULL);
         addedInstances.push_back(instance);
       }
     }
   }
 
+  // Take the fixed steps that fit into the real time passed, at most maxSubSteps so a
+  // slow step cannot snowball, and draw the bodies the leftover fraction of a step along.
+  // Frames draw the steps started the frame before while the new ones run, the benchmark
+  // waits for its steps instead so every run draws the same states
+  void advancePhysics(double seconds)
+  {
+    double fixed = 1.0 / physicsOptions.rate;
+    physicsLag += seconds;
+    int steps = physicsLag / fixed;
+    if (steps > physicsOptions.maxSubSteps)
+      {
+        steps = physicsOptions.maxSubSteps;
+        physicsLag = steps * fixed;
+      }
+    physicsLag -= steps * fixed;
+    if (benchmark.enabled)
+      {
+        physics->step(fixed, steps, physicsLag / fixed);
+        physics->synchronize();
+        snapshot = &physics->acquire();
+      }
+    else
+      {
+        physics->wait();
+        snapshot = &physics->acquire();
+        physics->step(fixed, steps, physicsLag / fixed);
+      }
+  }
+
+  // Orbit once around the middle of the scene over the run, looking at it from above
+  void scriptCamera(int frame, int frames)
+  {
+    btVector3 lower, upper;
+    sceneBounds(lower, upper);
+    btVector3 center = (lower + upper) * 0.5, extent = upper - lower;
+    float angle = TWOPI * frame / frames;
+    float radius = 0.3 * max(extent.x(), extent.y());
+    eye = vec3(center.x() + radius * cos(angle), center.y() + radius * sin(angle), center.z() + 0.25 * extent.z() + 2.0);
+    forward = normalize(vec3(center.x(), center.y(), center.z()) - eye);
+    look = lookAt(eye, eye + forward * float(5.0), up);
+  }
+
 public:
-  Context(int argc, char **)
+  Context(int argc, char **argv, const PhysicsOptions &_physicsOptions, size_t _textureBudget)
+    : physicsOptions(_physicsOptions), textureBudget(_textureBudget)
   {
-    initSDL();
-    initGL();
-    initFreetype();
-    initBullet();
-    initScene();
-    initPhysics();
-    initRigidBodies();
-    spawnStuff();
+    if (!parse_benchmark_options(argc, argv, benchmark))
+      throw runtime_error("Usage: ss-engine [--benchmark [frames]] [--size WxH] [--warmup N] [--report FILE] "
+                          "[--dump-every N] [--dump-prefix PATH]");
+    jobs.reset(new JobSystem());
+    printf("Job system with %d threads\n", jobs->threads());
+
+    // GL tasks run on this thread, the rest on the workers as soon as their inputs are ready
+    TaskGraph startup(&*jobs);
+    int window = startup.add("window", {}, true, [this] {
+        if (benchmark.enabled)
+          {
+            headless.reset(new HeadlessContext(benchmark.width, benchmark.height));
+            screenWidth = benchmark.width;
+            screenHeight = benchmark.height;
+          }
+        else
+          initSDL();
+        initGL();
+      });
+    int font = startup.add("font", {}, false, [] { loadFont(); });
+    startup.add("text", {window, font}, true, [this] { initFreetype(&*stream); });
+    int bullet = startup.add("bullet world", {}, false, [this] { initBullet(); });
+    int bulletFile = startup.add("bullet file", {bullet}, false, [this] { loadPhysics(); });
+    int scene = startup.add("scene", {}, false, [this] { readScene(); });
+    int textures = startup.add("textures", {window, scene}, true, [this] { loadTextures(); });
+    int built = startup.add("meshes", {scene}, false, [this] { initMeshes(); });
+    int geometry = startup.add("geometry", {built, textures}, true, [this] { initGeometry(); });
+    startup.add("occlusion", {}, false, [this] { occlusion.reset(new OcclusionCuller(&*jobs)); });
+    int paired = startup.add("physics objects", {bulletFile, built}, false, [this] { initPhysics(); });
+    int bodies = startup.add("rigid bodies", {paired, scene}, false, [this] {
+        initRigidBodies();
+        spawnStuff();
+        // Bring the world and the first snapshot up to date before anything reads it
+        physics->synchronize();
+        snapshot = &physics->acquire();
+      });
+    startup.add("lights", {bodies}, false, [this] { initLights(); });
+    startup.add("shadows", {geometry, bodies}, true, [this] { initShadows(); });
+    startup.run();
+    startup.printTimings();
   }
 
   ~Context()
   {
+    // The physics thread steps the world and calls back into the Context, it is joined
+    // before anything it touches goes
+    physics.reset();
+    for (Material &m : materials)
+      {
+        textures->release(m.texture);
+      }
+    // Deletes textures, so it goes while the GL context is still there
+    textures.reset();
     delete player;
 
+    // Every body is in the world once, shapes are shared between bodies of the same object
+    vector<btCollisionShape*> shapes;
     for (int i=world->getNumCollisionObjects()-1; i>=0 ;i--)
       {
         btCollisionObject* obj = world->getCollisionObjectArray()[i];
@@ -1122,42 +2642,195 @@ public:
           {
             delete body->getMotionState();
           }
+        shapes.push_back(obj->getCollisionShape());
         world->removeCollisionObject( obj );
         delete obj;
       }
+    sort(shapes.begin(), shapes.end());
+    shapes.erase(unique(shapes.begin(), shapes.end()), shapes.end());
+    for (btCollisionShape *shape : shapes)
+      {
+        delete shape;
+      }
     destroyFreetype();
+    // Members are destroyed after SDL_Quit, when there is no GL context any more, so
+    // everything holding GL objects goes first
+    profiler.deleteQueries();
+    if (pipelineStatistics)
+      glDeleteQueries(queryLatency, fragmentQueries);
+    glDeleteTextures(3, lightTextures);
+    glDeleteFramebuffers(2, shadowFramebuffers);
+    glDeleteTextures(2, shadowTextures);
+    for (int i = 0; i < 4; i++)
+      {
+        pools[i].reset();
+      }
+    shadowShader.reset();
+    depthShader.reset();
+    staticShader.reset();
+    stream.reset();
     SDL_Quit();
   }
 
-
-  void loop()
+  // Render the scripted camera path offscreen as fast as possible and report the frame timings
+  void runBenchmark()
   {
-    srand(time(NULL));
-    while (1)
+    int frames = benchmark.warmup + benchmark.frames;
+    BenchmarkRecorder recorder(benchmark.warmup);
+    printf("Benchmarking %d frames after %d warmup frames at %dx%d\n",
+           benchmark.frames, benchmark.warmup, screenWidth, screenHeight);
+    textures->finish();
+    for (int frame = 0; frame < frames && running; frame++)
       {
-        tick = SDL_GetTicks();
-        world->stepSimulation(1/60.0);
-        collision();
-        pollInput();
-        updatePlayer();
+        TraceZone frameZone("frame");
+        recorder.beginFrame();
+        sceneTime = frame / 60.0;
+        advancePhysics(1/60.0);
+        scriptCamera(frame, frames);
+        queueOccluders();
+        stream->beginFrame();
+        // Keeps the texture budget in effect, the loads themselves were finished before the first frame
+        textures->update();
         drawScene();
         drawUI();
-        SDL_GL_SwapWindow(window);
+        stream->endFrame();
+        recorder.endFrame(stats.drawCalls, stats.triangles);
 
-        if(1000/60>=SDL_GetTicks()-tick)
+        int measured = frame - benchmark.warmup;
+        if (benchmark.dumpEvery && measured >= 0 && measured % benchmark.dumpEvery == 0)
           {
-            SDL_Delay(1000.0/60-(SDL_GetTicks()-tick));
+            char filename[512];
+            snprintf(filename, sizeof(filename), "%s%05d.ppm", benchmark.dumpPrefix.c_str(), measured);
+            headless->savePPM(filename);
           }
       }
+    recorder.finish();
+    recorder.writeReport(benchmark.report.c_str(), (const char *) glGetString(GL_RENDERER), screenWidth, screenHeight);
+  }
+
+
+  void loop()
+  {
+    if (benchmark.enabled)
+      {
+        runBenchmark();
+        return;
+      }
+    srand(time(NULL));
+    physics->setStepCallback([this](float dt) { movePlayer(stepInput, dt); });
+    Uint64 frequency = SDL_GetPerformanceFrequency(), lastCounter = SDL_GetPerformanceCounter();
+    while (running)
+      {
+        TraceZone frameZone("frame");
+        tick = SDL_GetTicks();
+        sceneTime = tick / 1000.0;
+        profiler.beginFrame();
+        // Bodies are drawn as of the steps that just finished while the next ones run
+        {
+          ProfileScope scope(profiler, "physics wait");
+          Uint64 counter = SDL_GetPerformanceCounter();
+          advancePhysics((counter - lastCounter) / (double) frequency);
+          lastCounter = counter;
+        }
+        {
+          ProfileScope scope(profiler, "input");
+          pollInput();
+          updatePlayer();
+        }
+        {
+          ProfileScope scope(profiler, "occluders");
+          queueOccluders();
+        }
+        {
+          ProfileScope scope(profiler, "stream wait");
+          stream->beginFrame();
+        }
+        {
+          ProfileScope scope(profiler, "textures");
+          textures->update();
+        }
+        {
+          ProfileScope scope(profiler, "drawScene");
+          drawScene();
+        }
+        {
+          ProfileScope scope(profiler, "drawUI", true);
+          drawUI();
+        }
+        stream->endFrame();
+        {
+          ProfileScope scope(profiler, "swap");
+          SDL_GL_SwapWindow(window);
+        }
+      }
   }
 
 };
 
+static const char *usage =
+  "Usage: ss-engine [--trace FILE] [--texture-budget MB] [--job-benchmark] [--cook-textures FILE...]\n"
+  "       [--physics-threads N] [--physics-scheduler default|openmp|tbb|ppl|sequential]\n"
+  "       [--physics-benchmark [steps]] [--physics-rate HZ] [--physics-substeps N]\n";
+
 int main( int argc, char *argv[] )
 {
+  // --trace FILE captures the timeline from startup on
+  trace_thread_name("main");
+  bool jobBenchmark = false;
+  // --texture-budget MB, no budget by default
+  size_t textureBudget = 0;
+  int args = 0;
+  for (int i = 0; i < argc; i++)
+    {
+      if ((!strcmp(argv[i], "--trace") || !strcmp(argv[i], "--texture-budget")) && i + 1 == argc)
+        {
+          printf("%s requires %s\n%s", argv[i], strcmp(argv[i], "--trace") ? "a size in MB" : "a file", usage);
+          return 1;
+        }
+      if (!strcmp(argv[i], "--trace"))
+        trace_start(argv[++i]);
+      else if (!strcmp(argv[i], "--job-benchmark"))
+        jobBenchmark = true;
+      else if (!strcmp(argv[i], "--texture-budget"))
+        {
+          const char *value = argv[++i];
+          char *end;
+          long megabytes = strtol(value, &end, 10);
+          if (end == value || *end || megabytes <= 0 || (unsigned long) megabytes > (SIZE_MAX >> 20))
+            {
+              printf("Invalid value for %s: %s\n%s", argv[i - 1], value, usage);
+              return 1;
+            }
+          textureBudget = (size_t) megabytes << 20;
+        }
+      else if (!strcmp(argv[i], "--cook-textures"))
+        return cook_textures(argc - i - 1, argv + i + 1) ? 0 : 1;
+      else
+        argv[args++] = argv[i];
+    }
+  argc = args;
+  if (jobBenchmark)
+    {
+      run_job_benchmark();
+      return 0;
+    }
+
+  PhysicsOptions physicsOptions;
+  if (!parse_physics_options(argc, argv, physicsOptions))
+    {
+      printf("%s", usage);
+      return 1;
+    }
+
   try
     {
-      Context *ctx = new Context(argc, argv);
+      if (physicsOptions.benchmarkSteps)
+        {
+          run_physics_benchmark(physicsOptions);
+          return 0;
+        }
+      // Destroyed on the way out of loop() or of an error, so everything is shut down before SDL_Quit
+      unique_ptr<Context> ctx(new Context(argc, argv, physicsOptions, textureBudget));
       ctx->loop();
     }
   catch (exception &e)
@@ -1,68 +1,107 @@
 #version 150
 
-uniform struct Light {
-   vec3 position;
-   vec3 intensities;
-   float attenuation;
-   float ambientCoefficient;
-} light;
+layout(std140) uniform Frame {
+   mat4 camera;
+   mat4 projection;
+   vec4 cameraPosition;
+   vec4 lightPosition;
+   vec4 lightIntensities;
+   float lightAmbientCoefficient;
+   float lightAttenuation;
+   // Tiles per pixel in xy, depth slice scale and bias in zw
+   vec4 clusterScale;
+   float clusterNear;
+   int pointLights;
+   // Texel offsets of the cluster grid, light indices and light data in their buffers
+   ivec4 clusterBase;
+   ivec4 clusterSize;
+   // Light space texture coordinates of each cascade and the view depth where it ends
+   mat4 shadowMatrix[3];
+   vec4 cascadeEnd;
+};
 
-uniform mat4 model;
-uniform mat4 camera;
-uniform mat4 projection;
-uniform vec4 color;
 uniform int texid;
 uniform int isHighlighted;
 uniform sampler2D tex;
 
-uniform vec3 cameraPosition;
 uniform float materialShininess;
+uniform vec3 materialDiffuse;
 uniform vec3 materialSpecularColor;
 
 uniform int sky;
 
-in vec3 vertexFrag;
+uniform samplerBuffer lightData;
+uniform usamplerBuffer lightGrid;
+uniform usamplerBuffer lightIndices;
+uniform sampler2DArrayShadow shadowMap;
+
+in vec3 surfacePosFrag;
 in vec3 normalFrag;
 in vec2 uvFrag;
+in vec3 crossFrag;
+flat in vec4 colorFrag;
 
 out vec4 finalColor;
 
 void main() 
 {
-    vec3 normal = normalize(transpose(inverse(mat3(model))) * normalFrag); 
-    //normal = normalFrag;
-    vec3 surfacePos = vec3(model * vec4(vertexFrag, 1));
-    vec4 surfaceColor = texid > 0 ? texture(tex, uvFrag) : color;
-    vec3 surfaceToLight = normalize(light.position - surfacePos);
-    vec3 surfaceToCamera = normalize(cameraPosition - surfacePos);
+    vec3 normal = normalize(normalFrag);
+    vec3 surfacePos = surfacePosFrag;
+    vec4 surfaceColor = texid > 0 ? texture(tex, uvFrag) : colorFrag;
+    vec3 surfaceToLight = normalize(lightPosition.xyz - surfacePos);
+    vec3 surfaceToCamera = normalize(cameraPosition.xyz - surfacePos);
+    vec3 intensities = lightIntensities.rgb * materialDiffuse;
     
     //ambient
-    vec3 ambient = light.ambientCoefficient * surfaceColor.rgb * light.intensities;
+    vec3 ambient = lightAmbientCoefficient * surfaceColor.rgb * intensities;
 
     //diffuse
     float diffuseCoefficient = max(0.0, dot(normal, surfaceToLight));
-    vec3 diffuse = diffuseCoefficient * surfaceColor.rgb * light.intensities;
+    vec3 diffuse = diffuseCoefficient * surfaceColor.rgb * intensities;
 
     //specular
     float specularCoefficient = 0.3;
     specularCoefficient = pow(max(0.0, dot(surfaceToCamera, reflect(-surfaceToLight, normal))), materialShininess);
-    vec3 specular = specularCoefficient * materialSpecularColor * light.intensities;
+    vec3 specular = specularCoefficient * materialSpecularColor * intensities;
     
     //attenuation
-    float distanceToLight = length(light.position - surfacePos);
-    float attenuation = 1.0 / (1.0 + light.attenuation * pow(distanceToLight, 2));
+    float distanceToLight = length(lightPosition.xyz - surfacePos);
+    float attenuation = 1.0 / (1.0 + lightAttenuation * pow(distanceToLight, 2));
+
+    //shadow from the cascade covering this depth, filtered 2x2 by the comparison sampler
+    float viewDepth = -(camera * vec4(surfacePos, 1.0)).z;
+    int cascade = viewDepth < cascadeEnd.x ? 0 : viewDepth < cascadeEnd.y ? 1 : 2;
+    vec4 shadowCoord = shadowMatrix[cascade] * vec4(surfacePos, 1.0);
+    float shadow = viewDepth < cascadeEnd.z ? texture(shadowMap, vec4(shadowCoord.xy, cascade, shadowCoord.z)) : 1.0;
 
     //linear color (color before gamma correction)
     //vec3 linearColor = ambient + attenuation*(diffuse + specular); // Specular buggy
-    vec3 linearColor = ambient + attenuation*(diffuse);
+    vec3 linearColor = ambient + attenuation*(diffuse)*shadow;
+
+    //point lights binned into the cluster of this fragment
+    int slice = viewDepth < clusterNear ? 0 : min(clusterSize.z - 1, int(floor(log(viewDepth) * clusterScale.z + clusterScale.w)) + 1);
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * clusterScale.xy), clusterSize.xy - 1);
+    int cluster = (slice * clusterSize.y + tile.y) * clusterSize.x + tile.x;
+    //none when the grid is out of the texture buffer's reach this frame
+    uvec2 range = pointLights > 0 ? texelFetch(lightGrid, clusterBase.x + cluster).xy : uvec2(0u);
+    vec3 pointDiffuse = vec3(0.0);
+    for (uint i = 0u; i < range.y; i++)
+    {
+            int light = clusterBase.z + 2 * int(texelFetch(lightIndices, clusterBase.y + int(range.x + i)).x);
+            vec4 positionRadius = texelFetch(lightData, light);
+            vec4 colorIntensity = texelFetch(lightData, light + 1);
+            vec3 toLight = positionRadius.xyz - surfacePos;
+            float distance = length(toLight);
+            float falloff = clamp(1.0 - distance / positionRadius.w, 0.0, 1.0);
+            pointDiffuse += colorIntensity.rgb * colorIntensity.a * falloff * falloff * max(0.0, dot(normal, toLight / max(distance, 0.0001)));
+    }
+    linearColor += pointDiffuse * surfaceColor.rgb * materialDiffuse;
     
     //final color (after gamma correction)
     vec3 gamma = vec3(1.0/2.2);
 
-    vec4 tv = camera * model * vec4(vertexFrag,1);
-
     const float crossRadius = 0.003;
-    float d = sqrt(pow(tv.x/tv.z, 2) + pow(tv.y/tv.z, 2));
+    float d = length(crossFrag.xy / crossFrag.z);
     if (sky != 0)
     {
             finalColor = surfaceColor;
@@ -70,16 +109,17 @@ void main()
             finalColor.rgb * gamma;
             finalColor.r = 0.1;
     }
-    else if (d < crossRadius)
-            finalColor = vec4(0.75,0,0,0.1);
     else
     {
             finalColor = vec4(pow(linearColor, gamma), surfaceColor.a);
             if (isHighlighted > 0)
             {
-                    finalColor = color;
+                    finalColor = colorFrag;
                     finalColor.a = 0.5;
             }
+            // Opaque surfaces are drawn without blending, tint the crosshair in here instead
+            if (d < crossRadius)
+                    finalColor.rgb = mix(finalColor.rgb, vec3(0.75,0,0), 0.1);
     }
 
     //finalColor = vec4(finalColor.xyz*0.01 + normalFrag, 1.0);
@@ -4,18 +4,44 @@ in vec3 vertex;
 in vec3 normal;
 in vec2 uv;
 
-uniform mat4 model;
-uniform mat4 camera;
-uniform mat4 projection;
-uniform vec4 color;
+// Per-instance attributes, matrices are precomputed on the CPU once per frame
+in mat4 mvp;
+in mat4 model;
+in mat3 normalMatrix;
+in vec4 tint;
 
-out vec3 vertexFrag;
+layout(std140) uniform Frame {
+        mat4 camera;
+        mat4 projection;
+        vec4 cameraPosition;
+        vec4 lightPosition;
+        vec4 lightIntensities;
+        float lightAmbientCoefficient;
+        float lightAttenuation;
+        vec4 clusterScale;
+        float clusterNear;
+        int pointLights;
+        ivec4 clusterBase;
+        ivec4 clusterSize;
+        mat4 shadowMatrix[3];
+        vec4 cascadeEnd;
+};
+
+out vec3 surfacePosFrag;
 out vec3 normalFrag;
 out vec2 uvFrag;
+out vec3 crossFrag;
+flat out vec4 colorFrag;
+
+// Shares depth with the depth pre-pass
+invariant gl_Position;
 
 void main() {
-        gl_Position = projection * camera * model * vec4(vertex, 1.0);
+        gl_Position = mvp * vec4(vertex, 1.0);
         uvFrag = uv;
-        normalFrag = normal;
-        vertexFrag = vertex;
+        normalFrag = normalMatrix * normal;
+        surfacePosFrag = vec3(model * vec4(vertex, 1.0));
+        // View space x and y over depth, recovered from clip space
+        crossFrag = vec3(gl_Position.x / projection[0][0], gl_Position.y / projection[1][1], gl_Position.w);
+        colorFrag = tint;
 };
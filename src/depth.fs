@@ -0,0 +1,5 @@
+#version 150
+
+void main()
+{
+}
@@ -0,0 +1,11 @@
+#version 150
+
+in vec3 vertex;
+in mat4 mvp;
+
+// Must match the shading pass bit for bit, it is depth tested with GL_EQUAL
+invariant gl_Position;
+
+void main() {
+        gl_Position = mvp * vec4(vertex, 1.0);
+};
@@ -0,0 +1,129 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <GL/glew.h>
+
+#include <geometry.h>
+
+GLushort pack_unorm16(float value, float min, float extent)
+{
+  float t = extent > 0.0f ? (value - min) / extent : 0.0f;
+  t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+  return (GLushort) (t * 65535.0f + 0.5f);
+}
+
+static GLuint pack_snorm10(float v)
+{
+  v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+  int i = (int) roundf(v * 511.0f);
+  return (GLuint) i & 0x3ff;
+}
+
+GLuint pack_snorm_2_10_10_10(float x, float y, float z)
+{
+  return pack_snorm10(x) | pack_snorm10(y) << 10 | pack_snorm10(z) << 20;
+}
+
+// IEEE 754 binary16, round to nearest, overflow to infinity and denormals kept
+GLushort pack_half(float value)
+{
+  uint32_t f;
+  memcpy(&f, &value, sizeof(f));
+
+  uint32_t sign = (f >> 16) & 0x8000;
+  int32_t exponent = (int32_t) ((f >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = f & 0x7fffff;
+
+  if (((f >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  if (exponent >= 31)
+    return sign | 0x7c00;
+  if (exponent <= 0)
+    {
+      if (exponent < -10)
+        return sign;
+      mantissa |= 0x800000;
+      uint32_t shift = 14 - exponent;
+      uint32_t half = mantissa >> shift;
+      if ((mantissa >> (shift - 1)) & 1)
+        half++;
+      return sign | half;
+    }
+
+  uint32_t half = sign | exponent << 10 | mantissa >> 13;
+  // Carrying into the exponent is the correct rounding here
+  if (mantissa & 0x1000)
+    half++;
+  return half;
+}
+
+GeometryPool::GeometryPool(size_t _stride, size_t _indexSize)
+  : vao(0), stride(_stride), indexSize(_indexSize), vbo(0), ebo(0), meshes(0)
+{
+}
+
+GeometryPool::~GeometryPool()
+{
+  if (vao) {
+    glDeleteVertexArrays(1, &vao);
+    if (!arrays.empty())
+      glDeleteVertexArrays(arrays.size(), &arrays[0]);
+    glDeleteBuffers(1, &vbo);
+    glDeleteBuffers(1, &ebo);
+  }
+}
+
+void GeometryPool::add(const void *vertices, size_t vertexCount,
+                       const unsigned int *indices, size_t indexCount,
+                       GLint *baseVertex, GLuint *firstIndex)
+{
+  *baseVertex = vertexdata.size() / stride;
+  *firstIndex = elements.size() / indexSize;
+
+  vertexdata.insert(vertexdata.end(), (const char *) vertices, (const char *) vertices + vertexCount * stride);
+  if (indexSize == 2)
+    {
+      for (size_t i = 0; i < indexCount; i++)
+        {
+          GLushort index = indices[i];
+          elements.insert(elements.end(), (const char *) &index, (const char *) &index + sizeof(index));
+        }
+    }
+  else
+    elements.insert(elements.end(), (const char *) indices, (const char *) (indices + indexCount));
+  meshes++;
+}
+
+void GeometryPool::upload()
+{
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+
+  glGenBuffers(1, &vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferData(GL_ARRAY_BUFFER, vertexdata.size(), vertexdata.empty() ? NULL : &vertexdata[0], GL_STATIC_DRAW);
+
+  glGenBuffers(1, &ebo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, elements.size(), elements.empty() ? NULL : &elements[0], GL_STATIC_DRAW);
+
+  printf("Geometry pool stride %lu index %lu: %u meshes, %lu vertices, %lu indices, %lu kb\n",
+         stride, indexSize * 8, meshes, vertexdata.size() / stride, elements.size() / indexSize,
+         (vertexdata.size() + elements.size()) / 1024);
+
+  // The data lives on the GPU from here on
+  std::vector<char>().swap(vertexdata);
+  std::vector<char>().swap(elements);
+}
+
+GLuint GeometryPool::createVertexArray()
+{
+  GLuint array;
+  glGenVertexArrays(1, &array);
+  glBindVertexArray(array);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+  arrays.push_back(array);
+  return array;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <GL/glew.h>
+
+// Layout consumed by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+  GLuint count;
+  GLuint instanceCount;
+  GLuint firstIndex;
+  GLint baseVertex;
+  GLuint baseInstance;
+};
+
+/*
+  Compact vertex layouts. Positions are 16-bit unsigned normalized against
+  the mesh bounds, normals are signed 2_10_10_10 and texture coordinates
+  half floats. The fourth position component only pads to 4 byte alignment.
+*/
+struct PackedVertex
+{
+  GLushort position[4];
+  GLuint normal;
+};
+
+struct PackedTexturedVertex
+{
+  GLushort position[4];
+  GLuint normal;
+  GLushort uv[2];
+};
+
+GLushort pack_unorm16(float value, float min, float extent);
+GLuint pack_snorm_2_10_10_10(float x, float y, float z);
+GLushort pack_half(float value);
+
+/*
+  Shared vertex and index storage for every mesh of one vertex format.
+  Meshes are appended on the CPU during import and addressed afterwards by
+  base vertex and first index, upload() then creates a single VBO, EBO and
+  VAO for the whole pool.
+*/
+class GeometryPool
+{
+public:
+  // Index size is either 2 or 4 bytes
+  GeometryPool(size_t stride, size_t indexSize);
+  ~GeometryPool();
+
+  void add(const void *vertices, size_t vertexCount,
+           const unsigned int *indices, size_t indexCount,
+           GLint *baseVertex, GLuint *firstIndex);
+
+  // Create the buffers and a vertex array, which is left bound for attribute setup
+  void upload();
+
+  // Another vertex array over the pool buffers, for passes with their own attribute
+  // layout. Owned by the pool and left bound for attribute setup
+  GLuint createVertexArray();
+
+  GLenum indexType() const { return indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT; }
+
+  GLuint vao;
+  size_t stride, indexSize;
+
+private:
+  GLuint vbo, ebo;
+  std::vector<char> vertexdata;
+  std::vector<char> elements;
+  std::vector<GLuint> arrays;
+  unsigned int meshes;
+
+  GeometryPool(const GeometryPool &);
+  GeometryPool &operator=(const GeometryPool &);
+};
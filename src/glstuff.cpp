@@ -3,11 +3,18 @@
 
 #include "stb_image.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <GL/glew.h>
 #include <GL/gl.h>
 
+#include <glstuff.h>
+#include <trace.h>
+
 using namespace std;
 
 static string read_file(const char *);
@@ -23,44 +30,179 @@ void gl_error()
     }
 }
 
-GLuint load_texture(char *file)
+// Largest texture side and mip chain a cooked file may claim
+const int ktx_max_size = 16384, ktx_max_levels = 16;
+
+const unsigned char ktx_identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+string cooked_texture_path(const char *file)
 {
-  unsigned int texture;
-  unsigned char *image;
-  int w, h, n, intfmt = 0, fmt = 0;
+  string path(file);
+  size_t dot = path.rfind('.'), slash = path.find_last_of("/\\");
+  if (dot != string::npos && (slash == string::npos || dot > slash))
+    path.erase(dot);
+  return path + ".ktx";
+}
+
+size_t compressed_level_bytes(GLenum format, int width, int height)
+{
+  size_t block = format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16;
+  return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * block;
+}
+
+// A KTX file as written by the cooker, compressed 2D levels only
+static bool read_ktx(const char *file, TextureImage &image)
+{
+  FILE *f = fopen(file, "rb");
+  if (!f)
+    return false;
+
+  struct stat info;
+  unsigned char identifier[12];
+  uint32_t header[13];
+  bool valid = !fstat(fileno(f), &info) && fread(identifier, 1, 12, f) == 12 && !memcmp(identifier, ktx_identifier, 12)
+    && fread(header, 4, 13, f) == 13 && header[0] == 0x04030201 && header[1] == 0
+    && (header[4] == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || header[4] == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+    && header[6] >= 1 && header[6] <= (uint32_t) ktx_max_size && header[7] >= 1 && header[7] <= (uint32_t) ktx_max_size
+    && header[8] == 0 && header[9] == 0 && header[10] == 1 && header[11] <= (uint32_t) ktx_max_levels
+    && header[12] <= (uint64_t) info.st_size - ftell(f) && !fseek(f, header[12], SEEK_CUR);
+  if (!valid)
+    {
+      fprintf(stderr, "'%s' is not a cooked texture\n", file);
+      fclose(f);
+      return false;
+    }
+
+  image.compressed = header[4];
+  image.width = header[6];
+  image.height = header[7];
+  image.components = image.compressed == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 3 : 4;
+  image.levels = max(header[11], 1u);
+  image.bytes = 0;
+  for (int l = 0; l < image.levels; l++)
+    image.bytes += compressed_level_bytes(image.compressed, max(image.width >> l, 1), max(image.height >> l, 1));
+  // Each level is preceded by its size, a file with less than that left is cut short
+  if (image.bytes + 4 * image.levels > (uint64_t) info.st_size - ftell(f))
+    {
+      fprintf(stderr, "'%s' is truncated\n", file);
+      fclose(f);
+      return false;
+    }
+  image.pixels = (unsigned char *) malloc(image.bytes);
+
+  size_t offset = 0;
+  for (int l = 0; l < image.levels && valid; l++)
+    {
+      uint32_t size;
+      size_t expected = compressed_level_bytes(image.compressed, max(image.width >> l, 1), max(image.height >> l, 1));
+      valid = fread(&size, 4, 1, f) == 1 && size == expected && fread(image.pixels + offset, 1, size, f) == size;
+      offset += expected;
+    }
+  fclose(f);
+  if (!valid)
+    {
+      fprintf(stderr, "'%s' is truncated\n", file);
+      free(image.pixels);
+      image.pixels = NULL;
+    }
+  return valid;
+}
+
+bool decode_texture(const char *file, TextureImage &image)
+{
+  TraceZone zone("decode_texture", file);
 
-  image = stbi_load(file, &w, &h, &n, 0);
+  // Cooked textures are used as long as they are newer than their source
+  string cooked = cooked_texture_path(file);
+  struct stat source, target;
+  if (GLEW_EXT_texture_compression_s3tc && !stat(cooked.c_str(), &target))
+    {
+      if (!stat(file, &source) && source.st_mtime > target.st_mtime)
+        fprintf(stderr, "%s is older than %s, cook it again\n", cooked.c_str(), file);
+      else if (read_ktx(cooked.c_str(), image))
+        {
+          printf("%s w:%d h:%d %d levels, %lu kb compressed\n", cooked.c_str(), image.width, image.height,
+                 image.levels, image.bytes / 1024);
+          return true;
+        }
+    }
+
+  image.pixels = stbi_load(file, &image.width, &image.height, &image.components, 0);
+  image.compressed = 0;
+  image.levels = 1;
 
-  if (!image) {
+  if (!image.pixels) {
     fprintf(stderr, "cannot load texture '%s'\n", file);
-    return 0;
+    return false;
   } else {
-    printf("%s w:%d h:%d comp:%d\n", file, w, h, n);
+    printf("%s w:%d h:%d comp:%d\n", file, image.width, image.height, image.components);
   }
+  image.bytes = (size_t) image.width * image.height * image.components;
+  return true;
+}
+
+GLuint upload_texture(TextureImage &image)
+{
+  unsigned int texture;
+  GLenum intfmt, fmt;
+  TraceZone zone("upload_texture");
 
-  if (n == 1) { intfmt = fmt = GL_LUMINANCE; }
-  if (n == 2) { intfmt = fmt = GL_LUMINANCE_ALPHA; }
-  if (n == 3) { intfmt = fmt = GL_RGB; }
-  if (n == 4) { intfmt = fmt = GL_RGBA; }
+  intfmt = fmt = texture_format(image.components);
 
   glGenTextures(1, &texture);
   glBindTexture(GL_TEXTURE_2D, texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexImage2D(GL_TEXTURE_2D, 0, intfmt, w, h, 0, fmt, GL_UNSIGNED_BYTE, image);
-  glGenerateMipmap(GL_TEXTURE_2D);
+  if (image.compressed)
+    upload_compressed_texture(image, image.pixels);
+  else
+    {
+      glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+      glTexImage2D(GL_TEXTURE_2D, 0, intfmt, image.width, image.height, 0, fmt, GL_UNSIGNED_BYTE, image.pixels);
+      glGenerateMipmap(GL_TEXTURE_2D);
+    }
 
-  free(image);
+  free(image.pixels);
+  image.pixels = NULL;
 
   return texture;
-};
+}
+
+void upload_compressed_texture(const TextureImage &image, const unsigned char *data)
+{
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.levels - 1);
+  size_t offset = 0;
+  for (int l = 0; l < image.levels; l++)
+    {
+      int w = max(image.width >> l, 1), h = max(image.height >> l, 1);
+      size_t bytes = compressed_level_bytes(image.compressed, w, h);
+      glCompressedTexImage2D(GL_TEXTURE_2D, l, image.compressed, w, h, 0, bytes, data + offset);
+      offset += bytes;
+    }
+}
+
+GLenum texture_format(int n)
+{
+  if (n == 1) { return GL_LUMINANCE; }
+  if (n == 2) { return GL_LUMINANCE_ALPHA; }
+  if (n == 3) { return GL_RGB; }
+  return GL_RGBA;
+}
+
+GLuint load_texture(char *file)
+{
+  TextureImage image;
+  if (!decode_texture(file, image))
+    return 0;
+  return upload_texture(image);
+}
 
 
 GLuint compile_shader(const char* vs, const char* fs)
 {
+  TraceZone zone("compile_shader", vs);
   string vertex = read_file(vs);
   string frag = read_file(fs);
 
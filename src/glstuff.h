@@ -1,5 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
 void gl_error();
 GLuint load_texture(char *file);
+// Decoded pixels waiting for upload_texture, which frees them
+struct TextureImage
+{
+  unsigned char *pixels;
+  int width, height, components;
+  // Block compressed format of a cooked texture, pixels then hold all levels back to back
+  GLenum compressed;
+  int levels;
+  size_t bytes;
+};
+// Decoding makes no GL calls and may run on any thread, a cooked texture is read instead when present
+bool decode_texture(const char *file, TextureImage &image);
+GLuint upload_texture(TextureImage &image);
+// Pixel format of an image with 1 to 4 components
+GLenum texture_format(int components);
+// Every level of a compressed image into the bound texture, data may be an offset into a pixel buffer
+void upload_compressed_texture(const TextureImage &image, const unsigned char *data);
+size_t compressed_level_bytes(GLenum format, int width, int height);
+// assets/rock.jpg is cooked into assets/rock.ktx
+std::string cooked_texture_path(const char *file);
+extern const unsigned char ktx_identifier[12];
 GLuint compile_shader(const char* vs, const char* fs);
 GLint get_attrib(GLuint program, const char *name);
 GLint get_uniform(GLuint program, const char *name);
@@ -0,0 +1,113 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <headless.h>
+
+using namespace std;
+
+HeadlessContext::HeadlessContext(int _width, int _height)
+  : display(EGL_NO_DISPLAY), context(EGL_NO_CONTEXT), width(_width), height(_height), fbo(0)
+{
+  // Prefer the surfaceless platform so no X or Wayland server is needed
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (getPlatformDisplay && clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless"))
+    display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (display == EGL_NO_DISPLAY)
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  EGLint major, minor;
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    throw runtime_error("No EGL display for headless rendering");
+  const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+  if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context"))
+    throw runtime_error("EGL display lacks EGL_KHR_surfaceless_context");
+
+  if (!eglBindAPI(EGL_OPENGL_API))
+    throw runtime_error("EGL cannot bind desktop OpenGL");
+
+  // Surfaceless displays may expose no configs at all, a context needs none when rendering to FBOs
+  EGLConfig config = EGL_NO_CONFIG_KHR;
+  if (!strstr(extensions, "EGL_KHR_no_config_context"))
+    {
+      const EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+      EGLint configs = 0;
+      if (!eglChooseConfig(display, configAttributes, &config, 1, &configs) || !configs)
+        throw runtime_error("No EGL config for desktop OpenGL");
+    }
+
+  // Same compatibility profile SDL hands out by default
+  context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+  if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    throw runtime_error("Failed to make a surfaceless EGL context current");
+  printf("Headless EGL %d.%d context, %dx%d\n", major, minor, width, height);
+}
+
+HeadlessContext::~HeadlessContext()
+{
+  if (fbo)
+    {
+      glDeleteFramebuffers(1, &fbo);
+      glDeleteRenderbuffers(2, renderbuffers);
+    }
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(display, context);
+  eglTerminate(display);
+}
+
+void HeadlessContext::loadEntryPoints()
+{
+  glewExperimental = GL_TRUE;
+  GLenum status = glewInit();
+  // A GLEW built for GLX loads the GL entry points before it looks for a GLX display, which
+  // EGL has none of. Whether it got that far shows in the entry points themselves
+  if (status == GLEW_ERROR_NO_GLX_DISPLAY && glGenFramebuffers && glGenVertexArrays && glCreateShader
+      && glBindBufferRange && glMapBufferRange && glFenceSync)
+    status = GLEW_OK;
+  if (status != GLEW_OK)
+    throw runtime_error(string("GLEW could not load GL entry points: ") + (const char *) glewGetErrorString(status));
+}
+
+void HeadlessContext::createFramebuffer()
+{
+  const GLenum formats[2] = { GL_RGBA8, GL_DEPTH_COMPONENT24 };
+  const GLenum attachments[2] = { GL_COLOR_ATTACHMENT0, GL_DEPTH_ATTACHMENT };
+  glGenFramebuffers(1, &fbo);
+  glGenRenderbuffers(2, renderbuffers);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  for (int i = 0; i < 2; i++)
+    {
+      glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[i]);
+      glRenderbufferStorage(GL_RENDERBUFFER, formats[i], width, height);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, attachments[i], GL_RENDERBUFFER, renderbuffers[i]);
+    }
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    throw runtime_error("Headless framebuffer is incomplete");
+  glViewport(0, 0, width, height);
+}
+
+bool HeadlessContext::savePPM(const char *filename)
+{
+  pixels.resize(width * height * 3);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    {
+      printf("Failed to open %s\n", filename);
+      return false;
+    }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int y = height - 1; y >= 0; y--)
+    fwrite(&pixels[y * width * 3], 1, width * 3, f);
+  fclose(f);
+  return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+#include <GL/glew.h>
+#include <EGL/egl.h>
+
+/*
+  GL context without a window, for benchmarks on machines with no display.
+  The context is made current on an EGL surfaceless display, which Mesa
+  provides even on llvmpipe. There is no default framebuffer, so frames are
+  drawn into a framebuffer object of a fixed size.
+*/
+class HeadlessContext
+{
+public:
+  HeadlessContext(int width, int height);
+  ~HeadlessContext();
+
+  // Load the GL entry points through GLEW, throws if they are missing
+  void loadEntryPoints();
+  // Create the render target and leave it bound, GL entry points must be loaded first
+  void createFramebuffer();
+  GLuint framebuffer() const { return fbo; }
+
+  // Read back the color buffer as a binary PPM, top row first
+  bool savePPM(const char *filename);
+
+private:
+  EGLDisplay display;
+  EGLContext context;
+  int width, height;
+  GLuint fbo, renderbuffers[2];
+  std::vector<unsigned char> pixels;
+
+  HeadlessContext(const HeadlessContext &);
+  HeadlessContext &operator=(const HeadlessContext &);
+};
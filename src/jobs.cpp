@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+#include <jobs.h>
+#include <trace.h>
+
+using namespace std;
+
+// Pool and queue of the calling thread when it is a worker
+static thread_local const JobSystem *currentSystem = NULL;
+static thread_local int currentWorker = -1;
+
+JobSystem::JobSystem(int count) : queued(0), sleeping(0), quit(false)
+{
+  if (count < 0)
+    count = (int) thread::hardware_concurrency() - 1;
+  // Waiting threads only help, somebody has to run jobs while they sleep
+  count = max(1, count);
+  for (int i = 0; i <= count; i++)
+    queues.push_back(new queue());
+  for (int i = 0; i < count; i++)
+    workers.push_back(thread(&JobSystem::work, this, i));
+}
+
+JobSystem::~JobSystem()
+{
+  {
+    lock_guard<mutex> l(sleepLock);
+    quit = true;
+  }
+  wake.notify_all();
+  for (thread &t : workers)
+    t.join();
+  for (queue *q : queues)
+    delete q;
+}
+
+void JobSystem::run(JobCounter &counter, const Job &job, const char *name)
+{
+  counter.pending.fetch_add(1, memory_order_relaxed);
+  queue *q = queues[currentSystem == this ? currentWorker : queues.size() - 1];
+  {
+    lock_guard<mutex> l(q->lock);
+    queuedJob j = { job, &counter, name };
+    q->jobs.push_back(j);
+  }
+  // Pairs with the sleeping count raised before a worker checks queued
+  queued.fetch_add(1);
+  if (sleeping.load())
+    {
+      lock_guard<mutex> l(sleepLock);
+      wake.notify_one();
+    }
+}
+
+void JobSystem::wait(JobCounter &counter)
+{
+  int index = currentSystem == this ? currentWorker : queues.size() - 1;
+  while (!counter.done())
+    {
+      queuedJob job;
+      if (take(index, job))
+        {
+          execute(job);
+          continue;
+        }
+      // Whatever is left runs elsewhere, look for new jobs now and then
+      unique_lock<mutex> l(doneLock);
+      finished.wait_for(l, chrono::microseconds(100), [&counter] { return counter.done(); });
+    }
+}
+
+bool JobSystem::help()
+{
+  queuedJob job;
+  if (!take(currentSystem == this ? currentWorker : queues.size() - 1, job))
+    return false;
+  execute(job);
+  return true;
+}
+
+void JobSystem::parallelFor(JobCounter &counter, size_t count, size_t grain, const RangeJob &job, const char *name)
+{
+  grain = max(grain, (size_t) 1);
+  for (size_t first = 0; first < count; first += grain)
+    {
+      size_t last = min(count, first + grain);
+      run(counter, [job, first, last] { job(first, last); }, name);
+    }
+}
+
+void JobSystem::parallelFor(size_t count, size_t grain, const RangeJob &job, const char *name)
+{
+  JobCounter counter;
+  parallelFor(counter, count, grain, job, name);
+  wait(counter);
+}
+
+bool JobSystem::take(int index, queuedJob &out)
+{
+  if (!queued.load(memory_order_relaxed))
+    return false;
+
+  // Newest own job first while it is likely still in cache, the oldest of the others
+  for (size_t k = 0; k < queues.size(); k++)
+    {
+      queue *q = queues[(index + k) % queues.size()];
+      lock_guard<mutex> l(q->lock);
+      if (q->jobs.empty())
+        continue;
+      if (k == 0)
+        {
+          out = move(q->jobs.back());
+          q->jobs.pop_back();
+        }
+      else
+        {
+          out = move(q->jobs.front());
+          q->jobs.pop_front();
+        }
+      queued.fetch_sub(1, memory_order_relaxed);
+      return true;
+    }
+  return false;
+}
+
+void JobSystem::execute(queuedJob &job)
+{
+  {
+    TraceZone zone(job.name);
+    job.job();
+  }
+  // The waiter may return and free the counter as soon as it reads zero
+  if (job.counter->pending.fetch_sub(1, memory_order_acq_rel) == 1)
+    {
+      lock_guard<mutex> l(doneLock);
+      finished.notify_all();
+    }
+}
+
+void JobSystem::work(int index)
+{
+  currentSystem = this;
+  currentWorker = index;
+  char name[32];
+  snprintf(name, sizeof(name), "job worker %d", index);
+  trace_thread_name(name);
+
+  int idle = 0;
+  while (true)
+    {
+      queuedJob job;
+      if (take(index, job))
+        {
+          execute(job);
+          idle = 0;
+          continue;
+        }
+      // Short gaps between jobs are common within a frame, yield a while before sleeping
+      if (++idle < 64)
+        {
+          this_thread::yield();
+          continue;
+        }
+      idle = 0;
+      unique_lock<mutex> l(sleepLock);
+      sleeping.fetch_add(1);
+      wake.wait(l, [this] { return queued.load() > 0 || quit; });
+      sleeping.fetch_sub(1);
+      if (quit)
+        return;
+    }
+}
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void run_job_benchmark()
+{
+  JobSystem jobs;
+  printf("Job system with %d threads\n", jobs.threads());
+
+  // Queue a batch of empty jobs from outside the pool and wait for all of them
+  {
+    const int count = 200000;
+    JobCounter counter;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+      jobs.run(counter, [] {});
+    jobs.wait(counter);
+    printf("%-36s %8.1f ns per job\n", "empty jobs, one batch", seconds_since(start) * 1e9 / count);
+  }
+
+  // Round trip of a single job, the latency a frame pays per dependency
+  {
+    const int count = 20000;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+      {
+        JobCounter counter;
+        jobs.run(counter, [] {});
+        jobs.wait(counter);
+      }
+    printf("%-36s %8.1f ns per job\n", "empty jobs, run and wait each", seconds_since(start) * 1e9 / count);
+  }
+
+  // Jobs spawning children on their own deques, spread by stealing
+  {
+    const int parents = 64, children = 1000;
+    JobCounter counter;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int p = 0; p < parents; p++)
+      {
+        jobs.run(counter, [&jobs] {
+            JobCounter inner;
+            for (int c = 0; c < children; c++)
+              jobs.run(inner, [] {});
+            jobs.wait(inner);
+          });
+      }
+    jobs.wait(counter);
+    printf("%-36s %8.1f ns per job\n", "nested empty jobs", seconds_since(start) * 1e9 / (parents * (children + 1)));
+  }
+
+  // parallelFor against the same loop on one thread
+  {
+    vector<float> values(1 << 24);
+    for (size_t i = 0; i < values.size(); i++)
+      values[i] = i & 1023;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < values.size(); i++)
+      values[i] = sqrtf(values[i] * 0.5f + 1.0f);
+    double serial = seconds_since(start);
+
+    const size_t grains[] = { 1 << 10, 1 << 14, 1 << 18 };
+    printf("%-36s %8.2f ms\n", "serial loop over 16M floats", serial * 1e3);
+    for (size_t grain : grains)
+      {
+        start = chrono::steady_clock::now();
+        jobs.parallelFor(values.size(), grain, [&values](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+              values[i] = sqrtf(values[i] * 0.5f + 1.0f);
+          });
+        double parallel = seconds_since(start);
+        char label[64];
+        snprintf(label, sizeof(label), "parallelFor, grain %zu", grain);
+        printf("%-36s %8.2f ms, %.2fx\n", label, parallel * 1e3, serial / parallel);
+      }
+  }
+}
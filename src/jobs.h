@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Jobs still to finish in a group, the group is done when it drops to zero
+struct JobCounter
+{
+  std::atomic<int> pending;
+  JobCounter() : pending(0) {}
+  bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+
+private:
+  JobCounter(const JobCounter &);
+  JobCounter &operator=(const JobCounter &);
+};
+
+/*
+  Work-stealing job scheduler. Every worker owns a deque, it pushes and pops
+  its own jobs at the back while idle workers steal from the front of the
+  others. Threads outside the pool, such as the main thread, push into a
+  shared deque of their own. Waiting on a counter runs queued jobs instead
+  of blocking, so jobs may spawn and wait for jobs of their own.
+
+  Counters must outlive their jobs, and a job must not be added to a
+  counter another thread is waiting on once that wait may have returned.
+*/
+class JobSystem
+{
+public:
+  typedef std::function<void()> Job;
+  typedef std::function<void(size_t first, size_t last)> RangeJob;
+
+  // One worker per core besides the calling thread when workers is negative
+  JobSystem(int workers = -1);
+  ~JobSystem();
+
+  // Queue a job, counter is raised now and lowered once the job has run.
+  // The job shows up on the trace timeline under name, a string literal
+  void run(JobCounter &counter, const Job &job, const char *name = "job");
+  // Run queued jobs until the counter drops to zero
+  void wait(JobCounter &counter);
+  // Run one queued job if there is any, for threads waiting on something else
+  bool help();
+
+  // Split [0, count) into ranges of at most grain items and queue one job per range
+  void parallelFor(JobCounter &counter, size_t count, size_t grain, const RangeJob &job, const char *name = "range job");
+  // The same, returning when every range has run
+  void parallelFor(size_t count, size_t grain, const RangeJob &job, const char *name = "range job");
+
+  // Workers plus the thread that waits
+  int threads() const { return workers.size() + 1; }
+
+private:
+  struct queuedJob
+  {
+    Job job;
+    JobCounter *counter;
+    const char *name;
+  };
+  struct queue
+  {
+    std::mutex lock;
+    std::deque<queuedJob> jobs;
+  };
+
+  void work(int index);
+  // Pop from the own queue or steal from another, false when every queue was empty
+  bool take(int index, queuedJob &out);
+  void execute(queuedJob &job);
+
+  std::vector<std::thread> workers;
+  // One per worker, the last one is shared by threads outside the pool
+  std::vector<queue*> queues;
+  std::atomic<int> queued, sleeping;
+  std::mutex sleepLock, doneLock;
+  std::condition_variable wake, finished;
+  bool quit;
+
+  JobSystem(const JobSystem &);
+  JobSystem &operator=(const JobSystem &);
+};
+
+// Scheduling overhead of empty jobs, nested jobs and parallelFor against serial loops
+void run_job_benchmark();
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+
+#include <lighting.h>
+
+using namespace std;
+
+LightClusterer::LightClusterer(JobSystem *_jobs, float _clusterNear, float clusterFar)
+  : clusterNear(_clusterNear), input(NULL), clusters(2 * CLUSTER_COUNT, 0), jobs(_jobs)
+{
+  scale = (CLUSTERS_Z - 1) / logf(clusterFar / clusterNear);
+  bias = -logf(clusterNear) * scale;
+
+  for (int i = 0; i < BATCHES; i++)
+    {
+      batches[i].firstSlice = CLUSTERS_Z * i / BATCHES;
+      batches[i].lastSlice = CLUSTERS_Z * (i + 1) / BATCHES;
+    }
+}
+
+LightClusterer::~LightClusterer()
+{
+  jobs->wait(binning);
+}
+
+int LightClusterer::slice(float depth) const
+{
+  if (depth < clusterNear)
+    return 0;
+  return min(CLUSTERS_Z - 1, (int) floorf(logf(depth) * scale + bias) + 1);
+}
+
+// Tile of a normalized device coordinate, clamped to the grid
+static inline int32_t tile(float ndc, int tiles)
+{
+  return max(0, min(tiles - 1, (int) floorf((ndc * 0.5f + 0.5f) * tiles)));
+}
+
+void LightClusterer::begin(const vector<PointLight> &lights, const float *_view, const float *_projection)
+{
+  finish();
+  memcpy(view, _view, sizeof(view));
+  memcpy(projection, _projection, sizeof(projection));
+  input = &lights;
+
+  // Pad to a multiple of four with lights that never overlap anything
+  size_t padded = (lights.size() + 3) & ~3;
+  for (int k = 0; k < 4; k++)
+    tileBounds[k].assign(padded, k & 1 ? -1 : CLUSTERS_X);
+  depthMin.assign(padded, FLT_MAX);
+  depthMax.assign(padded, -FLT_MAX);
+
+  const float *v = view;
+  for (size_t i = 0; i < lights.size(); i++)
+    {
+      const PointLight &light = lights[i];
+      const float *p = light.position;
+      float r = light.radius;
+      float x = v[0] * p[0] + v[4] * p[1] + v[8] * p[2] + v[12];
+      float y = v[1] * p[0] + v[5] * p[1] + v[9] * p[2] + v[13];
+      float depth = -(v[2] * p[0] + v[6] * p[1] + v[10] * p[2] + v[14]);
+      if (depth + r <= 0)
+        continue;
+
+      // Project the view space box around the sphere, the nearest depth widens it the most
+      float nearest = max(depth - r, 1e-3f), farthest = depth + r;
+      float minX = projection[0] * min((x - r) / nearest, (x - r) / farthest);
+      float maxX = projection[0] * max((x + r) / nearest, (x + r) / farthest);
+      float minY = projection[5] * min((y - r) / nearest, (y - r) / farthest);
+      float maxY = projection[5] * max((y + r) / nearest, (y + r) / farthest);
+      if (maxX < -1 || minX > 1 || maxY < -1 || minY > 1)
+        continue;
+
+      tileBounds[0][i] = tile(minX, CLUSTERS_X);
+      tileBounds[1][i] = tile(maxX, CLUSTERS_X);
+      tileBounds[2][i] = tile(minY, CLUSTERS_Y);
+      tileBounds[3][i] = tile(maxY, CLUSTERS_Y);
+      depthMin[i] = depth - r;
+      depthMax[i] = farthest;
+    }
+
+  for (int i = 0; i < BATCHES; i++)
+    {
+      batch *b = &batches[i];
+      jobs->run(binning, [this, b] { bin(b); }, "bin lights");
+    }
+}
+
+void LightClusterer::finish()
+{
+  jobs->wait(binning);
+  if (!input)
+    return;
+  input = NULL;
+
+  // Batches hold consecutive slices, so their lists concatenate in cluster order
+  lightIndices.clear();
+  uint32_t offset = 0;
+  for (batch &b : batches)
+    {
+      size_t first = b.firstSlice * CLUSTERS_X * CLUSTERS_Y;
+      for (size_t c = 0; c < b.counts.size(); c++)
+        {
+          clusters[2 * (first + c)] = offset;
+          clusters[2 * (first + c) + 1] = b.counts[c];
+          offset += b.counts[c];
+        }
+      lightIndices.insert(lightIndices.end(), b.indices.begin(), b.indices.end());
+    }
+}
+
+void LightClusterer::bin(batch *b)
+{
+  b->counts.assign((b->lastSlice - b->firstSlice) * CLUSTERS_X * CLUSTERS_Y, 0);
+  b->indices.clear();
+  size_t padded = depthMin.size();
+
+  for (int s = b->firstSlice; s < b->lastSlice; s++)
+    {
+      float sliceNear = s == 0 ? 0.0f : expf((s - 1 - bias) / scale);
+      float sliceFar = s == CLUSTERS_Z - 1 ? FLT_MAX : expf((s - bias) / scale);
+
+      // Lights whose depth range touches the slice
+      b->candidates.clear();
+      __m128 lower = _mm_set1_ps(sliceNear), upper = _mm_set1_ps(sliceFar);
+      for (size_t i = 0; i < padded; i += 4)
+        {
+          __m128 overlap = _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&depthMin[i]), upper),
+                                      _mm_cmpge_ps(_mm_loadu_ps(&depthMax[i]), lower));
+          int mask = _mm_movemask_ps(overlap);
+          for (int k = 0; k < 4; k++)
+            {
+              if (mask & (1 << k))
+                b->candidates.push_back(i + k);
+            }
+        }
+      if (b->candidates.empty())
+        continue;
+
+      size_t count = (b->candidates.size() + 3) & ~3;
+      for (int k = 0; k < 4; k++)
+        {
+          b->candidateBounds[k].assign(count, k & 1 ? -1 : CLUSTERS_X);
+          for (size_t c = 0; c < b->candidates.size(); c++)
+            b->candidateBounds[k][c] = tileBounds[k][b->candidates[c]];
+        }
+
+      for (int ty = 0; ty < CLUSTERS_Y; ty++)
+        {
+          __m128i y = _mm_set1_epi32(ty);
+          for (int tx = 0; tx < CLUSTERS_X; tx++)
+            {
+              __m128i x = _mm_set1_epi32(tx);
+              uint32_t &clusterCount = b->counts[((s - b->firstSlice) * CLUSTERS_Y + ty) * CLUSTERS_X + tx];
+              for (size_t c = 0; c < count; c += 4)
+                {
+                  __m128i minX = _mm_loadu_si128((const __m128i *) &b->candidateBounds[0][c]);
+                  __m128i maxX = _mm_loadu_si128((const __m128i *) &b->candidateBounds[1][c]);
+                  __m128i minY = _mm_loadu_si128((const __m128i *) &b->candidateBounds[2][c]);
+                  __m128i maxY = _mm_loadu_si128((const __m128i *) &b->candidateBounds[3][c]);
+                  // Inside when neither minimum is past the tile nor the tile past a maximum
+                  __m128i outside = _mm_or_si128(_mm_or_si128(_mm_cmpgt_epi32(minX, x), _mm_cmpgt_epi32(x, maxX)),
+                                                 _mm_or_si128(_mm_cmpgt_epi32(minY, y), _mm_cmpgt_epi32(y, maxY)));
+                  int mask = ~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xf;
+                  for (int k = 0; k < 4; k++)
+                    {
+                      if (mask & (1 << k))
+                        {
+                          b->indices.push_back(b->candidates[c + k]);
+                          clusterCount++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <jobs.h>
+
+// Layout matches two RGBA32F texels of the light texture buffer
+struct PointLight
+{
+  float position[3];
+  float radius;
+  float color[3];
+  float intensity;
+};
+
+/*
+  Bins point lights into view space froxels for clustered forward shading.
+  The view is split into CLUSTERS_X by CLUSTERS_Y screen tiles and
+  CLUSTERS_Z depth slices, exponentially spaced from clusterNear on and
+  with everything closer in the first slice. Batches of slices are binned
+  in parallel as jobs, light bounds are tested four at a time with SSE.
+
+  The grid holds an (offset, count) pair per cluster into the light index
+  list, clusters are ordered x fastest, then y, then z.
+*/
+class LightClusterer
+{
+public:
+  static const int CLUSTERS_X = 16, CLUSTERS_Y = 9, CLUSTERS_Z = 24;
+  static const int CLUSTER_COUNT = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+
+  LightClusterer(JobSystem *jobs, float clusterNear, float clusterFar);
+  ~LightClusterer();
+
+  // Start binning in jobs, the light list must stay untouched until finish()
+  void begin(const std::vector<PointLight> &lights, const float *view, const float *projection);
+  void finish();
+
+  const std::vector<uint32_t> &grid() const { return clusters; }
+  const std::vector<uint16_t> &indices() const { return lightIndices; }
+
+  // Slice of a view space depth is floor(log(depth) * sliceScale + sliceBias) + 1
+  float sliceScale() const { return scale; }
+  float sliceBias() const { return bias; }
+  float nearPlane() const { return clusterNear; }
+
+private:
+  // Consecutive slices binned by one job
+  static const int BATCHES = 8;
+  struct batch
+  {
+    int firstSlice, lastSlice;
+    std::vector<uint32_t> counts;
+    std::vector<uint16_t> indices;
+    std::vector<uint16_t> candidates;
+    std::vector<int32_t> candidateBounds[4];
+  };
+
+  void bin(batch *b);
+  int slice(float depth) const;
+
+  float clusterNear, scale, bias;
+  const std::vector<PointLight> *input;
+  float view[16], projection[16];
+
+  // View space bounds of each light, minX maxX minY maxY as tile ranges and depth range
+  std::vector<int32_t> tileBounds[4];
+  std::vector<float> depthMin, depthMax;
+
+  std::vector<uint32_t> clusters;
+  std::vector<uint16_t> lightIndices;
+
+  JobSystem *jobs;
+  batch batches[BATCHES];
+  JobCounter binning;
+
+  LightClusterer(const LightClusterer &);
+  LightClusterer &operator=(const LightClusterer &);
+};
@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <meshopt.h>
+
+void analyze_vertex_cache(const unsigned int *indices, size_t indexCount, size_t vertexCount,
+                          unsigned int cacheSize, float *acmr, float *atvr)
+{
+  // A vertex is in the FIFO while fewer than cacheSize misses happened since it entered
+  std::vector<size_t> entered(vertexCount, 0);
+  std::vector<bool> referenced(vertexCount, false);
+  size_t misses = 0, unique = 0;
+
+  for (size_t i = 0; i < indexCount; i++)
+    {
+      unsigned int v = indices[i];
+      if (!entered[v] || misses + 1 - entered[v] > cacheSize)
+        {
+          misses++;
+          entered[v] = misses;
+        }
+      if (!referenced[v])
+        {
+          referenced[v] = true;
+          unique++;
+        }
+    }
+
+  *acmr = indexCount ? (float) misses / (indexCount / 3) : 0.0f;
+  *atvr = unique ? (float) misses / unique : 0.0f;
+}
+
+/*
+  Sander, Nehab and Barczak, Fast Triangle Reordering for Vertex Locality and
+  Reduced Overdraw. Triangles are emitted as fans around a current vertex, the
+  next fan vertex is the cached neighbour that stays in the cache longest.
+*/
+void optimize_vertex_cache(unsigned int *indices, size_t indexCount, size_t vertexCount,
+                           unsigned int cacheSize, std::vector<size_t> *clusters)
+{
+  size_t triangleCount = indexCount / 3;
+  if (clusters)
+    clusters->clear();
+  if (!triangleCount)
+    return;
+
+  // Vertex to triangle adjacency in compressed rows
+  std::vector<unsigned int> live(vertexCount, 0);
+  for (size_t i = 0; i < indexCount; i++)
+    {
+      live[indices[i]]++;
+    }
+  std::vector<size_t> offsets(vertexCount + 1, 0);
+  for (size_t v = 0; v < vertexCount; v++)
+    {
+      offsets[v + 1] = offsets[v] + live[v];
+    }
+  std::vector<unsigned int> adjacency(indexCount);
+  std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < indexCount; i++)
+    {
+      adjacency[fill[indices[i]]++] = i / 3;
+    }
+
+  std::vector<unsigned int> output;
+  output.reserve(indexCount);
+  std::vector<size_t> cacheTime(vertexCount, 0);
+  std::vector<bool> emitted(triangleCount, false);
+  std::vector<unsigned int> deadEnd, candidates;
+  size_t time = cacheSize + 1, cursor = 0;
+  long fan = 0;
+  bool restart = true;
+
+  while (fan >= 0)
+    {
+      if (restart && clusters)
+        clusters->push_back(output.size());
+
+      candidates.clear();
+      for (size_t a = offsets[fan]; a < offsets[fan + 1]; a++)
+        {
+          unsigned int t = adjacency[a];
+          if (emitted[t])
+            continue;
+          for (int k = 0; k < 3; k++)
+            {
+              unsigned int v = indices[t * 3 + k];
+              output.push_back(v);
+              deadEnd.push_back(v);
+              candidates.push_back(v);
+              live[v]--;
+              if (time - cacheTime[v] > cacheSize)
+                {
+                  cacheTime[v] = time;
+                  time++;
+                }
+            }
+          emitted[t] = true;
+        }
+
+      // Prefer the candidate that is still cached and has the most time left in the cache
+      long next = -1;
+      long best = -1;
+      for (unsigned int v : candidates)
+        {
+          if (!live[v])
+            continue;
+          long priority = 0;
+          if (time - cacheTime[v] + 2 * live[v] <= cacheSize)
+            priority = time - cacheTime[v];
+          if (priority > best)
+            {
+              best = priority;
+              next = v;
+            }
+        }
+
+      restart = next < 0;
+      if (restart)
+        {
+          while (!deadEnd.empty() && next < 0)
+            {
+              unsigned int d = deadEnd.back();
+              deadEnd.pop_back();
+              if (live[d])
+                next = d;
+            }
+          while (next < 0 && cursor < vertexCount)
+            {
+              if (live[cursor])
+                next = cursor;
+              cursor++;
+            }
+          // A neighbour from the dead end stack is likely still cached
+          restart = next >= 0 && time - cacheTime[next] > cacheSize;
+        }
+      fan = next;
+    }
+
+  memcpy(indices, &output[0], indexCount * sizeof(unsigned int));
+}
+
+struct clusterOrder
+{
+  size_t begin, end;
+  float facing;
+
+  bool operator<(const clusterOrder &o) const { return facing > o.facing; }
+};
+
+void optimize_overdraw(unsigned int *indices, size_t indexCount, const float *positions,
+                       const std::vector<size_t> &clusters)
+{
+  if (clusters.size() < 2)
+    return;
+
+  float center[3] = {0, 0, 0};
+  for (size_t i = 0; i < indexCount; i++)
+    {
+      for (int k = 0; k < 3; k++)
+        center[k] += positions[indices[i] * 3 + k] / indexCount;
+    }
+
+  // Clusters whose area weighted normal points away from the mesh center occlude the rest
+  std::vector<clusterOrder> order(clusters.size());
+  for (size_t c = 0; c < clusters.size(); c++)
+    {
+      order[c].begin = clusters[c];
+      order[c].end = c + 1 < clusters.size() ? clusters[c + 1] : indexCount;
+
+      float normal[3] = {0, 0, 0}, centroid[3] = {0, 0, 0}, area = 0;
+      for (size_t i = order[c].begin; i < order[c].end; i += 3)
+        {
+          const float *p0 = &positions[indices[i] * 3];
+          const float *p1 = &positions[indices[i + 1] * 3];
+          const float *p2 = &positions[indices[i + 2] * 3];
+          float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+          float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+          float n[3] = { e1[1] * e2[2] - e1[2] * e2[1],
+                         e1[2] * e2[0] - e1[0] * e2[2],
+                         e1[0] * e2[1] - e1[1] * e2[0] };
+          float a = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+          for (int k = 0; k < 3; k++)
+            {
+              normal[k] += n[k];
+              centroid[k] += (p0[k] + p1[k] + p2[k]) / 3.0f * a;
+            }
+          area += a;
+        }
+
+      float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+      order[c].facing = 0;
+      if (area > 0 && length > 0)
+        {
+          for (int k = 0; k < 3; k++)
+            order[c].facing += (centroid[k] / area - center[k]) * normal[k] / length;
+        }
+    }
+
+  std::stable_sort(order.begin(), order.end());
+
+  std::vector<unsigned int> output;
+  output.reserve(indexCount);
+  for (const clusterOrder &c : order)
+    {
+      output.insert(output.end(), indices + c.begin, indices + c.end);
+    }
+  memcpy(indices, &output[0], indexCount * sizeof(unsigned int));
+}
+
+size_t optimize_vertex_fetch(unsigned int *indices, size_t indexCount, size_t vertexCount,
+                             std::vector<unsigned int> &remap)
+{
+  std::vector<unsigned int> renamed(vertexCount, ~0u);
+  remap.clear();
+
+  for (size_t i = 0; i < indexCount; i++)
+    {
+      unsigned int &v = indices[i];
+      if (renamed[v] == ~0u)
+        {
+          renamed[v] = remap.size();
+          remap.push_back(v);
+        }
+      v = renamed[v];
+    }
+  return remap.size();
+}
+
+// Symmetric 4x4 error quadric of a plane ax + by + cz + d = 0
+struct quadric
+{
+  double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+  void plane(double a, double b, double c, double d, double weight)
+  {
+    a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+    b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+    c2 += weight * c * c; cd += weight * c * d;
+    d2 += weight * d * d;
+  }
+
+  void add(const quadric &q)
+  {
+    a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+    b2 += q.b2; bc += q.bc; bd += q.bd;
+    c2 += q.c2; cd += q.cd;
+    d2 += q.d2;
+  }
+
+  double error(const float *p) const
+  {
+    double x = p[0], y = p[1], z = p[2];
+    return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+      + b2 * y * y + 2 * bc * y * z + 2 * bd * y
+      + c2 * z * z + 2 * cd * z
+      + d2;
+  }
+};
+
+static void triangle_normal(const float *p0, const float *p1, const float *p2, double n[3])
+{
+  double e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+  double e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+  n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+  n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+  n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+struct collapse
+{
+  double cost;
+  unsigned int from, to;
+
+  bool operator<(const collapse &o) const { return cost < o.cost; }
+};
+
+size_t simplify(unsigned int *destination, const unsigned int *indices, size_t indexCount,
+                const float *positions, size_t vertexCount, size_t targetIndexCount)
+{
+  std::vector<unsigned int> result(indices, indices + indexCount);
+
+  // Vertices split for attribute seams share a position with another vertex and stay locked
+  std::vector<bool> locked(vertexCount, false);
+  {
+    std::vector<unsigned int> byPosition(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++)
+      byPosition[v] = v;
+    std::sort(byPosition.begin(), byPosition.end(), [positions](unsigned int a, unsigned int b) {
+        return memcmp(&positions[a * 3], &positions[b * 3], 3 * sizeof(float)) < 0;
+      });
+    for (size_t i = 1; i < vertexCount; i++)
+      {
+        if (!memcmp(&positions[byPosition[i] * 3], &positions[byPosition[i - 1] * 3], 3 * sizeof(float)))
+          locked[byPosition[i]] = locked[byPosition[i - 1]] = true;
+      }
+  }
+
+  std::vector<quadric> quadrics(vertexCount);
+  memset(&quadrics[0], 0, vertexCount * sizeof(quadric));
+  {
+    // Directed edges without a twin lie on an open border
+    std::vector<unsigned long long> edges;
+    for (size_t i = 0; i < indexCount; i += 3)
+      {
+        for (int k = 0; k < 3; k++)
+          edges.push_back((unsigned long long) indices[i + k] << 32 | indices[i + (k + 1) % 3]);
+      }
+    std::sort(edges.begin(), edges.end());
+
+    for (size_t i = 0; i < indexCount; i += 3)
+      {
+        const float *p[3] = { &positions[indices[i] * 3], &positions[indices[i + 1] * 3], &positions[indices[i + 2] * 3] };
+        double n[3];
+        triangle_normal(p[0], p[1], p[2], n);
+        double area = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (area == 0)
+          continue;
+        for (int k = 0; k < 3; k++)
+          n[k] /= area;
+        double d = -(n[0] * p[0][0] + n[1] * p[0][1] + n[2] * p[0][2]);
+        for (int k = 0; k < 3; k++)
+          quadrics[indices[i + k]].plane(n[0], n[1], n[2], d, area);
+
+        for (int k = 0; k < 3; k++)
+          {
+            unsigned int a = indices[i + k], b = indices[i + (k + 1) % 3];
+            if (std::binary_search(edges.begin(), edges.end(), (unsigned long long) b << 32 | a))
+              continue;
+            locked[a] = locked[b] = true;
+          }
+      }
+  }
+
+  std::vector<unsigned int> remap(vertexCount), offsets(vertexCount + 1), adjacency;
+  std::vector<bool> touched(vertexCount);
+  std::vector<collapse> candidates;
+
+  while (result.size() > targetIndexCount)
+    {
+      size_t count = result.size();
+
+      std::fill(offsets.begin(), offsets.end(), 0);
+      for (size_t i = 0; i < count; i++)
+        offsets[result[i] + 1]++;
+      for (size_t v = 0; v < vertexCount; v++)
+        offsets[v + 1] += offsets[v];
+      adjacency.resize(count);
+      {
+        std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < count; i++)
+          adjacency[fill[result[i]]++] = i / 3;
+      }
+
+      candidates.clear();
+      for (size_t i = 0; i < count; i += 3)
+        {
+          for (int k = 0; k < 3; k++)
+            {
+              unsigned int a = result[i + k], b = result[i + (k + 1) % 3];
+              // Interior edges are seen from both sides, only take them once
+              if (a > b)
+                continue;
+              quadric q = quadrics[a];
+              q.add(quadrics[b]);
+              collapse c = { 0, 0, 0 };
+              double ab = q.error(&positions[b * 3]), ba = q.error(&positions[a * 3]);
+              if (!locked[a] && (locked[b] || ab <= ba))
+                c.cost = ab, c.from = a, c.to = b;
+              else if (!locked[b])
+                c.cost = ba, c.from = b, c.to = a;
+              else
+                continue;
+              candidates.push_back(c);
+            }
+        }
+      std::sort(candidates.begin(), candidates.end());
+
+      for (size_t v = 0; v < vertexCount; v++)
+        remap[v] = v;
+      std::fill(touched.begin(), touched.end(), false);
+
+      // Each collapse removes about two triangles
+      size_t limit = std::max<size_t>(1, (count - targetIndexCount) / 6);
+      size_t collapses = 0;
+      for (const collapse &c : candidates)
+        {
+          if (collapses >= limit)
+            break;
+          if (touched[c.from] || touched[c.to])
+            continue;
+
+          // Reject collapses that fold a triangle over
+          bool flips = false;
+          for (unsigned int a = offsets[c.from]; a < offsets[c.from + 1] && !flips; a++)
+            {
+              const unsigned int *t = &result[adjacency[a] * 3];
+              if (t[0] == c.to || t[1] == c.to || t[2] == c.to)
+                continue;
+              const float *p[3], *q[3];
+              for (int k = 0; k < 3; k++)
+                {
+                  p[k] = &positions[t[k] * 3];
+                  q[k] = t[k] == c.from ? &positions[c.to * 3] : p[k];
+                }
+              double before[3], after[3];
+              triangle_normal(p[0], p[1], p[2], before);
+              triangle_normal(q[0], q[1], q[2], after);
+              flips = before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0;
+            }
+          if (flips)
+            continue;
+
+          remap[c.from] = c.to;
+          quadrics[c.to].add(quadrics[c.from]);
+          for (unsigned int a = offsets[c.from]; a < offsets[c.from + 1]; a++)
+            {
+              for (int k = 0; k < 3; k++)
+                touched[result[adjacency[a] * 3 + k]] = true;
+            }
+          collapses++;
+        }
+
+      if (!collapses)
+        break;
+
+      size_t written = 0;
+      for (size_t i = 0; i < count; i += 3)
+        {
+          unsigned int a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+          if (a == b || b == c || c == a)
+            continue;
+          result[written++] = a;
+          result[written++] = b;
+          result[written++] = c;
+        }
+      result.resize(written);
+    }
+
+  if (!result.empty())
+    memcpy(destination, &result[0], result.size() * sizeof(unsigned int));
+  return result.size();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+/*
+  Index buffer optimization run on triangle lists at import. Positions are
+  three floats per vertex, indices are rewritten in place.
+*/
+
+// Post-transform cache size the orderings are tuned for and measured with
+const unsigned int VERTEX_CACHE_SIZE = 16;
+
+// Average cache miss ratio per triangle and per referenced vertex of a FIFO cache
+void analyze_vertex_cache(const unsigned int *indices, size_t indexCount, size_t vertexCount,
+                          unsigned int cacheSize, float *acmr, float *atvr);
+
+// Tipsify triangle order, clusters receives the index offset of every triangle
+// run that starts after a cache flush
+void optimize_vertex_cache(unsigned int *indices, size_t indexCount, size_t vertexCount,
+                           unsigned int cacheSize, std::vector<size_t> *clusters);
+
+// Sort clusters so outward facing geometry is drawn first, view independent
+void optimize_overdraw(unsigned int *indices, size_t indexCount, const float *positions,
+                       const std::vector<size_t> &clusters);
+
+// Renumber vertices in order of first use, remap receives the old index of each
+// new vertex and unreferenced vertices are dropped, returns the new vertex count
+size_t optimize_vertex_fetch(unsigned int *indices, size_t indexCount, size_t vertexCount,
+                             std::vector<unsigned int> &remap);
+
+// Quadric error edge collapse onto existing vertices so every level can share
+// one vertex buffer, vertices on seams and open borders are kept in place.
+// Writes at most indexCount indices and returns how many were written
+size_t simplify(unsigned int *destination, const unsigned int *indices, size_t indexCount,
+                const float *positions, size_t vertexCount, size_t targetIndexCount);
@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+
+#include <occlusion.h>
+
+using namespace std;
+
+// out = a * b, column major 4x4
+static void multiply(float *out, const float *a, const float *b)
+{
+  for (int c = 0; c < 4; c++)
+    {
+      for (int r = 0; r < 4; r++)
+        {
+          out[c * 4 + r] = a[r] * b[c * 4] + a[4 + r] * b[c * 4 + 1]
+            + a[8 + r] * b[c * 4 + 2] + a[12 + r] * b[c * 4 + 3];
+        }
+    }
+}
+
+OcclusionCuller::OcclusionCuller(JobSystem *_jobs, int width, int height)
+  : rasterized(0), rasterizedTriangles(0), jobs(_jobs)
+{
+  // Rows are written four pixels at a time
+  int w = (width + 3) & ~3, h = height;
+  while (true)
+    {
+      levels.push_back(vector<float>(w * h, 0.0f));
+      levelWidth.push_back(w);
+      levelHeight.push_back(h);
+      if (w == 1 && h == 1)
+        break;
+      w = max(1, (w + 1) / 2);
+      h = max(1, (h + 1) / 2);
+    }
+  memset(viewProjection, 0, sizeof(viewProjection));
+}
+
+OcclusionCuller::~OcclusionCuller()
+{
+  finish();
+}
+
+void OcclusionCuller::addOccluder(const float *model, const OccluderMesh *mesh)
+{
+  occluder o;
+  memcpy(o.model, model, sizeof(o.model));
+  o.mesh = mesh;
+  pending.push_back(o);
+}
+
+void OcclusionCuller::begin(const float *_viewProjection)
+{
+  finish();
+  memcpy(viewProjection, _viewProjection, sizeof(viewProjection));
+  active.swap(pending);
+  pending.clear();
+  jobs->run(rasterizing, [this] { rasterize(); }, "rasterize occluders");
+}
+
+void OcclusionCuller::finish()
+{
+  jobs->wait(rasterizing);
+}
+
+void OcclusionCuller::rasterize()
+{
+  // 1/w of zero is infinitely far away
+  fill(levels[0].begin(), levels[0].end(), 0.0f);
+  rasterized = rasterizedTriangles = 0;
+
+  for (const occluder &o : active)
+    {
+      float mvp[16];
+      multiply(mvp, viewProjection, o.model);
+      __m128 c0 = _mm_loadu_ps(mvp), c1 = _mm_loadu_ps(mvp + 4);
+      __m128 c2 = _mm_loadu_ps(mvp + 8), c3 = _mm_loadu_ps(mvp + 12);
+
+      const vector<float> &positions = o.mesh->positions;
+      size_t vertexCount = positions.size() / 3;
+      clipped.resize(vertexCount * 4);
+      for (size_t v = 0; v < vertexCount; v++)
+        {
+          const float *p = &positions[v * 3];
+          __m128 clip = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(p[0])), _mm_mul_ps(c1, _mm_set1_ps(p[1]))),
+                                   _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(p[2])), c3));
+          _mm_storeu_ps(&clipped[v * 4], clip);
+        }
+
+      const vector<unsigned int> &indices = o.mesh->indices;
+      for (size_t i = 0; i + 2 < indices.size(); i += 3)
+        {
+          const float *v[3] = { &clipped[indices[i] * 4], &clipped[indices[i + 1] * 4], &clipped[indices[i + 2] * 4] };
+          float d[3];
+          int inside = 0;
+          for (int k = 0; k < 3; k++)
+            {
+              // Distance to the near plane, z = -w
+              d[k] = v[k][2] + v[k][3];
+              inside += d[k] >= 0;
+            }
+          if (inside == 3)
+            drawTriangle(v[0], v[1], v[2]);
+          else if (inside)
+            {
+              // Clip against the near plane, leaving a triangle or a quad
+              float polygon[4][4];
+              int n = 0;
+              for (int k = 0; k < 3; k++)
+                {
+                  int j = (k + 1) % 3;
+                  if (d[k] >= 0)
+                    memcpy(polygon[n++], v[k], 4 * sizeof(float));
+                  if ((d[k] >= 0) != (d[j] >= 0))
+                    {
+                      float t = d[k] / (d[k] - d[j]);
+                      for (int c = 0; c < 4; c++)
+                        polygon[n][c] = v[k][c] + t * (v[j][c] - v[k][c]);
+                      n++;
+                    }
+                }
+              for (int k = 2; k < n; k++)
+                drawTriangle(polygon[0], polygon[k - 1], polygon[k]);
+            }
+          rasterizedTriangles++;
+        }
+      rasterized++;
+    }
+
+  buildPyramid();
+}
+
+// Edge functions are scaled to barycentric weights, so a pixel is covered when
+// all three are non-negative whatever the winding
+void OcclusionCuller::drawTriangle(const float *v0, const float *v1, const float *v2)
+{
+  const int w = levelWidth[0], h = levelHeight[0];
+  const float *v[3] = { v0, v1, v2 };
+  float x[3], y[3], z[3];
+  for (int k = 0; k < 3; k++)
+    {
+      float iw = 1.0f / max(v[k][3], 1e-6f);
+      x[k] = (v[k][0] * iw * 0.5f + 0.5f) * w;
+      y[k] = (v[k][1] * iw * 0.5f + 0.5f) * h;
+      z[k] = iw;
+    }
+
+  float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+  if (fabsf(area) < 1e-6f)
+    return;
+
+  int minX = max(0, (int) floorf(min(x[0], min(x[1], x[2]))));
+  int maxX = min(w - 1, (int) ceilf(max(x[0], max(x[1], x[2]))));
+  int minY = max(0, (int) floorf(min(y[0], min(y[1], y[2]))));
+  int maxY = min(h - 1, (int) ceilf(max(y[0], max(y[1], y[2]))));
+  if (minX > maxX || minY > maxY)
+    return;
+  minX &= ~3;
+
+  float a[3], b[3], c[3];
+  float za = 0, zb = 0, zc = 0;
+  for (int k = 0; k < 3; k++)
+    {
+      int i = (k + 1) % 3, j = (k + 2) % 3;
+      a[k] = (y[i] - y[j]) / area;
+      b[k] = (x[j] - x[i]) / area;
+      c[k] = (x[i] * y[j] - x[j] * y[i]) / area;
+      za += a[k] * z[k];
+      zb += b[k] * z[k];
+      zc += c[k] * z[k];
+    }
+
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  __m128 a0 = _mm_set1_ps(a[0]), a1 = _mm_set1_ps(a[1]), a2 = _mm_set1_ps(a[2]), az = _mm_set1_ps(za);
+
+  for (int py = minY; py <= maxY; py++)
+    {
+      float cy = py + 0.5f;
+      __m128 r0 = _mm_set1_ps(b[0] * cy + c[0]);
+      __m128 r1 = _mm_set1_ps(b[1] * cy + c[1]);
+      __m128 r2 = _mm_set1_ps(b[2] * cy + c[2]);
+      __m128 rz = _mm_set1_ps(zb * cy + zc);
+      float *row = &levels[0][py * w];
+
+      for (int px = minX; px <= maxX; px += 4)
+        {
+          __m128 cx = _mm_add_ps(_mm_set1_ps((float) px), offsets);
+          __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, cx), r0);
+          __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, cx), r1);
+          __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, cx), r2);
+          __m128 mask = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+          if (!_mm_movemask_ps(mask))
+            continue;
+
+          __m128 depth = _mm_add_ps(_mm_mul_ps(az, cx), rz);
+          __m128 old = _mm_loadu_ps(row + px);
+          __m128 nearest = _mm_max_ps(old, depth);
+          _mm_storeu_ps(row + px, _mm_or_ps(_mm_and_ps(mask, nearest), _mm_andnot_ps(mask, old)));
+        }
+    }
+}
+
+void OcclusionCuller::buildPyramid()
+{
+  for (size_t l = 1; l < levels.size(); l++)
+    {
+      const vector<float> &below = levels[l - 1];
+      vector<float> &level = levels[l];
+      int bw = levelWidth[l - 1], bh = levelHeight[l - 1];
+      for (int y = 0; y < levelHeight[l]; y++)
+        {
+          int y0 = min(2 * y, bh - 1), y1 = min(2 * y + 1, bh - 1);
+          for (int x = 0; x < levelWidth[l]; x++)
+            {
+              int x0 = min(2 * x, bw - 1), x1 = min(2 * x + 1, bw - 1);
+              level[y * levelWidth[l] + x] = min(min(below[y0 * bw + x0], below[y0 * bw + x1]),
+                                                 min(below[y1 * bw + x0], below[y1 * bw + x1]));
+            }
+        }
+    }
+}
+
+bool OcclusionCuller::visible(const float aabbMin[3], const float aabbMax[3]) const
+{
+  const int w = levelWidth[0], h = levelHeight[0];
+  float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, nearest = 0;
+  const float *m = viewProjection;
+
+  for (int k = 0; k < 8; k++)
+    {
+      float p[3] = { k & 1 ? aabbMax[0] : aabbMin[0], k & 2 ? aabbMax[1] : aabbMin[1], k & 4 ? aabbMax[2] : aabbMin[2] };
+      float cx = m[0] * p[0] + m[4] * p[1] + m[8] * p[2] + m[12];
+      float cy = m[1] * p[0] + m[5] * p[1] + m[9] * p[2] + m[13];
+      float cz = m[2] * p[0] + m[6] * p[1] + m[10] * p[2] + m[14];
+      float cw = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+      // Boxes reaching through the near plane are always drawn
+      if (cz + cw < 0 || cw <= 1e-6f)
+        return true;
+      float iw = 1.0f / cw;
+      float sx = (cx * iw * 0.5f + 0.5f) * w, sy = (cy * iw * 0.5f + 0.5f) * h;
+      minX = min(minX, sx);
+      maxX = max(maxX, sx);
+      minY = min(minY, sy);
+      maxY = max(maxY, sy);
+      nearest = max(nearest, iw);
+    }
+
+  if (maxX < 0 || maxY < 0 || minX >= w || minY >= h)
+    return true;
+  int x0 = max(0, (int) minX), x1 = min(w - 1, (int) maxX);
+  int y0 = max(0, (int) minY), y1 = min(h - 1, (int) maxY);
+
+  // Coarsest level where the box spans at most two texels each way
+  size_t l = 0;
+  while (l + 1 < levels.size() && ((x1 >> l) - (x0 >> l) > 1 || (y1 >> l) - (y0 >> l) > 1))
+    l++;
+
+  const vector<float> &level = levels[l];
+  for (int y = y0 >> l; y <= y1 >> l; y++)
+    {
+      for (int x = x0 >> l; x <= x1 >> l; x++)
+        {
+          if (level[y * levelWidth[l] + x] <= nearest)
+            return true;
+        }
+    }
+  return false;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+#include <jobs.h>
+
+// Triangle list of an occluder in model space, three floats per vertex
+struct OccluderMesh
+{
+  std::vector<float> positions;
+  std::vector<unsigned int> indices;
+};
+
+/*
+  Software occlusion culling against a hierarchical depth buffer. Occluders
+  are rasterized with SSE into a small buffer of 1/w values in a job,
+  each level of the pyramid above it keeps the farthest depth of
+  the four texels below. Bounding boxes are tested against the pyramid
+  with the same view projection the occluders were rasterized with.
+  Nothing here touches GL.
+*/
+class OcclusionCuller
+{
+public:
+  OcclusionCuller(JobSystem *jobs, int width = 256, int height = 128);
+  ~OcclusionCuller();
+
+  // Queue an occluder instance for the next rasterization, model is column major
+  void addOccluder(const float *model, const OccluderMesh *mesh);
+
+  // Rasterize the queued occluders in a job
+  void begin(const float *viewProjection);
+  // Wait for the job, visible() may be called afterwards
+  void finish();
+
+  // False only if the box is certainly behind the occluders
+  bool visible(const float aabbMin[3], const float aabbMax[3]) const;
+
+  int width() const { return levelWidth[0]; }
+  int height() const { return levelHeight[0]; }
+  // Level 0 of the pyramid, row major from the bottom row
+  const float *depth() const { return &levels[0][0]; }
+  unsigned int occluders() const { return rasterized; }
+  unsigned int triangles() const { return rasterizedTriangles; }
+
+private:
+  struct occluder
+  {
+    float model[16];
+    const OccluderMesh *mesh;
+  };
+
+  void rasterize();
+  void drawTriangle(const float *v0, const float *v1, const float *v2);
+  void buildPyramid();
+
+  std::vector<std::vector<float> > levels;
+  std::vector<int> levelWidth, levelHeight;
+  std::vector<occluder> pending, active;
+  std::vector<float> clipped;
+  float viewProjection[16];
+  unsigned int rasterized, rasterizedTriangles;
+
+  JobSystem *jobs;
+  JobCounter rasterizing;
+
+  OcclusionCuller(const OcclusionCuller &);
+  OcclusionCuller &operator=(const OcclusionCuller &);
+};
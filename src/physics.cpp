@@ -0,0 +1,439 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <btBulletDynamicsCommon.h>
+#include <BulletCollision/CollisionDispatch/btCollisionDispatcherMt.h>
+#include <BulletDynamics/ConstraintSolver/btSequentialImpulseConstraintSolverMt.h>
+#include <BulletDynamics/Dynamics/btDiscreteDynamicsWorldMt.h>
+#include <LinearMath/btThreads.h>
+
+#include <physics.h>
+#include <trace.h>
+
+using namespace std;
+
+bool parse_physics_options(int &argc, char **argv, PhysicsOptions &options)
+{
+  options.threads = 0;
+  options.scheduler = "default";
+  options.benchmarkSteps = 0;
+  options.rate = 60;
+  options.maxSubSteps = 5;
+
+  int args = 1;
+  for (int i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+      if (!strcmp(arg, "--physics-benchmark"))
+        {
+          options.benchmarkSteps = 300;
+          if (value && value[0] != '-')
+            {
+              options.benchmarkSteps = atoi(value);
+              i++;
+            }
+        }
+      else if (strcmp(arg, "--physics-threads") && strcmp(arg, "--physics-scheduler")
+               && strcmp(arg, "--physics-rate") && strcmp(arg, "--physics-substeps"))
+        argv[args++] = argv[i];
+      else if (!value)
+        {
+          printf("Missing value for %s\n", arg);
+          return false;
+        }
+      else if (!strcmp(arg, "--physics-threads"))
+        options.threads = atoi(argv[++i]);
+      else if (!strcmp(arg, "--physics-rate"))
+        options.rate = atof(argv[++i]);
+      else if (!strcmp(arg, "--physics-substeps"))
+        options.maxSubSteps = atoi(argv[++i]);
+      else
+        options.scheduler = argv[++i];
+    }
+  argc = args;
+  return options.threads >= 0 && options.benchmarkSteps >= 0 && options.rate > 0 && options.maxSubSteps > 0;
+}
+
+// Bullet has one global scheduler, it is created on first use and lives until exit
+static btITaskScheduler *task_scheduler(const string &name)
+{
+  static btITaskScheduler *scheduler = NULL;
+  if (scheduler)
+    return scheduler;
+
+  if (name == "default")
+    scheduler = btCreateDefaultTaskScheduler();
+  else if (name == "openmp")
+    scheduler = btGetOpenMPTaskScheduler();
+  else if (name == "tbb")
+    scheduler = btGetTBBTaskScheduler();
+  else if (name == "ppl")
+    scheduler = btGetPPLTaskScheduler();
+  else if (name == "sequential")
+    scheduler = btGetSequentialTaskScheduler();
+  else
+    throw runtime_error("Unknown physics scheduler " + name);
+  if (!scheduler)
+    throw runtime_error("Bullet was built without the " + name + " task scheduler");
+  btSetTaskScheduler(scheduler);
+  return scheduler;
+}
+
+PhysicsWorld::PhysicsWorld(const PhysicsOptions &options) : solverPool(NULL), threadCount(1)
+{
+  if (!options.threads)
+    {
+      collisionConfig = new btDefaultCollisionConfiguration();
+      dispatcher = new btCollisionDispatcher(collisionConfig);
+      broadphase = new btDbvtBroadphase();
+      solver = new btSequentialImpulseConstraintSolver();
+      dynamicsWorld = new btDiscreteDynamicsWorld(dispatcher, broadphase, solver, collisionConfig);
+      return;
+    }
+
+#if !BT_THREADSAFE
+  printf("Bullet was built without BT_THREADSAFE, the multithreaded world runs on one thread\n");
+#endif
+  btITaskScheduler *scheduler = task_scheduler(options.scheduler);
+  scheduler->setNumThreads(min(options.threads, scheduler->getMaxNumThreads()));
+  threadCount = scheduler->getNumThreads();
+
+  // Workers create contacts concurrently, pools that run dry fall back to the locked allocator
+  btDefaultCollisionConstructionInfo info;
+  info.m_defaultMaxPersistentManifoldPoolSize = 80000;
+  info.m_defaultMaxCollisionAlgorithmPoolSize = 80000;
+  collisionConfig = new btDefaultCollisionConfiguration(info);
+  // Narrowphase over the overlapping pairs in batches of 40
+  dispatcher = new btCollisionDispatcherMt(collisionConfig, 40);
+  broadphase = new btDbvtBroadphase();
+  // Islands are spread over the pool, islands too large to share out go to the Mt solver
+  solverPool = new btConstraintSolverPoolMt(threadCount);
+  solver = new btSequentialImpulseConstraintSolverMt();
+  dynamicsWorld = new btDiscreteDynamicsWorldMt(dispatcher, broadphase, solverPool, solver, collisionConfig);
+  printf("Multithreaded physics on %d threads of the %s scheduler\n", threadCount, scheduler->getName());
+}
+
+PhysicsWorld::~PhysicsWorld()
+{
+  delete dynamicsWorld;
+  delete solver;
+  delete solverPool;
+  delete broadphase;
+  delete dispatcher;
+  delete collisionConfig;
+}
+
+// Step a pile of unit boxes in columns ten high on a floor, and record each step in milliseconds
+static void measure_steps(btDiscreteDynamicsWorld *world, int bodies, int steps, vector<float> &times)
+{
+  world->setGravity(btVector3(0, 0, -9.81));
+  btBoxShape floorShape(btVector3(1000, 1000, 1)), boxShape(btVector3(0.5, 0.5, 0.5));
+  btVector3 inertia(0, 0, 0);
+  boxShape.calculateLocalInertia(1, inertia);
+
+  vector<btRigidBody*> rigidBodies;
+  btTransform t;
+  t.setIdentity();
+  t.setOrigin(btVector3(0, 0, -1));
+  btRigidBody::btRigidBodyConstructionInfo floorInfo(0, new btDefaultMotionState(t), &floorShape);
+  rigidBodies.push_back(new btRigidBody(floorInfo));
+
+  const int layers = 10;
+  int side = ceil(sqrt(bodies / (float) layers));
+  for (int i = 0; i < bodies; i++)
+    {
+      int column = i / layers, layer = i % layers;
+      t.setOrigin(btVector3((column % side - side / 2) * 1.1, (column / side - side / 2) * 1.1, 0.5 + layer * 1.02));
+      btRigidBody::btRigidBodyConstructionInfo info(1, new btDefaultMotionState(t), &boxShape, inertia);
+      rigidBodies.push_back(new btRigidBody(info));
+    }
+  for (btRigidBody *body : rigidBodies)
+    world->addRigidBody(body);
+
+  times.clear();
+  for (int i = 0; i < steps; i++)
+    {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      // One step of exactly 1/60 s, without the world's own accumulator
+      world->stepSimulation(1 / 60.0, 0);
+      times.push_back(chrono::duration<float, milli>(chrono::steady_clock::now() - start).count());
+    }
+
+  for (btRigidBody *body : rigidBodies)
+    {
+      world->removeRigidBody(body);
+      delete body->getMotionState();
+      delete body;
+    }
+}
+
+void run_physics_benchmark(const PhysicsOptions &options)
+{
+  PhysicsOptions single = options, multi = options;
+  single.threads = 0;
+  if (!multi.threads)
+    multi.threads = max(2u, thread::hardware_concurrency());
+
+  const int counts[] = { 1000, 10000, 50000 };
+  printf("%8s  %-14s %7s %9s %9s %9s %9s\n", "bodies", "world", "threads", "mean ms", "p50 ms", "p95 ms", "max ms");
+  for (int bodies : counts)
+    {
+      for (int mt = 0; mt < 2; mt++)
+        {
+          PhysicsWorld physics(mt ? multi : single);
+          vector<float> times;
+          measure_steps(physics.world(), bodies, options.benchmarkSteps, times);
+
+          double total = 0;
+          for (float t : times)
+            total += t;
+          sort(times.begin(), times.end());
+          size_t n = times.size();
+          printf("%8d  %-14s %7d %9.2f %9.2f %9.2f %9.2f\n", bodies, mt ? "multithreaded" : "single", physics.threads(),
+                 total / n, times[n / 2], times[min(n - 1, n * 95 / 100)], times[n - 1]);
+        }
+    }
+}
+
+PhysicsThread::PhysicsThread(btDiscreteDynamicsWorld *world) :
+  world(world),
+  slotCount(0),
+  requested(0),
+  stepSeconds(0),
+  stepAlpha(1),
+  stepCount(0),
+  busy(false),
+  quit(false),
+  stepMs(0)
+{
+  thread = std::thread(&PhysicsThread::run, this);
+}
+
+PhysicsThread::~PhysicsThread()
+{
+  {
+    unique_lock<mutex> guard(lock);
+    done.wait(guard, [this] { return !busy; });
+    quit = true;
+  }
+  wake.notify_one();
+  thread.join();
+}
+
+void PhysicsThread::enqueue(const function<void()> &command)
+{
+  lock_guard<mutex> guard(lock);
+  commands.push_back(command);
+}
+
+void PhysicsThread::setStepCallback(const StepCallback &callback)
+{
+  enqueue([this, callback] { stepCallback = callback; });
+}
+
+int PhysicsThread::track(btRigidBody *body, bool addToWorld)
+{
+  int slot;
+  if (freeSlots.size())
+    {
+      slot = freeSlots.back();
+      freeSlots.pop_back();
+    }
+  else
+    slot = slotCount++;
+
+  enqueue([this, body, slot, addToWorld] {
+      if (addToWorld)
+        world->addRigidBody(body);
+      body->setUserIndex(slot);
+      if ((int) tracked.size() <= slot)
+        {
+          tracked.resize(slot + 1, NULL);
+          previous.resize(slot + 1);
+        }
+      tracked[slot] = body;
+      previous[slot].valid = false;
+    });
+  return slot;
+}
+
+void PhysicsThread::untrack(int slot, bool removeFromWorld)
+{
+  enqueue([this, slot, removeFromWorld] {
+      btRigidBody *body = tracked[slot];
+      if (removeFromWorld)
+        world->removeRigidBody(body);
+      body->setUserIndex(-1);
+      tracked[slot] = NULL;
+    });
+  // Applied before step requested + 1, which is when the slot is free again
+  retiredSlots.push_back(make_pair(slot, requested + 1));
+}
+
+void PhysicsThread::step(float dt, int count, float alpha)
+{
+  {
+    unique_lock<mutex> guard(lock);
+    done.wait(guard, [this] { return !busy; });
+    busy = true;
+    stepSeconds = dt;
+    stepCount = count;
+    stepAlpha = alpha;
+    requested++;
+  }
+  wake.notify_one();
+}
+
+void PhysicsThread::wait()
+{
+  unique_lock<mutex> guard(lock);
+  done.wait(guard, [this] { return !busy; });
+}
+
+void PhysicsThread::synchronize()
+{
+  unique_lock<mutex> guard(lock);
+  done.wait(guard, [this] { return !busy; });
+  running.swap(commands);
+  guard.unlock();
+
+  applyCommands();
+  publish(stepAlpha);
+}
+
+const PhysicsSnapshot &PhysicsThread::acquire()
+{
+  const PhysicsSnapshot &snapshot = snapshots.acquire();
+  for (size_t i = 0; i < retiredSlots.size(); )
+    {
+      if (retiredSlots[i].second <= snapshot.step)
+        {
+          freeSlots.push_back(retiredSlots[i].first);
+          retiredSlots[i] = retiredSlots.back();
+          retiredSlots.pop_back();
+        }
+      else
+        i++;
+    }
+  return snapshot;
+}
+
+void PhysicsThread::run()
+{
+  trace_thread_name("physics");
+  unique_lock<mutex> guard(lock);
+  for (;;)
+    {
+      wake.wait(guard, [this] { return busy || quit; });
+      if (quit)
+        {
+          // Bodies still queued to join the world join it, whoever tears the world down frees them
+          running.swap(commands);
+          guard.unlock();
+          applyCommands();
+          return;
+        }
+      running.swap(commands);
+      float dt = stepSeconds, alpha = stepAlpha;
+      int count = stepCount;
+      guard.unlock();
+
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      applyCommands();
+      for (int i = 0; i < count; i++)
+        {
+          if (i == count - 1)
+            savePrevious();
+          TraceZone zone("step simulation");
+          if (stepCallback)
+            stepCallback(dt);
+          // Exactly dt, the accumulator lives with the caller
+          world->stepSimulation(dt, 0);
+        }
+      publish(alpha);
+      stepMs.store(chrono::duration<float, milli>(chrono::steady_clock::now() - start).count(),
+                   memory_order_relaxed);
+
+      guard.lock();
+      busy = false;
+      done.notify_all();
+    }
+}
+
+void PhysicsThread::applyCommands()
+{
+  TraceZone zone("physics commands");
+  for (size_t i = 0; i < running.size(); i++)
+    running[i]();
+  running.clear();
+}
+
+void PhysicsThread::savePrevious()
+{
+  for (size_t i = 0; i < tracked.size(); i++)
+    {
+      btRigidBody *body = tracked[i];
+      savedBody &saved = previous[i];
+      saved.valid = body && !body->isStaticObject();
+      if (!saved.valid)
+        continue;
+
+      const btTransform &t = body->getWorldTransform();
+      btQuaternion rotation = t.getRotation();
+      btVector3 lower, upper;
+      body->getAabb(lower, upper);
+      for (int k = 0; k < 3; k++)
+        {
+          saved.origin[k] = t.getOrigin()[k];
+          saved.aabbMin[k] = lower[k];
+          saved.aabbMax[k] = upper[k];
+        }
+      saved.rotation[0] = rotation.x();
+      saved.rotation[1] = rotation.y();
+      saved.rotation[2] = rotation.z();
+      saved.rotation[3] = rotation.w();
+    }
+}
+
+void PhysicsThread::publish(float alpha)
+{
+  TraceZone zone("publish bodies");
+  PhysicsSnapshot &snapshot = snapshots.back();
+  // requested only changes while no step is in flight
+  snapshot.step = requested;
+  snapshot.bodies.resize(tracked.size());
+  for (size_t i = 0; i < tracked.size(); i++)
+    {
+      BodyState &state = snapshot.bodies[i];
+      btRigidBody *body = tracked[i];
+      state.valid = body != NULL;
+      if (!body)
+        continue;
+
+      btTransform t = body->getWorldTransform();
+      btVector3 lower, upper;
+      body->getAabb(lower, upper);
+      const savedBody &saved = previous[i];
+      if (saved.valid)
+        {
+          btQuaternion rotation(saved.rotation[0], saved.rotation[1], saved.rotation[2], saved.rotation[3]);
+          btVector3 origin(saved.origin[0], saved.origin[1], saved.origin[2]);
+          t = btTransform(slerp(rotation, t.getRotation(), alpha), lerp(origin, t.getOrigin(), alpha));
+          lower.setMin(btVector3(saved.aabbMin[0], saved.aabbMin[1], saved.aabbMin[2]));
+          upper.setMax(btVector3(saved.aabbMax[0], saved.aabbMax[1], saved.aabbMax[2]));
+        }
+      t.getOpenGLMatrix(state.transform);
+      for (int k = 0; k < 3; k++)
+        {
+          state.aabbMin[k] = lower[k];
+          state.aabbMax[k] = upper[k];
+        }
+      state.isStatic = body->isStaticObject();
+    }
+  snapshots.publish();
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class btBroadphaseInterface;
+class btCollisionConfiguration;
+class btCollisionDispatcher;
+class btConstraintSolver;
+class btConstraintSolverPoolMt;
+class btDiscreteDynamicsWorld;
+class btRigidBody;
+
+struct PhysicsOptions
+{
+  // Workers of the multithreaded world, the single threaded world is used when zero
+  int threads;
+  // Task scheduler backend: default, openmp, tbb, ppl or sequential
+  std::string scheduler;
+  // Steps measured per body count by the physics benchmark, which does not run when zero
+  int benchmarkSteps;
+  // Fixed steps per second, and the most steps taken for one frame before time is dropped
+  float rate;
+  int maxSubSteps;
+};
+
+// Takes --physics-threads N, --physics-scheduler NAME, --physics-benchmark [steps],
+// --physics-rate HZ and --physics-substeps N out of the arguments. Returns false on bad arguments
+bool parse_physics_options(int &argc, char **argv, PhysicsOptions &options);
+
+/*
+  A Bullet dynamics world and everything it is built from. With threads set
+  it is a btDiscreteDynamicsWorldMt with a solver pool, an Mt dispatcher and
+  a global task scheduler; the scheduler is shared by every world and only
+  ever created once.
+*/
+class PhysicsWorld
+{
+public:
+  PhysicsWorld(const PhysicsOptions &options);
+  ~PhysicsWorld();
+
+  btDiscreteDynamicsWorld *world() { return dynamicsWorld; }
+  // Threads stepping the world, 1 for the single threaded world
+  int threads() const { return threadCount; }
+
+private:
+  btCollisionConfiguration *collisionConfig;
+  btCollisionDispatcher *dispatcher;
+  btBroadphaseInterface *broadphase;
+  btConstraintSolverPoolMt *solverPool;
+  btConstraintSolver *solver;
+  btDiscreteDynamicsWorld *dynamicsWorld;
+  int threadCount;
+
+  PhysicsWorld(const PhysicsWorld &);
+  PhysicsWorld &operator=(const PhysicsWorld &);
+};
+
+// Step times of box piles of 1k, 10k and 50k bodies, single threaded against the configured world
+void run_physics_benchmark(const PhysicsOptions &options);
+
+/*
+  Single producer, single consumer triple buffer. The writer fills back()
+  and publishes it, the reader picks up the newest published buffer. Neither
+  side ever waits for the other.
+*/
+template <typename T>
+class TripleBuffer
+{
+public:
+  TripleBuffer() : backIndex(0), frontIndex(1), state(2) {}
+
+  T &back() { return buffers[backIndex]; }
+  void publish() { backIndex = state.exchange(backIndex | DIRTY, std::memory_order_acq_rel) & INDEX; }
+
+  // Newest published buffer, stays untouched by the writer until the next acquire
+  const T &acquire()
+  {
+    if (state.load(std::memory_order_relaxed) & DIRTY)
+      frontIndex = state.exchange(frontIndex, std::memory_order_acq_rel) & INDEX;
+    return buffers[frontIndex];
+  }
+
+private:
+  enum { INDEX = 3, DIRTY = 4 };
+  T buffers[3];
+  int backIndex, frontIndex;
+  // Index of the buffer between writer and reader, with DIRTY set while it is unread
+  std::atomic<int> state;
+};
+
+// What rendering needs of a rigid body, as of the end of a step
+struct BodyState
+{
+  // Column major world transform, interpolated between the last two steps
+  float transform[16];
+  // Covers the body before and after the last step
+  float aabbMin[3], aabbMax[3];
+  bool isStatic;
+  bool valid;
+};
+
+struct PhysicsSnapshot
+{
+  // Steps requested before this snapshot was taken
+  unsigned long step;
+  // Indexed by slot
+  std::vector<BodyState> bodies;
+};
+
+/*
+  Steps a Bullet world on its own thread, overlapped with rendering. Once
+  the thread runs, the main thread never touches the world. Mutations are
+  queued as commands and applied before the next step. Every step ends by
+  publishing the state of the tracked bodies into a triple buffer.
+
+  A step is a batch of fixed steps, possibly none, and published transforms
+  sit a given fraction of the way from the state before the batch's last
+  fixed step to the state after it.
+
+  A step callback runs on the physics thread before every fixed step, for
+  input that has to act per step rather than per frame.
+
+  Tracked bodies get a slot, which is also their user index, and slots are
+  only reused once a snapshot without the body was published.
+
+  Destruction waits for the step in flight, applies the commands still
+  queued and joins the thread, after which the world is the caller's again.
+*/
+class PhysicsThread
+{
+public:
+  typedef std::function<void(float dt)> StepCallback;
+
+  PhysicsThread(btDiscreteDynamicsWorld *world);
+  ~PhysicsThread();
+
+  // Run on the physics thread before the next step, in order
+  void enqueue(const std::function<void()> &command);
+  // Replace the step callback, from the next step on
+  void setStepCallback(const StepCallback &callback);
+  // Track a body already in the world, or add it to the world first
+  int track(btRigidBody *body, bool addToWorld);
+  // Stop tracking a body, which is removed from the world first if asked
+  void untrack(int slot, bool removeFromWorld);
+
+  // Wait for the step in flight, then start one of count fixed steps of dt seconds,
+  // published alpha of the way past the second to last
+  void step(float dt, int count, float alpha);
+  // Wait for the step in flight, its snapshot is the newest one after this
+  void wait();
+  // Wait for the step in flight, then apply the queued commands and publish on the calling thread
+  void synchronize();
+
+  // Newest published state, valid until the next acquire()
+  const PhysicsSnapshot &acquire();
+
+  // Duration of the last step in milliseconds, commands included
+  float stepTime() const { return stepMs.load(std::memory_order_relaxed); }
+
+private:
+  void run();
+  void applyCommands();
+  void savePrevious();
+  void publish(float alpha);
+
+  btDiscreteDynamicsWorld *world;
+  TripleBuffer<PhysicsSnapshot> snapshots;
+
+  // Physics thread side, bodies by slot and their state before the last fixed step
+  struct savedBody
+  {
+    float origin[3], rotation[4];
+    float aabbMin[3], aabbMax[3];
+    bool valid;
+  };
+  std::vector<btRigidBody*> tracked;
+  std::vector<savedBody> previous;
+  StepCallback stepCallback;
+
+  // Main thread side
+  std::vector<int> freeSlots;
+  std::vector<std::pair<int, unsigned long> > retiredSlots;
+  int slotCount;
+
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable wake, done;
+  std::vector<std::function<void()> > commands, running;
+  unsigned long requested;
+  float stepSeconds, stepAlpha;
+  int stepCount;
+  bool busy, quit;
+  std::atomic<float> stepMs;
+
+  PhysicsThread(const PhysicsThread &);
+  PhysicsThread &operator=(const PhysicsThread &);
+};
@@ -0,0 +1,179 @@
+#include <algorithm>
+
+#include <profiler.h>
+#include <trace.h>
+
+using namespace std;
+
+const int Profiler::HISTORY;
+
+Profiler::Profiler()
+  : active(false), frame(0), timing(-1), tracedScopes(0)
+{
+  fill(frameMs, frameMs + HISTORY, 0.0f);
+}
+
+void Profiler::deleteQueries()
+{
+  for (int i = 0; i < 2; i++)
+    {
+      if (!queries[i].empty())
+        glDeleteQueries(queries[i].size(), &queries[i][0]);
+      queries[i].clear();
+      issued[i].clear();
+    }
+  timing = -1;
+}
+
+void Profiler::setEnabled(bool enabled)
+{
+  if (enabled == active)
+    return;
+  // Start over so the averages do not mix in the time spent disabled
+  active = enabled;
+  records.clear();
+  summary.clear();
+  stack.clear();
+  timing = -1;
+  for (int i = 0; i < 2; i++)
+    issued[i].clear();
+  fill(frameMs, frameMs + HISTORY, 0.0f);
+  frameStart = chrono::steady_clock::now();
+  frame = 0;
+}
+
+void Profiler::beginFrame()
+{
+  if (!active)
+    return;
+  chrono::steady_clock::time_point now = chrono::steady_clock::now();
+  frameMs[frame % HISTORY] = chrono::duration<float, milli>(now - frameStart).count();
+  frameStart = now;
+  frame++;
+
+  // The queries of this parity were issued two frames ago
+  collect(frame & 1);
+  int slot = frame % HISTORY;
+  for (record &r : records)
+    {
+      r.cpu[slot] = 0;
+      r.gpu[slot] = -1;
+    }
+}
+
+void Profiler::collect(int buffer)
+{
+  for (size_t i = 0; i < issued[buffer].size(); i++)
+    {
+      const query &q = issued[buffer][i];
+      GLuint available = 0;
+      glGetQueryObjectuiv(queries[buffer][i], GL_QUERY_RESULT_AVAILABLE, &available);
+      // Late results are dropped rather than waited for. So is the first timed
+      // frame, llvmpipe reports garbage for the first query of a context
+      if (!available || q.record >= (int) records.size() || q.frame <= 1)
+        continue;
+      GLuint64 nanoseconds;
+      glGetQueryObjectui64v(queries[buffer][i], GL_QUERY_RESULT, &nanoseconds);
+      float &gpu = records[q.record].gpu[q.frame % HISTORY];
+      gpu = max(gpu, 0.0f) + nanoseconds / 1e6f;
+    }
+  issued[buffer].clear();
+}
+
+int Profiler::find(const char *name, int parent)
+{
+  for (size_t i = 0; i < records.size(); i++)
+    {
+      if (records[i].name == name && records[i].parent == parent)
+        return i;
+    }
+  record r;
+  r.name = name;
+  r.parent = parent;
+  r.depth = stack.size();
+  r.timed = false;
+  fill(r.cpu, r.cpu + HISTORY, 0.0f);
+  fill(r.gpu, r.gpu + HISTORY, -1.0f);
+  records.push_back(r);
+  return records.size() - 1;
+}
+
+void Profiler::begin(const char *name, bool gpu)
+{
+  // Every scope is a trace zone too, whether or not the profiler is enabled
+  bool traced = trace_enabled();
+  if (traced)
+    trace_begin(name);
+  tracedScopes = (tracedScopes << 1) | traced;
+
+  if (!active)
+    return;
+  int index = find(name, stack.empty() ? -1 : stack.back());
+  stack.push_back(index);
+  record &r = records[index];
+  r.start = chrono::steady_clock::now();
+
+  if (gpu && timing < 0)
+    {
+      int buffer = frame & 1;
+      size_t n = issued[buffer].size();
+      if (n == queries[buffer].size())
+        {
+          queries[buffer].push_back(0);
+          glGenQueries(1, &queries[buffer].back());
+        }
+      query q = { index, frame };
+      issued[buffer].push_back(q);
+      glBeginQuery(GL_TIME_ELAPSED, queries[buffer][n]);
+      timing = index;
+      r.timed = true;
+    }
+}
+
+void Profiler::end()
+{
+  if (tracedScopes & 1)
+    trace_end();
+  tracedScopes >>= 1;
+
+  if (!active || stack.empty())
+    return;
+  int index = stack.back();
+  stack.pop_back();
+  record &r = records[index];
+  r.cpu[frame % HISTORY] += chrono::duration<float, milli>(chrono::steady_clock::now() - r.start).count();
+  if (timing == index)
+    {
+      glEndQuery(GL_TIME_ELAPSED);
+      timing = -1;
+    }
+}
+
+const vector<Profiler::zone> &Profiler::zones()
+{
+  summary.clear();
+  int frames = min(frame, HISTORY);
+  for (const record &r : records)
+    {
+      float cpu = 0, gpu = 0;
+      int gpuFrames = 0;
+      for (int i = 0; i < HISTORY; i++)
+        {
+          cpu += r.cpu[i];
+          if (r.gpu[i] >= 0)
+            {
+              gpu += r.gpu[i];
+              gpuFrames++;
+            }
+        }
+      zone z = { r.name, r.depth, frames ? cpu / frames : 0, r.timed && gpuFrames ? gpu / gpuFrames : -1 };
+      summary.push_back(z);
+    }
+  return summary;
+}
+
+void Profiler::frameTimes(float *out) const
+{
+  for (int i = 0; i < HISTORY; i++)
+    out[i] = frameMs[(frame + i) % HISTORY];
+}
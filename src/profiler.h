@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+#include <GL/glew.h>
+
+/*
+  Frame profiler with nested CPU scopes and GPU timings. A scope opened with
+  gpu set is also wrapped in a GL_TIME_ELAPSED query. Those queries cannot
+  nest, so scopes inside a timed one only get CPU times. Queries are double
+  buffered by frame parity and read back two frames later, and only once
+  their result is available, so the profiler never waits for the GPU.
+  Timings are averaged over the last HISTORY frames. Nothing is recorded
+  while disabled, but scopes still become trace zones while a trace runs.
+  The queries have to be deleted with deleteQueries() while the GL context
+  is still current, the destructor does not touch GL.
+*/
+class Profiler
+{
+public:
+  static const int HISTORY = 120;
+
+  struct zone
+  {
+    const char *name;
+    int depth;
+    // Milliseconds per frame, gpuMs is negative for zones without a query
+    float cpuMs, gpuMs;
+  };
+
+  Profiler();
+  void deleteQueries();
+
+  void setEnabled(bool enabled);
+  bool enabled() const { return active; }
+
+  void beginFrame();
+  // Open a scope, names are compared by pointer so they must be literals
+  void begin(const char *name, bool gpu = false);
+  void end();
+
+  // Zones in the order they first ran, which is depth first
+  const std::vector<zone> &zones();
+  // Frame times in milliseconds, oldest first, out must hold HISTORY values
+  void frameTimes(float *out) const;
+
+private:
+  struct record
+  {
+    const char *name;
+    int parent, depth;
+    float cpu[HISTORY], gpu[HISTORY];
+    bool timed;
+    std::chrono::steady_clock::time_point start;
+  };
+  struct query
+  {
+    int record, frame;
+  };
+
+  int find(const char *name, int parent);
+  void collect(int buffer);
+
+  bool active;
+  // Frames since the profiler was last enabled
+  int frame;
+  std::chrono::steady_clock::time_point frameStart;
+  float frameMs[HISTORY];
+  std::vector<record> records;
+  std::vector<int> stack;
+  // Innermost open scope with a running query, -1 when none is
+  int timing;
+  // One bit per open scope, innermost lowest, set when it began a trace zone
+  uint64_t tracedScopes;
+  // Queries of the two frames in flight, indexed by frame parity
+  std::vector<GLuint> queries[2];
+  std::vector<query> issued[2];
+  std::vector<zone> summary;
+
+  Profiler(const Profiler &);
+  Profiler &operator=(const Profiler &);
+};
+
+// Profiles the enclosing block
+class ProfileScope
+{
+public:
+  ProfileScope(Profiler &_profiler, const char *name, bool gpu = false) : profiler(_profiler) { profiler.begin(name, gpu); }
+  ~ProfileScope() { profiler.end(); }
+
+private:
+  Profiler &profiler;
+};
@@ -0,0 +1,83 @@
+#include <cstring>
+#include <algorithm>
+
+#include <renderqueue.h>
+
+using namespace std;
+
+static inline uint64_t field(unsigned int value, int bits, int shift)
+{
+  return (uint64_t)(value & ((1u << bits) - 1)) << shift;
+}
+
+// Non-negative IEEE floats compare like their bit patterns, keep the top 20 bits
+static inline uint32_t depthBits(float depth)
+{
+  uint32_t bits;
+  if (!(depth > 0.0f))
+    return 0;
+  memcpy(&bits, &depth, sizeof(bits));
+  return bits >> 11;
+}
+
+uint64_t RenderQueue::makeKey(unsigned int pass, unsigned int shader, unsigned int texture,
+                              unsigned int material, unsigned int vao, float depth)
+{
+  return field(pass, 4, 60)
+    | field(shader, 6, 54)
+    | field(texture, 12, 42)
+    | field(material, 10, 32)
+    | field(vao, 12, 20)
+    | field(depthBits(depth), 20, 0);
+}
+
+uint64_t RenderQueue::makeDepthKey(unsigned int pass, float depth, bool backToFront, unsigned int shader,
+                                   unsigned int texture, unsigned int material, unsigned int vao)
+{
+  uint32_t bits = depthBits(depth);
+  return field(pass, 4, 60)
+    | field(backToFront ? ~bits : bits, 20, 40)
+    | field(shader, 6, 34)
+    | field(texture, 12, 22)
+    | field(material, 10, 12)
+    | field(vao, 12, 0);
+}
+
+void RenderQueue::push(uint64_t key, uint32_t index)
+{
+  RenderItem item = { key, index };
+  queue.push_back(item);
+}
+
+// LSD radix sort on 8-bit digits, digits shared by every key are skipped
+void RenderQueue::sort()
+{
+  const size_t n = queue.size();
+  if (n < 2)
+    return;
+
+  uint32_t histogram[8][256];
+  memset(histogram, 0, sizeof(histogram));
+  for (size_t i = 0; i < n; i++) {
+    uint64_t key = queue[i].key;
+    for (int d = 0; d < 8; d++)
+      histogram[d][(key >> (d * 8)) & 0xff]++;
+  }
+
+  scratch.resize(n);
+  for (int d = 0; d < 8; d++) {
+    uint32_t *h = histogram[d];
+    if (h[(queue[0].key >> (d * 8)) & 0xff] == n)
+      continue;
+
+    uint32_t offset = 0;
+    for (int b = 0; b < 256; b++) {
+      uint32_t count = h[b];
+      h[b] = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < n; i++)
+      scratch[h[(queue[i].key >> (d * 8)) & 0xff]++] = queue[i];
+    queue.swap(scratch);
+  }
+}
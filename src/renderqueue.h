@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+/*
+  Per-frame list of draw items sorted on a packed 64-bit state key so that
+  items sharing shader, texture, material and vertex array end up adjacent.
+
+  Key layout, most significant first:
+    pass      4 bits
+    shader    6 bits
+    texture  12 bits
+    material 10 bits
+    vao      12 bits
+    depth    20 bits
+
+  Depth keys move depth right below the pass for passes that must be drawn
+  in distance order, state then only decides between equally distant items.
+*/
+struct RenderItem
+{
+  uint64_t key;
+  uint32_t index;
+};
+
+class RenderQueue
+{
+public:
+  static uint64_t makeKey(unsigned int pass, unsigned int shader, unsigned int texture,
+                          unsigned int material, unsigned int vao, float depth);
+  static uint64_t makeDepthKey(unsigned int pass, float depth, bool backToFront, unsigned int shader,
+                               unsigned int texture, unsigned int material, unsigned int vao);
+  static unsigned int pass(uint64_t key) { return key >> 60; }
+
+  void clear() { queue.clear(); }
+  void push(uint64_t key, uint32_t index);
+  void sort();
+
+  const std::vector<RenderItem> &items() const { return queue; }
+
+private:
+  std::vector<RenderItem> queue, scratch;
+};
@@ -0,0 +1,141 @@
+#include <cstdio>
+#include <GL/glew.h>
+
+#include <ringbuffer.h>
+
+static const GLbitfield mapFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+RingBuffer::RingBuffer(size_t _regionSize, int _frames)
+  : buffer(0), ring(0), mapped(NULL), persistent(GLEW_ARB_buffer_storage),
+    regionSize(_regionSize), wantedSize(_regionSize), frames(_frames), current(0),
+    head(0), capacity(_regionSize), fences(_frames, (GLsync) 0), waits(0)
+{
+  create();
+  printf("Ring buffer %d x %lu kb%s\n", frames, regionSize / 1024, persistent ? " persistently mapped" : "");
+}
+
+RingBuffer::~RingBuffer()
+{
+  destroy();
+}
+
+GLuint RingBuffer::createBuffer(size_t size)
+{
+  GLuint id;
+  glGenBuffers(1, &id);
+  glBindBuffer(GL_ARRAY_BUFFER, id);
+  if (persistent) {
+    glBufferStorage(GL_ARRAY_BUFFER, size, NULL, mapFlags);
+    mapped = (char *) glMapBufferRange(GL_ARRAY_BUFFER, 0, size, mapFlags);
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+    if (staging.size() < size)
+      staging.resize(size);
+    mapped = &staging[0];
+  }
+  return id;
+}
+
+void RingBuffer::create()
+{
+  ring = buffer = createBuffer(regionSize * frames);
+}
+
+void RingBuffer::destroy()
+{
+  for (GLsync &fence : fences) {
+    if (fence)
+      glDeleteSync(fence);
+    fence = 0;
+  }
+  if (persistent) {
+    glBindBuffer(GL_ARRAY_BUFFER, ring);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  // Storage still referenced by queued commands is released by GL once they finish,
+  // deleting a mapped spill buffer unmaps it
+  glDeleteBuffers(1, &ring);
+  if (!spills.empty())
+    glDeleteBuffers(spills.size(), &spills[0]);
+  spills.clear();
+  buffer = ring = 0;
+  mapped = NULL;
+}
+
+void RingBuffer::spill(size_t bytes)
+{
+  while (wantedSize < (head + bytes) * 2)
+    wantedSize *= 2;
+  size_t base = regionSize * current;
+  GLuint previous = buffer;
+  buffer = createBuffer(base + wantedSize);
+  spills.push_back(buffer);
+  // Everything written so far moves along, offsets handed out stay valid in the new buffer
+  if (head) {
+    if (persistent) {
+      glBindBuffer(GL_COPY_READ_BUFFER, previous);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, base, base, head);
+    } else {
+      glBufferSubData(GL_ARRAY_BUFFER, base, head, mapped + base);
+    }
+  }
+  capacity = wantedSize;
+  fprintf(stderr, "Ring buffer region full, frame spilled into a %lu kb buffer\n", (base + wantedSize) / 1024);
+}
+
+void RingBuffer::beginFrame()
+{
+  // Recreate at the size the last overflow asked for, frames bind their ranges again before drawing
+  if (!spills.empty()) {
+    destroy();
+    regionSize = wantedSize;
+    create();
+    fprintf(stderr, "Ring buffer grown to %d x %lu kb\n", frames, regionSize / 1024);
+  }
+  GLsync &fence = fences[current];
+  if (fence) {
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+      waits++;
+      do {
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+      } while (status == GL_TIMEOUT_EXPIRED);
+    }
+    glDeleteSync(fence);
+    fence = 0;
+  }
+  head = 0;
+  capacity = regionSize;
+}
+
+void RingBuffer::endFrame()
+{
+  fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  current = (current + 1) % frames;
+}
+
+void RingBuffer::reserve(size_t bytes)
+{
+  if (head + bytes > capacity)
+    spill(bytes);
+}
+
+void *RingBuffer::allocate(size_t bytes, size_t alignment, size_t *offset)
+{
+  size_t base = regionSize * current;
+  size_t start = (base + head + alignment - 1) / alignment * alignment;
+  if (start + bytes > base + capacity)
+    spill(start + bytes - base - head);
+  head = start + bytes - base;
+  *offset = start;
+  return mapped + start;
+}
+
+void RingBuffer::commit(size_t offset, size_t bytes)
+{
+  if (persistent || !bytes)
+    return;
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, mapped + offset);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <GL/glew.h>
+
+/*
+  Streaming buffer for all per-frame dynamic GPU data. The buffer is split
+  into one region per frame in flight, each guarded by a fence, and stays
+  persistently mapped so writes never orphan or reallocate storage.
+
+  Without ARB_buffer_storage, allocations are staged in client memory and
+  copied in with glBufferSubData on commit().
+
+  A frame that outgrows its region spills into a second buffer holding a
+  copy of what the frame wrote so far at the same offsets, so id() always
+  names a buffer with every allocation of the frame. Ranges bound earlier
+  keep reading the ring, which is only recreated larger at the next
+  beginFrame. Pointers returned by allocate() must be written before the
+  next allocation, and bindings must be made again every frame.
+*/
+class RingBuffer
+{
+public:
+  RingBuffer(size_t regionSize, int frames = 3);
+  ~RingBuffer();
+
+  // Wait until the GPU is done with the region this frame will write
+  void beginFrame();
+  void endFrame();
+
+  // Reserve bytes in the current region, offset receives the offset into id()
+  void *allocate(size_t bytes, size_t alignment, size_t *offset);
+  // Spill up front if the current region cannot take bytes more, the ring grows next frame
+  void reserve(size_t bytes);
+  // Make a finished allocation visible to the GPU
+  void commit(size_t offset, size_t bytes);
+
+  GLuint id() const { return buffer; }
+  unsigned int stalls() const { return waits; }
+
+private:
+  // Where this frame allocates, the ring or the latest spill buffer
+  GLuint buffer, ring;
+  char *mapped;
+  std::vector<char> staging;
+  bool persistent;
+  // Bytes per region, and per region once the ring is recreated
+  size_t regionSize, wantedSize;
+  int frames, current;
+  // Bytes used and usable in this frame, counted from the start of its region
+  size_t head, capacity;
+  std::vector<GLsync> fences;
+  // Buffers that took over after an overflow, deleted at the next frame
+  std::vector<GLuint> spills;
+  unsigned int waits;
+
+  GLuint createBuffer(size_t size);
+  void create();
+  void destroy();
+  void spill(size_t bytes);
+
+  RingBuffer(const RingBuffer &);
+  RingBuffer &operator=(const RingBuffer &);
+};
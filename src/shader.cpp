@@ -0,0 +1,93 @@
+#include <cstdio>
+#include <cstring>
+#include <GL/glew.h>
+
+#include <glstuff.h>
+#include <shader.h>
+
+using namespace std;
+
+ShaderProgram::ShaderProgram(const char *vs, const char *fs, const ShaderProgram *attributeLayout)
+{
+  program = compile_shader(vs, fs);
+
+  if (attributeLayout) {
+    for (const auto &a : attributeLayout->attributes)
+      glBindAttribLocation(program, a.second, a.first.c_str());
+    glLinkProgram(program);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE)
+      fprintf(stderr, "Relinking %s %s with a shared attribute layout failed\n", vs, fs);
+  }
+
+  GLint count, length;
+  GLint size;
+  GLenum type;
+  char name[256];
+
+  glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+  for (GLint i = 0; i < count; i++) {
+    glGetActiveUniform(program, i, sizeof(name), &length, &size, &type, name);
+    GLint location = glGetUniformLocation(program, name);
+    // Members of uniform blocks have no location
+    if (location == -1)
+      continue;
+    uniforms[name] = location;
+    // Arrays are reported as "name[0]", make them reachable by plain name
+    char *bracket = strchr(name, '[');
+    if (bracket) {
+      *bracket = '\0';
+      uniforms[name] = location;
+    }
+  }
+
+  glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &count);
+  for (GLint i = 0; i < count; i++) {
+    glGetActiveAttrib(program, i, sizeof(name), &length, &size, &type, name);
+    attributes[name] = glGetAttribLocation(program, name);
+  }
+
+  printf("%s %s: %lu uniforms %lu attributes\n", vs, fs, uniforms.size(), attributes.size());
+}
+
+ShaderProgram::~ShaderProgram()
+{
+  glDeleteProgram(program);
+}
+
+void ShaderProgram::use() const
+{
+  glUseProgram(program);
+}
+
+GLint ShaderProgram::uniform(const char *name) const
+{
+  unordered_map<string, GLint>::const_iterator i = uniforms.find(name);
+  if (i == uniforms.end()) {
+    fprintf(stderr, "Could not bind uniform %s\n", name);
+    return -1;
+  }
+  return i->second;
+}
+
+GLint ShaderProgram::attrib(const char *name) const
+{
+  unordered_map<string, GLint>::const_iterator i = attributes.find(name);
+  if (i == attributes.end()) {
+    fprintf(stderr, "Could not bind attribute %s\n", name);
+    return -1;
+  }
+  return i->second;
+}
+
+void ShaderProgram::bindBlock(const char *name, GLuint binding) const
+{
+  GLuint index = glGetUniformBlockIndex(program, name);
+  if (index == GL_INVALID_INDEX) {
+    fprintf(stderr, "Could not bind uniform block %s\n", name);
+    return;
+  }
+  glUniformBlockBinding(program, index, binding);
+}
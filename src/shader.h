@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <GL/glew.h>
+
+/*
+  Linked GLSL program with every active uniform and attribute location
+  resolved once at link time. Lookups after construction never touch GL.
+*/
+class ShaderProgram
+{
+public:
+  // Programs linked with an attribute layout share its attribute locations, and with them vertex arrays
+  ShaderProgram(const char *vs, const char *fs, const ShaderProgram *attributeLayout = NULL);
+  virtual ~ShaderProgram();
+
+  void use() const;
+  GLuint id() const { return program; }
+
+  GLint uniform(const char *name) const;
+  GLint attrib(const char *name) const;
+  void bindBlock(const char *name, GLuint binding) const;
+
+  void set(GLint location, int value) const { glUniform1i(location, value); }
+  void set(GLint location, float value) const { glUniform1f(location, value); }
+  void set(GLint location, float x, float y, float z) const { glUniform3f(location, x, y, z); }
+  void set(GLint location, float x, float y, float z, float w) const { glUniform4f(location, x, y, z, w); }
+  void setMatrix(GLint location, const float *m) const { glUniformMatrix4fv(location, 1, GL_FALSE, m); }
+
+private:
+  GLuint program;
+  std::unordered_map<std::string, GLint> uniforms;
+  std::unordered_map<std::string, GLint> attributes;
+
+  ShaderProgram(const ShaderProgram &);
+  ShaderProgram &operator=(const ShaderProgram &);
+};
@@ -0,0 +1,10 @@
+#version 150
+
+in vec3 vertex;
+in mat4 model;
+
+uniform mat4 lightViewProjection;
+
+void main() {
+        gl_Position = lightViewProjection * model * vec4(vertex, 1.0);
+};
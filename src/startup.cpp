@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cstdio>
+
+#include <startup.h>
+#include <trace.h>
+
+using namespace std;
+
+TaskGraph::TaskGraph(JobSystem *_jobs) : jobs(_jobs), total(0), finished(0)
+{
+}
+
+TaskGraph::~TaskGraph()
+{
+  for (node *n : nodes)
+    delete n;
+}
+
+int TaskGraph::add(const char *name, const vector<int> &dependencies, bool gl, const Task &task)
+{
+  node *n = new node();
+  n->name = name;
+  n->gl = gl;
+  n->task = task;
+  n->waiting = dependencies.size();
+  n->start = n->end = 0;
+  n->onWorker = false;
+  int id = nodes.size();
+  for (int d : dependencies)
+    nodes[d]->dependents.push_back(id);
+  nodes.push_back(n);
+  return id;
+}
+
+double TaskGraph::now() const
+{
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+}
+
+void TaskGraph::ready(int task)
+{
+  if (nodes[task]->gl)
+    {
+      lock_guard<mutex> l(lock);
+      glReady.push_back(task);
+      wake.notify_one();
+    }
+  else
+    jobs->run(running, [this, task] { execute(task); }, "startup task");
+}
+
+void TaskGraph::execute(int task)
+{
+  node *n = nodes[task];
+  n->onWorker = this_thread::get_id() != caller;
+  n->start = now();
+  bool failed;
+  {
+    lock_guard<mutex> l(lock);
+    failed = (bool) failure;
+  }
+  if (!failed)
+    {
+      try
+        {
+          TraceZone zone(n->name);
+          n->task();
+        }
+      catch (...)
+        {
+          lock_guard<mutex> l(lock);
+          if (!failure)
+            failure = current_exception();
+        }
+    }
+  n->end = now();
+
+  for (int d : n->dependents)
+    {
+      if (nodes[d]->waiting.fetch_sub(1) == 1)
+        ready(d);
+    }
+  lock_guard<mutex> l(lock);
+  finished++;
+  wake.notify_one();
+}
+
+void TaskGraph::run()
+{
+  started = chrono::steady_clock::now();
+  caller = this_thread::get_id();
+  for (size_t i = 0; i < nodes.size(); i++)
+    {
+      if (!nodes[i]->waiting)
+        ready(i);
+    }
+
+  while (true)
+    {
+      int task = -1;
+      {
+        lock_guard<mutex> l(lock);
+        if (finished == (int) nodes.size())
+          break;
+        if (!glReady.empty())
+          {
+            task = glReady.front();
+            glReady.pop_front();
+          }
+      }
+      if (task >= 0)
+        execute(task);
+      else if (!jobs->help())
+        {
+          unique_lock<mutex> l(lock);
+          wake.wait_for(l, chrono::milliseconds(1),
+                        [this] { return !glReady.empty() || finished == (int) nodes.size(); });
+        }
+    }
+  jobs->wait(running);
+  total = now();
+
+  if (failure)
+    rethrow_exception(failure);
+}
+
+void TaskGraph::printTimings() const
+{
+  vector<const node*> order(nodes.begin(), nodes.end());
+  sort(order.begin(), order.end(), [](const node *a, const node *b) { return a->start < b->start; });
+
+  double busy = 0;
+  for (const node *n : order)
+    busy += n->end - n->start;
+  printf("Startup took %.1f ms for %.1f ms of tasks\n", total, busy);
+  printf("  %-20s %9s %9s  %s\n", "task", "start ms", "time ms", "thread");
+  for (const node *n : order)
+    printf("  %-20s %9.1f %9.1f  %s\n", n->name, n->start, n->end - n->start, n->onWorker ? "worker" : "main");
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <jobs.h>
+
+/*
+  Startup work as a graph of tasks. A task runs once all its dependencies
+  have finished: as a job when it makes no GL calls, otherwise on the
+  thread calling run(), which owns the GL context and helps with jobs
+  while no GL task is ready. The first exception thrown by a task skips
+  the tasks not yet started and is rethrown by run().
+*/
+class TaskGraph
+{
+public:
+  typedef std::function<void()> Task;
+
+  TaskGraph(JobSystem *jobs);
+  ~TaskGraph();
+
+  // Dependencies are ids returned by earlier calls. Names must outlive the graph
+  int add(const char *name, const std::vector<int> &dependencies, bool gl, const Task &task);
+  void run();
+
+  // When every task started and how long it ran, in start order
+  void printTimings() const;
+
+private:
+  struct node
+  {
+    const char *name;
+    bool gl;
+    Task task;
+    std::vector<int> dependents;
+    std::atomic<int> waiting;
+    // Milliseconds since run() started
+    double start, end;
+    // Jobs may also run on the calling thread while it waits for GL tasks
+    bool onWorker;
+  };
+
+  void ready(int task);
+  void execute(int task);
+  double now() const;
+
+  JobSystem *jobs;
+  JobCounter running;
+  std::vector<node*> nodes;
+  std::chrono::steady_clock::time_point started;
+  std::thread::id caller;
+  double total;
+
+  std::mutex lock;
+  std::condition_variable wake;
+  std::deque<int> glReady;
+  int finished;
+  std::exception_ptr failure;
+
+  TaskGraph(const TaskGraph &);
+  TaskGraph &operator=(const TaskGraph &);
+};
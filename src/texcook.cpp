@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <emmintrin.h>
+#include <GL/glew.h>
+
+#include "stb_image.h"
+
+#include <glstuff.h>
+#include <jobs.h>
+#include <texcook.h>
+#include <trace.h>
+
+using namespace std;
+
+static float srgb_to_linear(float c)
+{
+  return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static unsigned char linear_to_srgb(float c)
+{
+  c = min(max(c, 0.0f), 1.0f);
+  c = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+  return (unsigned char) (c * 255 + 0.5f);
+}
+
+// Average 2 x 2 texels of a linear RGBA level, the last row or column of an odd size is dropped
+static void downsample(const vector<float> &src, int w, int h, vector<float> &dst, int dw, int dh)
+{
+  const __m128 quarter = _mm_set1_ps(0.25f);
+  dst.resize((size_t) dw * dh * 4);
+  for (int y = 0; y < dh; y++)
+    {
+      const float *row0 = &src[(size_t) min(2 * y, h - 1) * w * 4];
+      const float *row1 = &src[(size_t) min(2 * y + 1, h - 1) * w * 4];
+      float *out = &dst[(size_t) y * dw * 4];
+      for (int x = 0; x < dw; x++)
+        {
+          int x0 = min(2 * x, w - 1) * 4, x1 = min(2 * x + 1, w - 1) * 4;
+          __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(row0 + x0), _mm_loadu_ps(row0 + x1)),
+                                  _mm_add_ps(_mm_loadu_ps(row1 + x0), _mm_loadu_ps(row1 + x1)));
+          _mm_storeu_ps(out + x * 4, _mm_mul_ps(sum, quarter));
+        }
+    }
+}
+
+static uint16_t pack_565(const float c[3])
+{
+  int r = min(max((int) (c[0] * 31 / 255 + 0.5f), 0), 31);
+  int g = min(max((int) (c[1] * 63 / 255 + 0.5f), 0), 63);
+  int b = min(max((int) (c[2] * 31 / 255 + 0.5f), 0), 31);
+  return r << 11 | g << 5 | b;
+}
+
+static void unpack_565(uint16_t v, float c[3])
+{
+  int r = v >> 11, g = (v >> 5) & 63, b = v & 31;
+  c[0] = r << 3 | r >> 2;
+  c[1] = g << 2 | g >> 4;
+  c[2] = b << 3 | b >> 2;
+}
+
+// Pick the nearest of the four colors between c0 and c1 for every texel, returns the squared error
+static float fit_bc1(const unsigned char texels[16][4], uint16_t &c0, uint16_t &c1, uint32_t &indices)
+{
+  // Four color mode needs c0 above c1, equal endpoints only ever use index 0
+  if (c0 < c1)
+    swap(c0, c1);
+  float palette[4][3];
+  unpack_565(c0, palette[0]);
+  unpack_565(c1, palette[1]);
+  for (int k = 0; k < 3; k++)
+    {
+      palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+      palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+    }
+
+  float error = 0;
+  indices = 0;
+  for (int i = 0; i < 16; i++)
+    {
+      int best = 0;
+      float bestDistance = FLT_MAX;
+      for (int j = 0; j < (c0 == c1 ? 1 : 4); j++)
+        {
+          float d = 0;
+          for (int k = 0; k < 3; k++)
+            d += (texels[i][k] - palette[j][k]) * (texels[i][k] - palette[j][k]);
+          if (d < bestDistance)
+            {
+              bestDistance = d;
+              best = j;
+            }
+        }
+      indices |= best << (2 * i);
+      error += bestDistance;
+    }
+  return error;
+}
+
+// Endpoints from the extent of the colors along their principal axis, then one least squares refit
+static void encode_bc1(const unsigned char texels[16][4], unsigned char *out)
+{
+  float mean[3] = { 0, 0, 0 };
+  for (int i = 0; i < 16; i++)
+    for (int k = 0; k < 3; k++)
+      mean[k] += texels[i][k] / 16.0f;
+
+  float cov[3][3] = { { 0 } };
+  for (int i = 0; i < 16; i++)
+    for (int a = 0; a < 3; a++)
+      for (int b = 0; b < 3; b++)
+        cov[a][b] += (texels[i][a] - mean[a]) * (texels[i][b] - mean[b]);
+
+  float axis[3] = { 0.577f, 0.577f, 0.577f };
+  for (int n = 0; n < 8; n++)
+    {
+      float v[3], length = 0;
+      for (int a = 0; a < 3; a++)
+        {
+          v[a] = cov[a][0] * axis[0] + cov[a][1] * axis[1] + cov[a][2] * axis[2];
+          length += v[a] * v[a];
+        }
+      if (length < 1e-12f)
+        break;
+      length = sqrtf(length);
+      for (int a = 0; a < 3; a++)
+        axis[a] = v[a] / length;
+    }
+
+  float lowest = FLT_MAX, highest = -FLT_MAX;
+  for (int i = 0; i < 16; i++)
+    {
+      float t = 0;
+      for (int k = 0; k < 3; k++)
+        t += (texels[i][k] - mean[k]) * axis[k];
+      lowest = min(lowest, t);
+      highest = max(highest, t);
+    }
+  float lo[3], hi[3];
+  for (int k = 0; k < 3; k++)
+    {
+      lo[k] = mean[k] + axis[k] * lowest;
+      hi[k] = mean[k] + axis[k] * highest;
+    }
+
+  uint16_t c0 = pack_565(hi), c1 = pack_565(lo);
+  uint32_t indices;
+  float error = fit_bc1(texels, c0, c1, indices);
+
+  if (c0 != c1)
+    {
+      // Weight of c0 for each index
+      const float weights[4] = { 1, 0, 2 / 3.0f, 1 / 3.0f };
+      float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+      for (int i = 0; i < 16; i++)
+        {
+          float a = weights[(indices >> (2 * i)) & 3], b = 1 - a;
+          aa += a * a;
+          ab += a * b;
+          bb += b * b;
+          for (int k = 0; k < 3; k++)
+            {
+              ax[k] += a * texels[i][k];
+              bx[k] += b * texels[i][k];
+            }
+        }
+      float det = aa * bb - ab * ab;
+      if (fabsf(det) > 1e-6f)
+        {
+          for (int k = 0; k < 3; k++)
+            {
+              hi[k] = (ax[k] * bb - bx[k] * ab) / det;
+              lo[k] = (bx[k] * aa - ax[k] * ab) / det;
+            }
+          uint16_t r0 = pack_565(hi), r1 = pack_565(lo);
+          uint32_t refined;
+          if (fit_bc1(texels, r0, r1, refined) < error)
+            {
+              c0 = r0;
+              c1 = r1;
+              indices = refined;
+            }
+        }
+    }
+
+  out[0] = c0 & 255;
+  out[1] = c0 >> 8;
+  out[2] = c1 & 255;
+  out[3] = c1 >> 8;
+  for (int b = 0; b < 4; b++)
+    out[4 + b] = indices >> (8 * b);
+}
+
+// Eight alphas between the extremes of the block
+static void encode_bc3_alpha(const unsigned char texels[16][4], unsigned char *out)
+{
+  int lo = 255, hi = 0;
+  for (int i = 0; i < 16; i++)
+    {
+      lo = min(lo, (int) texels[i][3]);
+      hi = max(hi, (int) texels[i][3]);
+    }
+  out[0] = hi;
+  out[1] = lo;
+
+  uint64_t bits = 0;
+  if (hi > lo)
+    {
+      int palette[8] = { hi, lo };
+      for (int j = 2; j < 8; j++)
+        palette[j] = ((8 - j) * hi + (j - 1) * lo) / 7;
+      for (int i = 0; i < 16; i++)
+        {
+          int best = 0;
+          for (int j = 1; j < 8; j++)
+            {
+              if (abs(texels[i][3] - palette[j]) < abs(texels[i][3] - palette[best]))
+                best = j;
+            }
+          bits |= (uint64_t) best << (3 * i);
+        }
+    }
+  for (int b = 0; b < 6; b++)
+    out[2 + b] = bits >> (8 * b);
+}
+
+static void write_u32(FILE *f, uint32_t v)
+{
+  unsigned char b[4] = { (unsigned char) v, (unsigned char) (v >> 8), (unsigned char) (v >> 16), (unsigned char) (v >> 24) };
+  fwrite(b, 1, 4, f);
+}
+
+bool cook_texture(const char *input, const char *output, JobSystem *jobs)
+{
+  TraceZone zone("cook_texture", input);
+  int width, height, components;
+  unsigned char *pixels = stbi_load(input, &width, &height, &components, 4);
+  if (!pixels)
+    {
+      fprintf(stderr, "cannot load texture '%s'\n", input);
+      return false;
+    }
+
+  bool alpha = false;
+  for (size_t i = 0; i < (size_t) width * height && (components == 2 || components == 4); i++)
+    alpha |= pixels[i * 4 + 3] < 255;
+  GLenum format = alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+  size_t blockBytes = alpha ? 16 : 8;
+
+  vector<float> level((size_t) width * height * 4), next;
+  for (size_t i = 0; i < (size_t) width * height; i++)
+    {
+      for (int k = 0; k < 3; k++)
+        level[i * 4 + k] = srgb_to_linear(pixels[i * 4 + k] / 255.0f);
+      level[i * 4 + 3] = pixels[i * 4 + 3] / 255.0f;
+    }
+  free(pixels);
+
+  FILE *f = fopen(output, "wb");
+  if (!f)
+    {
+      fprintf(stderr, "cannot write '%s'\n", output);
+      return false;
+    }
+  int levels = 1;
+  while (max(width, height) >> levels)
+    levels++;
+
+  // KTX 1.1 header, glType, glTypeSize and glFormat are 0, 1 and 0 for compressed data
+  fwrite(ktx_identifier, 1, sizeof(ktx_identifier), f);
+  const uint32_t header[13] = { 0x04030201, 0, 1, 0, format, (uint32_t) (alpha ? GL_RGBA : GL_RGB),
+                                (uint32_t) width, (uint32_t) height, 0, 0, 1, (uint32_t) levels, 0 };
+  for (uint32_t v : header)
+    write_u32(f, v);
+
+  int w = width, h = height;
+  size_t total = 0;
+  vector<unsigned char> blocks;
+  for (int l = 0; l < levels; l++)
+    {
+      if (l)
+        {
+          int dw = max(1, w / 2), dh = max(1, h / 2);
+          downsample(level, w, h, next, dw, dh);
+          level.swap(next);
+          w = dw;
+          h = dh;
+        }
+
+      int bw = (w + 3) / 4, bh = (h + 3) / 4;
+      blocks.resize(bw * bh * blockBytes);
+      jobs->parallelFor(bh, 4, [&](size_t first, size_t last) {
+          unsigned char texels[16][4];
+          for (size_t by = first; by < last; by++)
+            for (int bx = 0; bx < bw; bx++)
+              {
+                // Edge blocks repeat the last row and column
+                for (int i = 0; i < 16; i++)
+                  {
+                    int x = min(bx * 4 + (i & 3), w - 1), y = min((int) by * 4 + (i >> 2), h - 1);
+                    const float *t = &level[((size_t) y * w + x) * 4];
+                    for (int k = 0; k < 3; k++)
+                      texels[i][k] = linear_to_srgb(t[k]);
+                    texels[i][3] = (unsigned char) (min(max(t[3], 0.0f), 1.0f) * 255 + 0.5f);
+                  }
+                unsigned char *out = &blocks[(by * bw + bx) * blockBytes];
+                if (alpha)
+                  {
+                    encode_bc3_alpha(texels, out);
+                    out += 8;
+                  }
+                encode_bc1(texels, out);
+              }
+        }, "encode blocks");
+      // Block sizes keep every level a multiple of 4 bytes, no padding needed
+      write_u32(f, blocks.size());
+      fwrite(&blocks[0], 1, blocks.size(), f);
+      total += blocks.size();
+    }
+
+  bool written = !ferror(f);
+  written &= !fclose(f);
+  if (!written)
+    {
+      fprintf(stderr, "failed writing '%s'\n", output);
+      return false;
+    }
+
+  // Uncompressed RGB is stored as RGBA by most drivers, plus a third for the mips
+  size_t uncompressed = (size_t) width * height * 4 * 4 / 3;
+  printf("%s %dx%d %s, %d levels, %lu kb -> %lu kb (%.1fx smaller) in %s\n", input, width, height,
+         alpha ? "BC3" : "BC1", levels, uncompressed / 1024, total / 1024, (double) uncompressed / total, output);
+  return true;
+}
+
+bool cook_textures(int count, char **files)
+{
+  JobSystem jobs;
+  bool cooked = true;
+  for (int i = 0; i < count; i++)
+    cooked &= cook_texture(files[i], cooked_texture_path(files[i]).c_str(), &jobs);
+  return cooked;
+}
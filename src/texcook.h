@@ -0,0 +1,20 @@
+#pragma once
+
+class JobSystem;
+
+/*
+  Offline texture cooking. A cooked texture is a KTX file holding the full
+  mip chain, block compressed, that loads with glCompressedTexImage2D
+  without decoding or mip generation at runtime. Mips are box filtered in
+  linear light and converted back to sRGB before encoding. Opaque images
+  become BC1 (DXT1) at 4 bits per texel, images with alpha BC3 (DXT5) at
+  8 bits per texel.
+
+  decode_texture picks up the cooked file next to the source image, see
+  cooked_texture_path in glstuff.h.
+*/
+
+// Cook one image into a KTX file, blocks are encoded on the jobs
+bool cook_texture(const char *input, const char *output, JobSystem *jobs);
+// Cook every file next to its source, false if any failed
+bool cook_textures(int count, char **files);
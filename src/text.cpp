@@ -15,6 +15,7 @@
 #include FT_FREETYPE_H
 
 #include <glstuff.h>
+#include <ringbuffer.h>
 #include <text.h>
 
 struct point {
@@ -24,7 +25,7 @@ struct point {
   GLfloat t;
 };
 
-static GLuint vbo;
+static RingBuffer *ring;
 
 static FT_Library ft;
 static FT_Face face;
@@ -33,7 +34,7 @@ const char *fontfilename = "assets/terminus.ttf";
 
 atlas *a;
 
-int initFreetype() {
+int loadFont() {
   if (FT_Init_FreeType(&ft)) {
     fprintf(stderr, "Could not init freetype library\n");
     return 0;
@@ -45,6 +46,15 @@ int initFreetype() {
     return 0;
   }
 
+  a = new atlas(face, 64);
+
+  return 1;
+}
+
+int initFreetype(RingBuffer *stream) {
+  if (!a)
+    return 0;
+
   program = compile_shader("src/text.vs", "src/text.fs");
   if(program == 0)
     return 0;
@@ -59,9 +69,10 @@ int initFreetype() {
   if(attribute_coord == -1 || uniform_tex == -1 || uniform_color == -1)
     return 0;
 
-  glGenBuffers(1, &vbo);
+  ring = stream;
 
-  a = new atlas(face, 64);
+  glUseProgram(program);
+  a->upload();
 
   return 1;
 }
@@ -72,11 +83,8 @@ void renderText_text(const char *text, atlas * a, float x, float y, float sx, fl
   glBindTexture(GL_TEXTURE_2D, a->tex);
   glUniform1i(uniform_tex, 0);
 
-  glEnableVertexAttribArray(attribute_coord);
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glVertexAttribPointer(attribute_coord, 4, GL_FLOAT, GL_FALSE, 0, 0);
-
-  point coords[6 * strlen(text)];
+  size_t offset;
+  point *coords = (point *) ring->allocate(6 * strlen(text) * sizeof(point), sizeof(point), &offset);
   int c = 0;
 
   for (p = (const uint8_t *)text; *p; p++) {
@@ -105,7 +113,11 @@ void renderText_text(const char *text, atlas * a, float x, float y, float sx, fl
       x2 + w, -y2 - h, a->c[*p].tx + a->c[*p].bw / a->w, a->c[*p].ty + a->c[*p].bh / a->h};
   }
 
-  glBufferData(GL_ARRAY_BUFFER, sizeof coords, coords, GL_DYNAMIC_DRAW);
+  ring->commit(offset, c * sizeof(point));
+
+  glEnableVertexAttribArray(attribute_coord);
+  glBindBuffer(GL_ARRAY_BUFFER, ring->id());
+  glVertexAttribPointer(attribute_coord, 4, GL_FLOAT, GL_FALSE, 0, (const GLvoid *) offset);
   glDrawArrays(GL_TRIANGLES, 0, c);
 
   glDisableVertexAttribArray(attribute_coord);
@@ -130,6 +142,62 @@ void position(float wx, float wy, float x, float y, float z) {
   glDisable(GL_BLEND);
 }
 
+void overlay(float wx, float wy, int line, const char *text) {
+  float sx = 1.0 / wx;
+  float sy = 1.0 / wy;
+
+  glUseProgram(program);
+  glEnable(GL_BLEND); glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  GLfloat yellow[4] = { 1, 1, 0, 1 };
+
+  glUniform4fv(uniform_color, 1, yellow);
+  renderText_text(text, a, -1 + 8 * sx, 1 - (140 + 40 * line) * sy, sx, sy);
+  glDisable(GL_BLEND);
+}
+
+/* Bars of count values under an overlay line, height pixels tall at maxValue, drawn with the atlas' solid block */
+void graph(float wx, float wy, int line, const float *values, int count, float maxValue, float height) {
+  const float barWidth = 3;
+  float sx = 2.0 / wx;
+  float sy = 2.0 / wy;
+  float left = -1 + 4 * sx;
+  float bottom = 1 - (70 + 20 * line + 8 + height) * sy;
+
+  glUseProgram(program);
+  glEnable(GL_BLEND); glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glBindTexture(GL_TEXTURE_2D, a->tex);
+  glUniform1i(uniform_tex, 0);
+
+  size_t offset;
+  point *coords = (point *) ring->allocate(6 * (count + 1) * sizeof(point), sizeof(point), &offset);
+  int c = 0;
+  for (int i = 0; i <= count; i++) {
+    /* The last quad is a backdrop line marking maxValue */
+    float x0 = i < count ? left + i * barWidth * sx : left;
+    float x1 = i < count ? x0 + (barWidth - 1) * sx : left + count * barWidth * sx;
+    float y0 = i < count ? bottom : bottom + height * sy;
+    float y1 = i < count ? bottom + std::min(values[i] / maxValue, 1.0f) * height * sy : y0 + sy;
+    coords[c++] = (point) { x0, y0, a->solidx, a->solidy };
+    coords[c++] = (point) { x1, y0, a->solidx, a->solidy };
+    coords[c++] = (point) { x0, y1, a->solidx, a->solidy };
+    coords[c++] = (point) { x1, y0, a->solidx, a->solidy };
+    coords[c++] = (point) { x0, y1, a->solidx, a->solidy };
+    coords[c++] = (point) { x1, y1, a->solidx, a->solidy };
+  }
+  ring->commit(offset, c * sizeof(point));
+
+  GLfloat green[4] = { 0, 1, 0, 0.8 };
+  glUniform4fv(uniform_color, 1, green);
+  glEnableVertexAttribArray(attribute_coord);
+  glBindBuffer(GL_ARRAY_BUFFER, ring->id());
+  glVertexAttribPointer(attribute_coord, 4, GL_FLOAT, GL_FALSE, 0, (const GLvoid *) offset);
+  glDrawArrays(GL_TRIANGLES, 0, c);
+
+  glDisableVertexAttribArray(attribute_coord);
+  glDisable(GL_BLEND);
+}
+
 void destroyFreetype() {
   glDeleteProgram(program);
 }
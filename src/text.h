@@ -4,6 +4,7 @@
 #define MAXWIDTH 512
 #include <freetype2/ft2build.h>
 #include FT_FREETYPE_H
+#include <vector>
 static GLuint program;
 static GLint attribute_coord;
 static GLint uniform_tex;
@@ -30,12 +31,20 @@ struct atlas {
     float ty;
   } c[128];
 
+  /* Center of an opaque texel block for untextured shapes */
+  float solidx;
+  float solidy;
+
+  /* Glyphs rasterized by the constructor, uploaded and dropped by upload() */
+  std::vector<unsigned char> pixels;
+
   atlas(FT_Face face, int height) {
     FT_Set_Pixel_Sizes(face, 0, height);
     FT_GlyphSlot g = face->glyph;
 
     unsigned int roww = 0;
     unsigned int rowh = 0;
+    tex = 0;
     w = 0;
     h = 0;
 
@@ -60,26 +69,12 @@ struct atlas {
     w = std::max(w, roww);
     h += rowh;
 
-    /* Create a texture that will be used to hold all ASCII glyphs */
-    glActiveTexture(GL_TEXTURE0);
-    glGenTextures(1, &tex);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glUniform1i(uniform_tex, 0);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, w, h, 0, GL_ALPHA, GL_UNSIGNED_BYTE, 0);
+    /* Room for a 2 x 2 opaque block below the glyphs */
+    h += 2;
 
-    /* We require 1 byte alignment when uploading texture data */
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    pixels.assign(w * h, 0);
 
-    /* Clamping to edges is important to prevent artifacts when scaling */
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-    /* Linear filtering usually looks best for text */
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    /* Paste all glyph bitmaps into the texture, remembering the offset */
+    /* Paste all glyph bitmaps into the image, remembering the offset */
     int ox = 0;
     int oy = 0;
 
@@ -97,7 +92,8 @@ struct atlas {
         ox = 0;
       }
 
-      glTexSubImage2D(GL_TEXTURE_2D, 0, ox, oy, g->bitmap.width, g->bitmap.rows, GL_ALPHA, GL_UNSIGNED_BYTE, g->bitmap.buffer);
+      for (unsigned int row = 0; row < g->bitmap.rows; row++)
+        memcpy(&pixels[(oy + row) * w + ox], g->bitmap.buffer + row * g->bitmap.pitch, g->bitmap.width);
       c[i].ax = g->advance.x >> 6;
       c[i].ay = g->advance.y >> 6;
 
@@ -114,6 +110,34 @@ struct atlas {
       ox += g->bitmap.width + 1;
     }
 
+    for (unsigned int row = h - 2; row < h; row++)
+      memset(&pixels[row * w], 255, 2);
+    solidx = 1.0 / w;
+    solidy = (h - 1.0) / h;
+  }
+
+  /* Create a texture that will be used to hold all ASCII glyphs, needs the GL context */
+  void upload() {
+    glActiveTexture(GL_TEXTURE0);
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glUniform1i(uniform_tex, 0);
+
+    /* We require 1 byte alignment when uploading texture data */
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, w, h, 0, GL_ALPHA, GL_UNSIGNED_BYTE, &pixels[0]);
+
+    /* Clamping to edges is important to prevent artifacts when scaling */
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    /* Linear filtering usually looks best for text */
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    std::vector<unsigned char>().swap(pixels);
+
     fprintf(stderr, "Generated a %d x %d (%d kb) texture atlas\n", w, h, w * h / 1024);
   }
 
@@ -122,8 +146,14 @@ struct atlas {
   }
 };
 
-int initFreetype();
+class RingBuffer;
+/* Opens the font and rasterizes the atlas, no GL calls so it may run on any thread */
+int loadFont();
+/* Text shader and atlas texture, on the GL thread after loadFont() */
+int initFreetype(RingBuffer *stream);
 void renderText(const char *text, atlas * a, float x, float y, float sx, float sy);
 void destroyFreetype();
 void display(float wx, float wy);
 void position(float wx, float wy, float x, float y, float z);
+void overlay(float wx, float wy, int line, const char *text);
+void graph(float wx, float wy, int line, const float *values, int count, float maxValue, float height);
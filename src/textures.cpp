@@ -0,0 +1,556 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <textures.h>
+#include <trace.h>
+
+using namespace std;
+
+// Of the decoded pixels and their layout, so identical files in different places share a texture
+static uint64_t content_hash(const TextureImage &image)
+{
+  uint64_t h = image.width * 0x9E3779B97F4A7C15ull ^ image.height ^ (uint64_t) image.compressed << 32 ^ image.components;
+  size_t i = 0;
+  for (; i + 8 <= image.bytes; i += 8)
+    {
+      uint64_t word;
+      memcpy(&word, image.pixels + i, 8);
+      h = (h ^ word * 0x9E3779B97F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+      h ^= h >> 31;
+    }
+  for (; i < image.bytes; i++)
+    h = (h ^ image.pixels[i]) * 0x100000001B3ull;
+  return h;
+}
+
+TextureLoader::TextureLoader(JobSystem *_jobs, size_t _bytesPerUpdate)
+  : jobs(_jobs), bytesPerUpdate(_bytesPerUpdate), nextId(1)
+{
+}
+
+TextureLoader::~TextureLoader()
+{
+  jobs->wait(working);
+  for (request *r : requests)
+    discard(r);
+  if (!buffers.empty())
+    glDeleteBuffers(buffers.size(), &buffers[0]);
+}
+
+void TextureLoader::setHooks(const DecodedHook &_decoded, const UploadedHook &_uploaded)
+{
+  decoded = _decoded;
+  uploaded = _uploaded;
+}
+
+GLuint TextureLoader::placeholder()
+{
+  const unsigned char grey[4] = { 128, 128, 128, 255 };
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+  return texture;
+}
+
+unsigned long TextureLoader::load(const char *file, GLuint *texture)
+{
+  request *r = new request();
+  r->file = file;
+  r->id = nextId++;
+  r->texture = placeholder();
+  r->buffer = 0;
+  r->image.pixels = NULL;
+  r->hash = 0;
+  r->mapped = NULL;
+  r->checked = r->cancelled = false;
+  r->state = DECODING;
+
+  requests.push_back(r);
+  jobs->run(working, [r] {
+      bool decoded = decode_texture(r->file.c_str(), r->image);
+      if (decoded)
+        r->hash = content_hash(r->image);
+      r->state.store(decoded ? DECODED : FAILED, memory_order_release);
+    }, "texture decode");
+  *texture = r->texture;
+  return r->id;
+}
+
+void TextureLoader::cancel(unsigned long id)
+{
+  for (request *r : requests)
+    {
+      if (r->id == id)
+        r->cancelled = true;
+    }
+}
+
+void TextureLoader::update()
+{
+  advance(bytesPerUpdate);
+}
+
+void TextureLoader::finish()
+{
+  TraceZone zone("TextureLoader::finish");
+  while (!requests.empty())
+    {
+      size_t left = requests.size();
+      advance((size_t) -1);
+      if (requests.size() == left && !jobs->help())
+        this_thread::yield();
+    }
+}
+
+void TextureLoader::advance(size_t budget)
+{
+  // Nothing spent lets the first texture through whatever its size
+  size_t spent = 0;
+  size_t kept = 0;
+  for (size_t i = 0; i < requests.size(); i++)
+    {
+      request *r = requests[i];
+      int state = r->state.load(memory_order_acquire);
+      // Failed loads keep the placeholder
+      if ((r->cancelled && state != DECODING && state != COPYING) || state == FAILED)
+        {
+          discard(r);
+          continue;
+        }
+      if (state == COPIED && spent < budget)
+        {
+          spent += r->image.bytes;
+          upload(r);
+          if (uploaded)
+            uploaded(r->id);
+          delete r;
+          continue;
+        }
+      if (state == DECODED && !r->checked)
+        {
+          r->checked = true;
+          if (decoded && !decoded(r->id, r->image, r->hash))
+            {
+              discard(r);
+              continue;
+            }
+        }
+      if (state == DECODED && spent < budget)
+        {
+          spent += r->image.bytes;
+          map(r);
+        }
+      requests[kept++] = r;
+    }
+  requests.resize(kept);
+}
+
+void TextureLoader::map(request *r)
+{
+  size_t bytes = r->image.bytes;
+  if (buffers.empty())
+    {
+      buffers.push_back(0);
+      glGenBuffers(1, &buffers.back());
+    }
+  r->buffer = buffers.back();
+  buffers.pop_back();
+
+  // Fresh storage, a buffer still being read by an earlier upload is not waited for
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, r->buffer);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+  r->mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  if (!r->mapped)
+    {
+      // Upload straight from the decoded pixels instead
+      buffers.push_back(r->buffer);
+      r->buffer = 0;
+      r->state = COPIED;
+      return;
+    }
+  r->state = COPYING;
+  jobs->run(working, [r] {
+      TraceZone zone("copy texture", r->file.c_str());
+      memcpy(r->mapped, r->image.pixels, r->image.bytes);
+      free(r->image.pixels);
+      r->image.pixels = NULL;
+      r->state.store(COPIED, memory_order_release);
+    }, "texture copy");
+}
+
+void TextureLoader::upload(request *r)
+{
+  TraceZone zone("upload_texture", r->file.c_str());
+  GLenum format = texture_format(r->image.components);
+
+  // Storage first, with no pixel buffer bound so nothing is read yet
+  glBindTexture(GL_TEXTURE_2D, r->texture);
+  if (!r->image.compressed)
+    glTexImage2D(GL_TEXTURE_2D, 0, format, r->image.width, r->image.height, 0, format, GL_UNSIGNED_BYTE, NULL);
+
+  const unsigned char *pixels = r->image.pixels;
+  bool intact = true;
+  if (r->buffer)
+    {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, r->buffer);
+      intact = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      r->mapped = NULL;
+      // Now an offset into the bound buffer
+      pixels = NULL;
+    }
+
+  if (!intact)
+    fprintf(stderr, "Pixel buffer of %s was lost, the texture stays empty\n", r->file.c_str());
+  else if (r->image.compressed)
+    upload_compressed_texture(r->image, pixels);
+  else
+    {
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, r->image.width, r->image.height, format, GL_UNSIGNED_BYTE, pixels);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+      glGenerateMipmap(GL_TEXTURE_2D);
+    }
+
+  if (r->buffer)
+    {
+      // Drop the storage once the upload has read it, pooled buffers hold no memory
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, 0, NULL, GL_STREAM_DRAW);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      buffers.push_back(r->buffer);
+    }
+  free(r->image.pixels);
+  r->image.pixels = NULL;
+}
+
+void TextureLoader::discard(request *r)
+{
+  if (r->mapped)
+    {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, r->buffer);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, 0, NULL, GL_STREAM_DRAW);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      buffers.push_back(r->buffer);
+    }
+  free(r->image.pixels);
+  delete r;
+}
+
+// Bytes per texel as drivers usually store the pixel formats, RGB is padded to RGBA
+static size_t texel_bytes(GLenum format)
+{
+  if (format == GL_LUMINANCE)
+    return 1;
+  if (format == GL_LUMINANCE_ALPHA)
+    return 2;
+  return 4;
+}
+
+static size_t level_bytes(GLenum format, bool compressed, int width, int height)
+{
+  if (compressed)
+    return compressed_level_bytes(format, width, height);
+  return (size_t) width * height * texel_bytes(format);
+}
+
+TextureManager::TextureManager(JobSystem *jobs, size_t budget)
+  : loader(jobs), limit(budget), resident(0), distinct(0), frame(0)
+{
+  loader.setHooks([this](unsigned long id, const TextureImage &image, uint64_t hash) { return decoded(id, image, hash); },
+                  [this](unsigned long id) { uploaded(id); });
+}
+
+TextureManager::~TextureManager()
+{
+  for (texture *t : textures)
+    {
+      if (t && t->name)
+        glDeleteTextures(1, &t->name);
+      delete t;
+    }
+}
+
+int TextureManager::acquire(const char *file)
+{
+  unordered_map<string, int>::iterator f = files.find(file);
+  if (f != files.end())
+    {
+      textures[f->second]->references++;
+      textures[canonical(f->second)]->users++;
+      return f->second;
+    }
+
+  texture *t = new texture();
+  t->file = file;
+  t->hash = 0;
+  t->references = t->users = 1;
+  t->alias = -1;
+  t->load = loader.load(file, &t->name);
+  t->loading = true;
+  t->evicted = false;
+  t->format = 0;
+  t->compressed = false;
+  t->width = t->height = t->levels = 0;
+  t->bytes = 0;
+  t->lastDrawn = frame;
+
+  int handle;
+  if (freeHandles.empty())
+    {
+      handle = textures.size();
+      textures.push_back(t);
+    }
+  else
+    {
+      handle = freeHandles.back();
+      freeHandles.pop_back();
+      textures[handle] = t;
+    }
+  files[file] = handle;
+  loading[t->load] = handle;
+  distinct++;
+  return handle;
+}
+
+void TextureManager::release(int handle)
+{
+  if (handle < 0)
+    return;
+  texture *t = textures[handle];
+  int c = canonical(handle);
+  t->references--;
+  textures[c]->users--;
+  if (c != handle && !t->references)
+    destroy(handle);
+  if (!textures[c]->users)
+    destroy(c);
+}
+
+void TextureManager::destroy(int handle)
+{
+  texture *t = textures[handle];
+  if (t->alias < 0)
+    {
+      if (t->loading)
+        {
+          loader.cancel(t->load);
+          loading.erase(t->load);
+        }
+      glDeleteTextures(1, &t->name);
+      if (t->hash && hashes.count(t->hash) && hashes[t->hash] == handle)
+        hashes.erase(t->hash);
+      resident -= t->bytes;
+      distinct--;
+    }
+  files.erase(t->file);
+  delete t;
+  textures[handle] = NULL;
+  freeHandles.push_back(handle);
+}
+
+int TextureManager::canonical(int handle) const
+{
+  while (textures[handle]->alias >= 0)
+    handle = textures[handle]->alias;
+  return handle;
+}
+
+GLuint TextureManager::name(int handle) const
+{
+  return handle < 0 ? 0 : textures[canonical(handle)]->name;
+}
+
+GLuint TextureManager::use(int handle)
+{
+  if (handle < 0)
+    return 0;
+  texture *t = textures[canonical(handle)];
+  t->lastDrawn = frame;
+  return t->name;
+}
+
+bool TextureManager::decoded(unsigned long id, const TextureImage &image, uint64_t hash)
+{
+  unordered_map<unsigned long, int>::iterator l = loading.find(id);
+  if (l == loading.end())
+    return false;
+  int handle = l->second;
+  texture *t = textures[handle];
+
+  unordered_map<uint64_t, int>::iterator same = hashes.find(hash);
+  if (same != hashes.end() && same->second != handle)
+    {
+      // Uses move over to the texture with the same contents
+      texture *c = textures[same->second];
+      printf("Texture %s is the same as %s\n", t->file.c_str(), c->file.c_str());
+      c->users += t->users;
+      c->lastDrawn = max(c->lastDrawn, t->lastDrawn);
+      t->users = 0;
+      t->alias = same->second;
+      t->loading = false;
+      loading.erase(l);
+      glDeleteTextures(1, &t->name);
+      t->name = 0;
+      distinct--;
+      return false;
+    }
+
+  hashes[hash] = handle;
+  t->hash = hash;
+  t->compressed = image.compressed != 0;
+  t->format = t->compressed ? image.compressed : texture_format(image.components);
+  t->width = image.width;
+  t->height = image.height;
+  t->levels = t->compressed ? image.levels : 1;
+  // glGenerateMipmap makes the full chain of uncompressed images
+  while (!t->compressed && max(t->width, t->height) >> t->levels)
+    t->levels++;
+  return true;
+}
+
+void TextureManager::uploaded(unsigned long id)
+{
+  unordered_map<unsigned long, int>::iterator l = loading.find(id);
+  if (l == loading.end())
+    return;
+  texture *t = textures[l->second];
+  loading.erase(l);
+  t->loading = false;
+  t->evicted = false;
+  t->bytes = 0;
+  for (int level = 0; level < t->levels; level++)
+    t->bytes += level_bytes(t->format, t->compressed, max(t->width >> level, 1), max(t->height >> level, 1));
+  resident += t->bytes;
+}
+
+void TextureManager::reload(int handle)
+{
+  texture *t = textures[handle];
+  glDeleteTextures(1, &t->name);
+  t->load = loader.load(t->file.c_str(), &t->name);
+  t->loading = true;
+  loading[t->load] = handle;
+}
+
+void TextureManager::evict(texture *t)
+{
+  printf("Texture %s evicted, %lu kb\n", t->file.c_str(), t->bytes / 1024);
+  glDeleteTextures(1, &t->name);
+  t->name = TextureLoader::placeholder();
+  t->evicted = true;
+  resident -= t->bytes;
+  t->bytes = 0;
+}
+
+// Copy every level but the top one into a new texture, on the GPU. The copy needs both
+// textures in the same sized format, which is taken from the texture rather than the upload
+void TextureManager::downsample(texture *t)
+{
+  GLint internalFormat, width;
+  glBindTexture(GL_TEXTURE_2D, t->name);
+  glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+  int levels = 1;
+  for (; levels < t->levels; levels++)
+    {
+      glGetTexLevelParameteriv(GL_TEXTURE_2D, levels, GL_TEXTURE_WIDTH, &width);
+      if (!width)
+        break;
+    }
+  if (levels < 2)
+    {
+      t->levels = levels;
+      return;
+    }
+
+  GLuint smaller;
+  glGenTextures(1, &smaller);
+  glBindTexture(GL_TEXTURE_2D, smaller);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 2);
+  bool storage = GLEW_ARB_texture_storage;
+  if (storage)
+    glTexStorage2D(GL_TEXTURE_2D, levels - 1, internalFormat, max(t->width >> 1, 1), max(t->height >> 1, 1));
+
+  size_t bytes = 0;
+  for (int level = 1; level < levels; level++)
+    {
+      int w = max(t->width >> level, 1), h = max(t->height >> level, 1);
+      size_t size = level_bytes(t->format, t->compressed, w, h);
+      if (!storage && t->compressed)
+        glCompressedTexImage2D(GL_TEXTURE_2D, level - 1, internalFormat, w, h, 0, size, NULL);
+      else if (!storage)
+        glTexImage2D(GL_TEXTURE_2D, level - 1, internalFormat, w, h, 0, t->format, GL_UNSIGNED_BYTE, NULL);
+      glCopyImageSubData(t->name, GL_TEXTURE_2D, level, 0, 0, 0, smaller, GL_TEXTURE_2D, level - 1, 0, 0, 0, w, h, 1);
+      bytes += size;
+    }
+  glDeleteTextures(1, &t->name);
+
+  printf("Texture %s downsampled to %dx%d, %lu kb\n", t->file.c_str(),
+         max(t->width >> 1, 1), max(t->height >> 1, 1), bytes / 1024);
+  t->name = smaller;
+  t->width = max(t->width >> 1, 1);
+  t->height = max(t->height >> 1, 1);
+  t->levels = levels - 1;
+  resident -= t->bytes - bytes;
+  t->bytes = bytes;
+}
+
+void TextureManager::enforceBudget()
+{
+  if (!limit || resident <= limit)
+    return;
+
+  vector<texture*> order;
+  for (texture *t : textures)
+    {
+      if (t && t->alias < 0 && !t->loading && !t->evicted)
+        order.push_back(t);
+    }
+  sort(order.begin(), order.end(), [](const texture *a, const texture *b) { return a->lastDrawn < b->lastDrawn; });
+
+  for (size_t i = 0; i < order.size() && resident > limit && order[i]->lastDrawn < frame - idleFrames; i++)
+    evict(order[i]);
+
+  // What is left was drawn recently, the least recent ones give up detail first
+  if (!GLEW_ARB_copy_image)
+    return;
+  for (size_t i = 0; i < order.size() && resident > limit; i++)
+    {
+      texture *t = order[i];
+      while (!t->evicted && resident > limit && t->levels > 1 && max(t->width, t->height) > minSize)
+        downsample(t);
+    }
+}
+
+void TextureManager::update()
+{
+  frame++;
+  loader.update();
+  // Evicted textures drawn last frame come back
+  for (size_t i = 0; i < textures.size(); i++)
+    {
+      texture *t = textures[i];
+      if (t && t->evicted && !t->loading && t->lastDrawn == frame - 1)
+        reload(i);
+    }
+  enforceBudget();
+}
+
+void TextureManager::finish()
+{
+  loader.finish();
+  enforceBudget();
+}
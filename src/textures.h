@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <GL/glew.h>
+
+#include <glstuff.h>
+#include <jobs.h>
+
+/*
+  Loads textures in the background. load() hands out the texture name at
+  once, holding a grey placeholder texel, and decodes the file in a job.
+  Loads are told apart by an id that is never reused, unlike texture names
+  which GL hands out again once deleted.
+  update() on the GL thread maps a pixel buffer for every decoded image and
+  has a job copy the pixels in. Once the copy is done the buffer is unmapped
+  and the texture respecified from it, so the GL thread never touches pixel
+  data and the driver can upload without stalling the frame.
+*/
+class TextureLoader
+{
+public:
+  // Called on the GL thread with the contents hash before a decoded image is uploaded, false drops it
+  typedef std::function<bool(unsigned long id, const TextureImage &image, uint64_t hash)> DecodedHook;
+  // Called once the texture of a load holds the decoded image
+  typedef std::function<void(unsigned long id)> UploadedHook;
+
+  // Every update maps and uploads at most bytesPerUpdate, but always one texture
+  TextureLoader(JobSystem *jobs, size_t bytesPerUpdate = 8 << 20);
+  ~TextureLoader();
+
+  void setHooks(const DecodedHook &decoded, const UploadedHook &uploaded);
+
+  // Start loading file into a new texture, returns the id of the load
+  unsigned long load(const char *file, GLuint *texture);
+  // Stop a load, its texture is no longer touched afterwards
+  void cancel(unsigned long id);
+  // Advance the loads, once per frame on the GL thread
+  void update();
+  // Upload everything loaded so far, for benchmarks that must not draw placeholders
+  void finish();
+
+  size_t pending() const { return requests.size(); }
+
+  // A new texture of one grey texel
+  static GLuint placeholder();
+
+private:
+  enum { DECODING, DECODED, COPYING, COPIED, FAILED };
+  struct request
+  {
+    std::string file;
+    unsigned long id;
+    GLuint texture, buffer;
+    TextureImage image;
+    uint64_t hash;
+    void *mapped;
+    bool checked, cancelled;
+    std::atomic<int> state;
+  };
+
+  void advance(size_t budget);
+  void map(request *r);
+  void upload(request *r);
+  void discard(request *r);
+
+  JobSystem *jobs;
+  // Decode and copy jobs, waited on before anything they write is freed
+  JobCounter working;
+  size_t bytesPerUpdate;
+  std::vector<request*> requests;
+  unsigned long nextId;
+  // Unmapped pixel buffers for reuse
+  std::vector<GLuint> buffers;
+  DecodedHook decoded;
+  UploadedHook uploaded;
+
+  TextureLoader(const TextureLoader &);
+  TextureLoader &operator=(const TextureLoader &);
+};
+
+/*
+  Owns every material texture. acquire() hands out a handle per file and
+  counts its uses, the texture is deleted once the last one is released.
+  Files that decode to the same contents share one texture, which is why
+  users hold handles and resolve them to a texture name when drawing.
+
+  The memory of each texture is estimated from its levels. While the total
+  is over budget, textures not drawn for idleFrames are dropped back to the
+  placeholder, to load again when next drawn, and after that the least
+  recently drawn lose their top mip level on the GPU, down to minSize,
+  where ARB_copy_image is supported.
+*/
+class TextureManager
+{
+public:
+  // No budget when budget is 0
+  TextureManager(JobSystem *jobs, size_t budget = 0);
+  ~TextureManager();
+
+  int acquire(const char *file);
+  void release(int handle);
+
+  // Texture to bind for a handle, 0 for -1. use() also marks it drawn this frame
+  GLuint name(int handle) const;
+  GLuint use(int handle);
+
+  // Once per frame on the GL thread, before drawing
+  void update();
+  // Upload everything acquired so far
+  void finish();
+
+  // Distinct textures, duplicates count once
+  size_t count() const { return distinct; }
+  size_t used() const { return resident; }
+  size_t budget() const { return limit; }
+
+  static const int idleFrames = 300, minSize = 64;
+
+private:
+  struct texture
+  {
+    std::string file;
+    uint64_t hash;
+    // Handles given out for the file, and uses of the texture counting those of its duplicates
+    int references, users;
+    // Handle of the texture holding the same contents, -1 unless a duplicate
+    int alias;
+    GLuint name;
+    // Id of the load in flight while loading
+    unsigned long load;
+    bool loading, evicted;
+    // Of the uploaded image, format is the compressed or the pixel format
+    GLenum format;
+    bool compressed;
+    int width, height, levels;
+    size_t bytes;
+    int lastDrawn;
+  };
+
+  int canonical(int handle) const;
+  bool decoded(unsigned long id, const TextureImage &image, uint64_t hash);
+  void uploaded(unsigned long id);
+  void reload(int handle);
+  void evict(texture *t);
+  void downsample(texture *t);
+  void enforceBudget();
+  void destroy(int handle);
+
+  TextureLoader loader;
+  std::vector<texture*> textures;
+  std::vector<int> freeHandles;
+  std::unordered_map<std::string, int> files;
+  // Handle holding each contents, and of every texture being loaded by load id
+  std::unordered_map<uint64_t, int> hashes;
+  std::unordered_map<unsigned long, int> loading;
+  size_t limit, resident, distinct;
+  int frame;
+
+  TextureManager(const TextureManager &);
+  TextureManager &operator=(const TextureManager &);
+};
@@ -0,0 +1,202 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <trace.h>
+
+using namespace std;
+
+std::atomic<bool> tracing(false);
+
+struct traceEvent
+{
+  const char *name;
+  char detail[32];
+  uint64_t nanoseconds;
+  char phase;
+};
+
+// Filled by its thread only, the count is published after each event is written
+struct traceChunk
+{
+  static const int CAPACITY = 4096;
+  traceEvent events[CAPACITY];
+  atomic<int> count;
+  atomic<traceChunk*> next;
+  traceChunk() : count(0), next(NULL) {}
+};
+
+struct threadBuffer
+{
+  int id;
+  string name;
+  // The writer appends at tail, the reader frees from head
+  traceChunk *head, *tail;
+  // Events of head already consumed by the reader
+  int read;
+};
+
+// Registration and writing out take the lock, recording never does
+static mutex bufferLock;
+static vector<threadBuffer*> buffers;
+static string filename;
+static const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+static thread_local threadBuffer *local = NULL;
+
+static threadBuffer *buffer()
+{
+  if (!local)
+    {
+      local = new threadBuffer();
+      local->head = local->tail = new traceChunk();
+      local->read = 0;
+      lock_guard<mutex> l(bufferLock);
+      local->id = buffers.size();
+      buffers.push_back(local);
+    }
+  return local;
+}
+
+static void record(char phase, const char *name, const char *detail)
+{
+  threadBuffer *b = buffer();
+  traceChunk *c = b->tail;
+  int n = c->count.load(memory_order_relaxed);
+  if (n == traceChunk::CAPACITY)
+    {
+      traceChunk *fresh = new traceChunk();
+      c->next.store(fresh, memory_order_release);
+      b->tail = c = fresh;
+      n = 0;
+    }
+  traceEvent &e = c->events[n];
+  e.name = name;
+  e.phase = phase;
+  e.detail[0] = '\0';
+  if (detail)
+    {
+      strncpy(e.detail, detail, sizeof(e.detail) - 1);
+      e.detail[sizeof(e.detail) - 1] = '\0';
+    }
+  e.nanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+  c->count.store(n + 1, memory_order_release);
+}
+
+static void write_escaped(FILE *f, const char *s)
+{
+  for (; *s; s++)
+    {
+      if (*s == '"' || *s == '\\')
+        fputc('\\', f);
+      if ((unsigned char) *s >= 0x20)
+        fputc(*s, f);
+    }
+}
+
+// Hand every published event to visit and free the chunks the writers are done with
+template <typename F> static void consume(threadBuffer *b, F visit)
+{
+  while (true)
+    {
+      traceChunk *c = b->head;
+      int n = c->count.load(memory_order_acquire);
+      for (; b->read < n; b->read++)
+        visit(c->events[b->read]);
+      traceChunk *next = c->next.load(memory_order_acquire);
+      if (!next)
+        break;
+      // The chunk filled up after the count was read, the writer is done with it now
+      n = c->count.load(memory_order_acquire);
+      for (; b->read < n; b->read++)
+        visit(c->events[b->read]);
+      b->head = next;
+      b->read = 0;
+      delete c;
+    }
+}
+
+static void write_at_exit()
+{
+  trace_stop();
+}
+
+void trace_begin(const char *name, const char *detail)
+{
+  record('B', name, detail);
+}
+
+void trace_end()
+{
+  record('E', NULL, NULL);
+}
+
+void trace_thread_name(const char *name)
+{
+  threadBuffer *b = buffer();
+  lock_guard<mutex> l(bufferLock);
+  b->name = name;
+}
+
+void trace_start(const char *_filename)
+{
+  static bool registered = false;
+  lock_guard<mutex> l(bufferLock);
+  if (tracing)
+    return;
+  // Drop whatever was recorded after the last capture stopped
+  for (threadBuffer *b : buffers)
+    consume(b, [](const traceEvent &) {});
+  filename = _filename;
+  if (!registered)
+    {
+      atexit(write_at_exit);
+      registered = true;
+    }
+  tracing = true;
+  printf("Tracing to %s\n", filename.c_str());
+}
+
+void trace_stop()
+{
+  lock_guard<mutex> l(bufferLock);
+  if (!tracing)
+    return;
+  tracing = false;
+
+  FILE *f = fopen(filename.c_str(), "w");
+  if (!f)
+    {
+      printf("Failed to open %s\n", filename.c_str());
+      return;
+    }
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  size_t events = 0;
+  for (threadBuffer *b : buffers)
+    {
+      fprintf(f, "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"",
+              events++ ? ",\n" : "", b->id);
+      write_escaped(f, b->name.empty() ? "thread" : b->name.c_str());
+      fprintf(f, "\"}}");
+      consume(b, [&](const traceEvent &e)
+              {
+                fprintf(f, ",\n{\"ph\": \"%c\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f", e.phase, b->id, e.nanoseconds / 1000.0);
+                if (e.name)
+                  fprintf(f, ", \"name\": \"%s\"", e.name);
+                if (e.detail[0])
+                  {
+                    fprintf(f, ", \"args\": {\"detail\": \"");
+                    write_escaped(f, e.detail);
+                    fprintf(f, "\"}");
+                  }
+                fprintf(f, "}");
+                events++;
+              });
+    }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  printf("Wrote %lu trace events to %s\n", events, filename.c_str());
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+
+/*
+  Timeline capture in the Chrome trace event format, viewable in
+  chrome://tracing or Perfetto. Every thread records begin and end events
+  into its own buffer without locks, and the buffers are only read when a
+  capture is written out. While no capture runs a zone costs one relaxed
+  atomic load.
+
+  Names must outlive the capture (string literals), details are copied.
+*/
+
+extern std::atomic<bool> tracing;
+
+inline bool trace_enabled() { return tracing.load(std::memory_order_relaxed); }
+
+// Start recording, the capture is written to filename when it stops
+void trace_start(const char *filename);
+// Stop recording and write the capture out, also called at exit
+void trace_stop();
+
+void trace_begin(const char *name, const char *detail = NULL);
+void trace_end();
+// Label the calling thread in the timeline
+void trace_thread_name(const char *name);
+
+// Traces the enclosing block
+class TraceZone
+{
+public:
+  TraceZone(const char *name, const char *detail = NULL) : active(trace_enabled())
+  {
+    if (active)
+      trace_begin(name, detail);
+  }
+  ~TraceZone()
+  {
+    if (active)
+      trace_end();
+  }
+
+private:
+  bool active;
+};
@@ -0,0 +1,95 @@
+#include <jobs.h>
+#include <transforms.h>
+
+void TransformBatch::clear()
+{
+  for (int e = 0; e < 16; e++)
+    model[e].clear();
+}
+
+size_t TransformBatch::add(const float *m)
+{
+  for (int e = 0; e < 16; e++)
+    model[e].push_back(m[e]);
+  return model[0].size() - 1;
+}
+
+// Inverse transpose of the upper 3x3, which is its cofactor matrix over the determinant
+static void normalMatrices(const float *__restrict a00, const float *__restrict a10, const float *__restrict a20,
+                           const float *__restrict a01, const float *__restrict a11, const float *__restrict a21,
+                           const float *__restrict a02, const float *__restrict a12, const float *__restrict a22,
+                           float *__restrict n00, float *__restrict n10, float *__restrict n20,
+                           float *__restrict n01, float *__restrict n11, float *__restrict n21,
+                           float *__restrict n02, float *__restrict n12, float *__restrict n22, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    float c00 = a11[i] * a22[i] - a12[i] * a21[i];
+    float c01 = a12[i] * a20[i] - a10[i] * a22[i];
+    float c02 = a10[i] * a21[i] - a11[i] * a20[i];
+    float c10 = a02[i] * a21[i] - a01[i] * a22[i];
+    float c11 = a00[i] * a22[i] - a02[i] * a20[i];
+    float c12 = a01[i] * a20[i] - a00[i] * a21[i];
+    float c20 = a01[i] * a12[i] - a02[i] * a11[i];
+    float c21 = a02[i] * a10[i] - a00[i] * a12[i];
+    float c22 = a00[i] * a11[i] - a01[i] * a10[i];
+    float invDet = 1.0f / (a00[i] * c00 + a01[i] * c01 + a02[i] * c02);
+    n00[i] = c00 * invDet; n10[i] = c10 * invDet; n20[i] = c20 * invDet;
+    n01[i] = c01 * invDet; n11[i] = c11 * invDet; n21[i] = c21 * invDet;
+    n02[i] = c02 * invDet; n12[i] = c12 * invDet; n22[i] = c22 * invDet;
+  }
+}
+
+void TransformBatch::compute(const float *vp, JobSystem *jobs)
+{
+  // Ranges small enough that every stream of one stays in L1
+  const size_t grain = 1024;
+  const size_t n = size();
+  if (!n)
+    return;
+  for (int e = 0; e < 16; e++)
+    mvp[e].resize(n);
+  for (int e = 0; e < 9; e++)
+    normal[e].resize(n);
+
+  if (!jobs || n <= grain) {
+    computeRange(vp, 0, n);
+    return;
+  }
+  jobs->parallelFor(n, grain, [this, vp](size_t first, size_t last) { computeRange(vp, first, last); }, "transform instances");
+}
+
+void TransformBatch::computeRange(const float *vp, size_t first, size_t last)
+{
+  const size_t n = last - first;
+
+  // mvp = vp * model, one output element stream at a time
+  for (int c = 0; c < 4; c++) {
+    const float *__restrict m0 = &model[4 * c + 0][first];
+    const float *__restrict m1 = &model[4 * c + 1][first];
+    const float *__restrict m2 = &model[4 * c + 2][first];
+    const float *__restrict m3 = &model[4 * c + 3][first];
+    for (int r = 0; r < 4; r++) {
+      const float v0 = vp[r], v1 = vp[r + 4], v2 = vp[r + 8], v3 = vp[r + 12];
+      float *__restrict out = &mvp[4 * c + r][first];
+      for (size_t i = 0; i < n; i++)
+        out[i] = v0 * m0[i] + v1 * m1[i] + v2 * m2[i] + v3 * m3[i];
+    }
+  }
+
+  normalMatrices(&model[0][first], &model[1][first], &model[2][first],
+                 &model[4][first], &model[5][first], &model[6][first],
+                 &model[8][first], &model[9][first], &model[10][first],
+                 &normal[0][first], &normal[1][first], &normal[2][first],
+                 &normal[3][first], &normal[4][first], &normal[5][first],
+                 &normal[6][first], &normal[7][first], &normal[8][first], n);
+}
+
+void TransformBatch::store(size_t i, float *mvpOut, float *modelOut, float *normalOut) const
+{
+  for (int e = 0; e < 16; e++) {
+    mvpOut[e] = mvp[e][i];
+    modelOut[e] = model[e][i];
+  }
+  for (int e = 0; e < 9; e++)
+    normalOut[e] = normal[e][i];
+}
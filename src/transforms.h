@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+class JobSystem;
+
+/*
+  Per-frame batch of instance transforms kept as structure-of-arrays, one
+  float stream per matrix element, so compute() runs as straight loops
+  the compiler can vectorize. Matrices are column-major like OpenGL.
+*/
+class TransformBatch
+{
+public:
+  void clear();
+  size_t size() const { return model[0].size(); }
+
+  // Append a model matrix, returns its index in the batch
+  size_t add(const float *m);
+
+  // Fill model-view-projection and normal matrices for every entry, large
+  // batches are split into ranges run as jobs when a job system is given
+  void compute(const float *viewProjection, JobSystem *jobs = NULL);
+
+  // Write out one entry as 4x4 mvp, 4x4 model and 3x3 normal matrices
+  void store(size_t i, float *mvpOut, float *modelOut, float *normalOut) const;
+
+private:
+  void computeRange(const float *viewProjection, size_t first, size_t last);
+
+  std::vector<float> model[16];
+  std::vector<float> mvp[16];
+  std::vector<float> normal[9];
+};
@@ -0,0 +1,82 @@
+/*
+  OcclusionCuller without a GPU: a wall is rasterized into the depth buffer
+  from a camera at the origin looking down -z, and boxes around it are
+  tested against the pyramid.
+*/
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <occlusion.h>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+  printf("%s: %s\n", condition ? "ok" : "FAILED", what);
+  if (!condition)
+    failures++;
+}
+
+// Column major, as gluPerspective
+static void perspective(float *m, float fovy, float aspect, float zNear, float zFar)
+{
+  float f = 1.0f / tanf(fovy * 0.5f);
+  memset(m, 0, 16 * sizeof(float));
+  m[0] = f / aspect;
+  m[5] = f;
+  m[10] = (zFar + zNear) / (zNear - zFar);
+  m[11] = -1;
+  m[14] = 2 * zFar * zNear / (zNear - zFar);
+}
+
+static bool box_visible(const OcclusionCuller &culler, float x0, float y0, float z0, float x1, float y1, float z1)
+{
+  const float lower[3] = { x0, y0, z0 }, upper[3] = { x1, y1, z1 };
+  return culler.visible(lower, upper);
+}
+
+int main()
+{
+  JobSystem jobs(1);
+  OcclusionCuller culler(&jobs);
+  float viewProjection[16];
+  // Same aspect as the 256 x 128 buffer
+  perspective(viewProjection, 60.0f * M_PI / 180.0f, 2.0f, 0.1f, 100.0f);
+  const float identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+
+  // Nothing rasterized yet, nothing can be hidden
+  culler.begin(viewProjection);
+  culler.finish();
+  check(box_visible(culler, -1, -1, -22, 1, 1, -20), "boxes are visible without occluders");
+
+  // A 10 x 10 wall 10 units ahead, covering x and y within 5 / 10 of the distance
+  OccluderMesh wall;
+  const float corners[12] = { -5, -5, -10, 5, -5, -10, 5, 5, -10, -5, 5, -10 };
+  const unsigned int quad[6] = { 0, 1, 2, 0, 2, 3 };
+  wall.positions.assign(corners, corners + 12);
+  wall.indices.assign(quad, quad + 6);
+  culler.addOccluder(identity, &wall);
+  culler.begin(viewProjection);
+  culler.finish();
+  check(culler.occluders() == 1 && culler.triangles() == 2, "the wall is rasterized");
+
+  int covered = 0;
+  for (int i = 0; i < culler.width() * culler.height(); i++)
+    covered += culler.depth()[i] > 0;
+  check(covered > 0 && covered < culler.width() * culler.height(), "the wall covers part of the depth buffer");
+
+  check(!box_visible(culler, -1, -1, -22, 1, 1, -20), "a box behind the wall is culled");
+  check(!box_visible(culler, 1, 1, -21, 4, 3, -19), "a box behind the wall off its middle is culled");
+  check(box_visible(culler, -1, -1, -6, 1, 1, -5), "a box in front of the wall is kept");
+  check(box_visible(culler, -1, -1, -12, 1, 1, -8), "a box through the wall is kept");
+  check(box_visible(culler, 8, -1, -22, 12, 1, -20), "a box reaching past the wall's edge is kept");
+  check(box_visible(culler, -1, -1, -1, 1, 1, 1), "a box through the near plane is kept");
+
+  // Occluders only last for the frame they were added to
+  culler.begin(viewProjection);
+  culler.finish();
+  check(box_visible(culler, -1, -1, -22, 1, 1, -20), "occluders are gone the next frame");
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,270 @@
+/*
+  Bookkeeping of TextureManager without a GPU: handles, use counts, content
+  dedupe, eviction of idle textures and downsampling in drawn order. GL is
+  replaced by fakes that track texture names and level 0 sizes, files by
+  names of the form "value_size" that decode to size x size texels of value.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <textures.h>
+
+using namespace std;
+
+static set<GLuint> liveTextures, liveBuffers;
+static vector<GLuint> freeTextures;
+static map<GLuint, int> textureWidth;
+static map<GLuint, vector<char> > bufferData;
+static GLuint boundTexture, boundBuffer, nextName = 1;
+
+// GL 1.1 comes from libGL
+extern "C" {
+void GLAPIENTRY glGenTextures(GLsizei n, GLuint *textures)
+{
+  for (int i = 0; i < n; i++)
+    {
+      // Names come back as soon as they are free, like drivers do
+      if (freeTextures.empty())
+        textures[i] = nextName++;
+      else
+        {
+          textures[i] = freeTextures.back();
+          freeTextures.pop_back();
+        }
+      liveTextures.insert(textures[i]);
+      textureWidth[textures[i]] = 0;
+    }
+}
+
+void GLAPIENTRY glDeleteTextures(GLsizei n, const GLuint *textures)
+{
+  for (int i = 0; i < n; i++)
+    {
+      if (!textures[i])
+        continue;
+      if (!liveTextures.erase(textures[i]))
+        {
+          printf("texture %u deleted twice\n", textures[i]);
+          exit(1);
+        }
+      freeTextures.push_back(textures[i]);
+    }
+}
+
+void GLAPIENTRY glBindTexture(GLenum, GLuint texture) { boundTexture = texture; }
+void GLAPIENTRY glTexParameteri(GLenum, GLenum, GLint) {}
+void GLAPIENTRY glPixelStorei(GLenum, GLint) {}
+void GLAPIENTRY glTexSubImage2D(GLenum, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, const void *) {}
+
+void GLAPIENTRY glTexImage2D(GLenum, GLint level, GLint, GLsizei width, GLsizei, GLint, GLenum, GLenum, const void *)
+{
+  if (!level)
+    textureWidth[boundTexture] = width;
+}
+
+void GLAPIENTRY glGetTexLevelParameteriv(GLenum, GLint level, GLenum name, GLint *value)
+{
+  *value = name == GL_TEXTURE_INTERNAL_FORMAT ? GL_RGBA8 : textureWidth[boundTexture] >> level;
+}
+}
+
+// Everything newer through the pointers GLEW resolves
+static void APIENTRY gen_buffers(GLsizei n, GLuint *buffers)
+{
+  for (int i = 0; i < n; i++)
+    {
+      buffers[i] = nextName++;
+      liveBuffers.insert(buffers[i]);
+    }
+}
+static void APIENTRY bind_buffer(GLenum, GLuint buffer) { boundBuffer = buffer; }
+static void APIENTRY buffer_data(GLenum, GLsizeiptr size, const void *, GLenum) { bufferData[boundBuffer].resize(size); }
+static void *APIENTRY map_buffer_range(GLenum, GLintptr, GLsizeiptr, GLbitfield) { return &bufferData[boundBuffer][0]; }
+static GLboolean APIENTRY unmap_buffer(GLenum) { return GL_TRUE; }
+static void APIENTRY delete_buffers(GLsizei n, const GLuint *buffers)
+{
+  for (int i = 0; i < n; i++)
+    liveBuffers.erase(buffers[i]);
+}
+static void APIENTRY generate_mipmap(GLenum) {}
+static void APIENTRY compressed_tex_image_2d(GLenum, GLint, GLenum, GLsizei, GLsizei, GLint, GLsizei, const void *) {}
+static void APIENTRY copy_image_sub_data(GLuint source, GLenum, GLint, GLint, GLint, GLint, GLuint target, GLenum, GLint,
+                                         GLint, GLint, GLint, GLsizei, GLsizei, GLsizei)
+{
+  if (!liveTextures.count(source) || !liveTextures.count(target))
+    {
+      printf("copy between deleted textures %u and %u\n", source, target);
+      exit(1);
+    }
+}
+static void APIENTRY tex_storage_2d(GLenum, GLsizei, GLenum, GLsizei width, GLsizei) { textureWidth[boundTexture] = width; }
+
+PFNGLGENBUFFERSPROC __glewGenBuffers = gen_buffers;
+PFNGLBINDBUFFERPROC __glewBindBuffer = bind_buffer;
+PFNGLBUFFERDATAPROC __glewBufferData = buffer_data;
+PFNGLMAPBUFFERRANGEPROC __glewMapBufferRange = map_buffer_range;
+PFNGLUNMAPBUFFERPROC __glewUnmapBuffer = unmap_buffer;
+PFNGLDELETEBUFFERSPROC __glewDeleteBuffers = delete_buffers;
+PFNGLGENERATEMIPMAPPROC __glewGenerateMipmap = generate_mipmap;
+PFNGLCOMPRESSEDTEXIMAGE2DPROC __glewCompressedTexImage2D = compressed_tex_image_2d;
+PFNGLCOPYIMAGESUBDATAPROC __glewCopyImageSubData = copy_image_sub_data;
+PFNGLTEXSTORAGE2DPROC __glewTexStorage2D = tex_storage_2d;
+GLboolean __GLEW_ARB_copy_image = GL_TRUE, __GLEW_ARB_texture_storage = GL_TRUE;
+
+// The parts of glstuff the loader uses
+bool decode_texture(const char *file, TextureImage &image)
+{
+  int value = atoi(file), size = atoi(strchr(file, '_') + 1);
+  image.width = image.height = size;
+  image.components = 4;
+  image.compressed = 0;
+  image.levels = 1;
+  image.bytes = (size_t) size * size * 4;
+  image.pixels = (unsigned char *) malloc(image.bytes);
+  memset(image.pixels, value, image.bytes);
+  return true;
+}
+
+GLenum texture_format(int) { return GL_RGBA; }
+size_t compressed_level_bytes(GLenum, int width, int height) { return ((width + 3) / 4) * ((height + 3) / 4) * 8; }
+void upload_compressed_texture(const TextureImage &, const unsigned char *) {}
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+  printf("%s: %s\n", condition ? "ok" : "FAILED", what);
+  if (!condition)
+    failures++;
+}
+
+static int width(const TextureManager &textures, int handle)
+{
+  return textureWidth[textures.name(handle)];
+}
+
+static void test_sharing(JobSystem *jobs)
+{
+  TextureManager textures(jobs);
+  int a = textures.acquire("1_64"), again = textures.acquire("1_64");
+  int copy = textures.acquire("1_64_copy"), other = textures.acquire("2_64");
+  textures.finish();
+  check(a == again, "the same file gets the same handle");
+  check(textures.count() == 2, "files with the same contents count once");
+  check(textures.name(a) == textures.name(copy) && textures.name(a) != textures.name(other),
+        "files with the same contents share a texture");
+
+  textures.release(a);
+  textures.release(again);
+  check(textures.count() == 2 && width(textures, copy) == 64, "a shared texture stays while one file still uses it");
+  textures.release(copy);
+  check(textures.count() == 1, "a shared texture goes with its last use");
+  textures.release(other);
+  check(textures.count() == 0 && !textures.used() && liveTextures.empty(), "released textures are deleted");
+}
+
+static void test_cancel(JobSystem *jobs)
+{
+  TextureManager textures(jobs);
+  int cancelled = textures.acquire("3_64");
+  GLuint name = textures.name(cancelled);
+  textures.release(cancelled);
+  int next = textures.acquire("4_64");
+  check(textures.name(next) == name, "the name of a cancelled load is handed out again");
+  textures.finish();
+  check(textures.count() == 1 && width(textures, next) == 64, "the cancelled load does not land on the new texture");
+  textures.release(next);
+}
+
+static void test_eviction(JobSystem *jobs)
+{
+  // 21 kb per 64 x 64 texture with mips, of which three fit, none of them small enough to shrink
+  TextureManager textures(jobs, 70 << 10);
+  vector<int> handles;
+  char file[32];
+  for (int i = 0; i < 6; i++)
+    {
+      snprintf(file, sizeof(file), "%d_64", 10 + i);
+      handles.push_back(textures.acquire(file));
+    }
+  textures.finish();
+
+  for (int frame = 0; frame <= TextureManager::idleFrames + 1; frame++)
+    {
+      textures.update();
+      for (int i = 0; i < 3; i++)
+        textures.use(handles[i]);
+    }
+  bool drawnKept = true, idleEvicted = true;
+  for (int i = 0; i < 6; i++)
+    {
+      if (i < 3)
+        drawnKept = drawnKept && width(textures, handles[i]) == 64;
+      else
+        idleEvicted = idleEvicted && width(textures, handles[i]) == 1;
+    }
+  check(drawnKept && idleEvicted, "idle textures are evicted, drawn ones kept");
+  check(textures.used() <= textures.budget(), "eviction brings usage under the budget");
+
+  textures.update();
+  textures.use(handles[5]);
+  textures.update();
+  textures.finish();
+  check(width(textures, handles[5]) > 1, "an evicted texture reloads once drawn again");
+
+  for (int handle : handles)
+    textures.release(handle);
+  check(textures.count() == 0 && !textures.used(), "evicted textures are released");
+}
+
+static void test_downsampling(JobSystem *jobs)
+{
+  // 341 kb per 256 x 256 texture with mips, one has to shrink
+  TextureManager textures(jobs, 1200 << 10);
+  int oldest = textures.acquire("20_256");
+  textures.update();
+  int newer[3] = { textures.acquire("21_256"), textures.acquire("22_256"), textures.acquire("23_256") };
+  textures.finish();
+  check(width(textures, oldest) == 128, "the least recently drawn texture loses its top level");
+  check(width(textures, newer[0]) == 256 && width(textures, newer[1]) == 256 && width(textures, newer[2]) == 256,
+        "recently drawn textures keep theirs");
+  check(textures.used() <= textures.budget(), "downsampling brings usage under the budget");
+
+  textures.release(oldest);
+  for (int handle : newer)
+    textures.release(handle);
+}
+
+static void test_teardown(JobSystem *jobs)
+{
+  // As on quit: some loads decoded and mapped into pixel buffers, the rest still decoding
+  {
+    TextureManager textures(jobs);
+    char file[32];
+    for (int i = 0; i < 8; i++)
+      {
+        snprintf(file, sizeof(file), "%d_128", 30 + i);
+        textures.acquire(file);
+      }
+    while (jobs->help())
+      ;
+    textures.update();
+  }
+  check(liveTextures.empty() && liveBuffers.empty(), "a manager destroyed mid-load deletes its textures and pixel buffers");
+}
+
+int main()
+{
+  JobSystem jobs(2);
+  test_sharing(&jobs);
+  test_cancel(&jobs);
+  test_eviction(&jobs);
+  test_downsampling(&jobs);
+  test_teardown(&jobs);
+  check(liveTextures.empty(), "no texture outlives its manager");
+  return failures ? 1 : 0;
+}